@@ -68,6 +68,33 @@ public:
 	bool rayIntersect(const Ray3f &ray, Intersection &its,
 		bool shadowRay = false) const;
 
+	/// Volume boundary crossed by a ray, see \ref rayIntersectBoundaries()
+	struct BoundaryHit {
+		float t;
+		const Mesh *mesh;
+	};
+
+	/**
+	 * \brief Shadow ray query through the scene media, in a single traversal
+	 *
+	 * Returns \c true as soon as a non-volumetric triangle is hit. Otherwise, the
+	 * volume boundaries crossed by the ray are stored (unsorted) in \c hits. When
+	 * there are more than \c maxHits of them, only the closest ones are kept and
+	 * \c truncated is set, the rest can be found with another query starting
+	 * at the farthest kept one.
+	 */
+	bool rayIntersectBoundaries(const Ray3f &ray, BoundaryHit *hits, int maxHits,
+		int &nHits, bool &truncated) const;
+
+	/**
+	 * \brief Distance from \c p to the closest triangle of any registered mesh
+	 *
+	 * Nodes farther than the closest triangle found so far are pruned, so it
+	 * only visits the neighbourhood of \c p. Returns \c maxDist if nothing is
+	 * closer than it
+	 */
+	float closestDistance(const Point3f &p, float maxDist = std::numeric_limits<float>::infinity()) const;
+
 	/// Return the total number of meshes registered with the BVH
 	n_UINT getMeshCount() const { return (n_UINT)m_meshes.size(); }
 
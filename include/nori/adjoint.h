@@ -0,0 +1,53 @@
+/*
+    Date: 19-1-2023
+    Authors: Pedro José Pérez García
+    Comms: Part of our nori extensions for the final assignment
+            of the course "Modelling and Simullation of Appearance",
+            Master in Robotics, Graphics and Computer Vision (MRGCV),
+            Universidad de Zaragoza, course 2022-2023
+*/
+
+#pragma once
+
+#include <nori/grid.h>
+#include <vector>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Coarse estimate of the radiance leaving the path vertices, for adjoint-driven Russian roulette and splitting
+ *
+ * A uniform grid over the scene bounds, every cell holds the mean luminance of the radiance
+ * scattered at the vertices that fell in it (surfaces and media alike, over all directions).
+ * Training goes in iterations, and unlike GuidingField every iteration adds to the means of
+ * the previous ones: the records are unbiased whatever roulette the paths used.
+ */
+class AdjointField {
+public:
+    /// An estimate of the luminance of the radiance leaving a vertex at p
+    struct Record {
+        Point3f p;
+        float value;
+    };
+
+    /// Starts over with empty cells over bbox, its longest axis split into resolution cells
+    void init(const BoundingBox3f& bbox, int resolution);
+
+    /// One training iteration: adds the records to the cells they fall in
+    void update(const std::vector<Record>& records);
+
+    /// Estimate at p, false if p is outside the grid or its cell has too few records
+    bool lookup(const Point3f& p, float& L) const;
+
+    /// Cells with enough records for lookup()
+    size_t getTrainedCount() const;
+
+private:
+    static constexpr uint32_t MinRecords = 4;
+
+    UniformGrid m_grid;
+    std::vector<double> m_sum;
+    std::vector<uint32_t> m_count;
+};
+
+NORI_NAMESPACE_END
@@ -0,0 +1,82 @@
+/*
+    Date: 19-1-2023
+    Authors: Pedro José Pérez García
+    Comms: Part of our nori extensions for the final assignment
+            of the course "Modelling and Simullation of Appearance",
+            Master in Robotics, Graphics and Computer Vision (MRGCV),
+            Universidad de Zaragoza, course 2022-2023
+*/
+
+#pragma once
+
+#include <nori/adjoint.h>
+#include <nori/sampler.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Adjoint-driven Russian roulette and splitting (Vorba and Krivanek 2016)
+ *
+ * The expected contribution of a path from a vertex at x on is its throughput times the learned
+ * estimate of the radiance leaving x (see AdjointField). The target is the mean radiance of the
+ * pixel of the path, learned by the same training passes: paths that fall below the weight window
+ * around it survive with probability proportional to their contribution, and paths above it are
+ * split. Vertices with no estimate at x are left to plain Russian roulette.
+ */
+class AdjointRRS {
+public:
+    AdjointRRS(int maxSplit = 1) : m_max_split(maxSplit) { }
+
+    /// Starts over with an empty adjoint estimate over bbox (see AdjointField::init()) and unknown pixels
+    void init(const BoundingBox3f& bbox, int resolution, const Vector2i& imageSize);
+
+    /// One training iteration: adds the records to the adjoint estimate, and the mean luminance of every
+    /// pixel in the iteration (x fastest) to the pixel estimates. Both average over all the iterations
+    void update(const std::vector<AdjointField::Record>& records, const std::vector<float>& pixelLuminance);
+
+    /// Cells of the adjoint estimate with enough records
+    size_t getTrainedCount() const { return m_field.getTrainedCount(); }
+
+    /// Mean luminance of the radiance through pixel, 0 if unknown (no training yet, or outside of the image)
+    float getPixelEstimate(const Point2i& pixel) const;
+
+    /**
+     * Returns the number of copies that go on from x (0 if the path was killed) for a path with
+     * throughput beta through a pixel with the given estimate, and weights beta for the roulette: the
+     * caller divides it among the copies (see split()). rouletteDone tells if the vertex was weighed
+     */
+    int copies(Sampler* sampler, const Point3f& x, float pixelEstimate, Color3f& beta, bool& rouletteDone) const;
+
+    /**
+     * Traces the copies beyond the first one of a path split at a vertex: continuation samples their
+     * continuations and trace their radiance. Divides path.beta among all of them, the first copy is
+     * left for the caller. State is the path state of the integrator, copied for every copy
+     */
+    template <typename State, typename Continuation, typename Trace>
+    static Color3f split(int copies, int bounces, State& path, const Continuation& continuation, const Trace& trace)
+    {
+        if(copies <= 1)
+            return Color3f(0.f);
+        path.beta /= (float)copies;
+        Color3f L(0.f);
+        for(int copy = 1; copy < copies; copy++)
+        {
+            State split = path;
+            split.bounces = bounces + 1;
+            Ray3f splitRay;
+            if(!continuation(split, splitRay))
+                continue;
+            L += trace(split, splitRay);
+        }
+        return L;
+    }
+
+private:
+    AdjointField m_field;
+    Vector2i m_image_size = Vector2i(0, 0);
+    std::vector<double> m_pixel_sum;
+    int m_iterations = 0;
+    int m_max_split;
+};
+
+NORI_NAMESPACE_END
@@ -0,0 +1,108 @@
+/*
+    Date: 19-1-2023
+    Authors: Pedro José Pérez García
+    Comms: Part of our nori extensions for the final assignment
+            of the course "Modelling and Simullation of Appearance",
+            Master in Robotics, Graphics and Computer Vision (MRGCV),
+            Universidad de Zaragoza, course 2022-2023
+*/
+
+#pragma once
+
+#include <nori/common.h>
+#include <tbb/mutex.h>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Process-wide, reference counted cache of immutable assets
+ *
+ * Scenes often reference the same file several times (i.e. the same .vol placed with
+ * different transforms, or a texture shared by many meshes). Objects that load files
+ * go through AssetCache<T>::instance().get(), keyed by the resolved path and every
+ * option that changes what gets loaded, so duplicates share a single copy in memory.
+ *
+ * The cache only keeps weak references: an asset is freed as soon as the last object
+ * using it goes away, the cache never extends its lifetime.
+ */
+template <typename T> class AssetCache {
+public:
+    typedef std::function<std::shared_ptr<T>()> Loader;
+
+    /// The process-wide cache of assets of type T
+    static AssetCache& instance()
+    {
+        static AssetCache cache;
+        return cache;
+    }
+
+    /// Returns the asset with this key, calling load() if nobody holds it right now.
+    /// The loader runs without the cache lock, so different assets can load in parallel
+    std::shared_ptr<T> get(const std::string& key, const Loader& load)
+    {
+        {
+            tbb::mutex::scoped_lock lock(m_mutex);
+            auto it = m_assets.find(key);
+            if(it != m_assets.end())
+            {
+                if(std::shared_ptr<T> asset = it->second.lock())
+                    return asset;
+            }
+        }
+
+        std::shared_ptr<T> asset = load();
+
+        tbb::mutex::scoped_lock lock(m_mutex);
+        auto it = m_assets.find(key);
+        if(it != m_assets.end())
+        {
+            // Another thread loaded it in the meantime, keep theirs
+            if(std::shared_ptr<T> other = it->second.lock())
+                return other;
+            it->second = asset;
+        }
+        else
+        {
+            purge();
+            m_assets[key] = asset;
+        }
+        return asset;
+    }
+
+    /// Removes `asset` from the cache if the caller holds the only reference to it, so that
+    /// it can be modified in place (i.e. reloaded with the next frame of a sequence).
+    /// Returns false if the asset is shared and must be left untouched
+    bool detach(const std::string& key, const std::shared_ptr<T>& asset)
+    {
+        tbb::mutex::scoped_lock lock(m_mutex);
+        if(asset.use_count() != 1)
+            return false;
+        auto it = m_assets.find(key);
+        if(it != m_assets.end() && it->second.lock() == asset)
+            m_assets.erase(it);
+        return true;
+    }
+
+private:
+    AssetCache() { }
+
+    /// Drops the entries whose asset was already freed. Requires the lock
+    void purge()
+    {
+        for(auto it = m_assets.begin(); it != m_assets.end(); )
+        {
+            if(it->second.expired())
+                it = m_assets.erase(it);
+            else
+                ++it;
+        }
+    }
+
+    tbb::mutex m_mutex;
+    std::unordered_map<std::string, std::weak_ptr<T>> m_assets;
+};
+
+NORI_NAMESPACE_END
@@ -0,0 +1,107 @@
+/*
+    Date: 19-1-2023
+    Authors: Pedro José Pérez García
+    Comms: Part of our nori extensions for the final assignment
+            of the course "Modelling and Simullation of Appearance",
+            Master in Robotics, Graphics and Computer Vision (MRGCV),
+            Universidad de Zaragoza, course 2022-2023
+*/
+
+#pragma once
+
+#include <nori/bbox.h>
+#include <nori/color.h>
+#include <nori/ray.h>
+#include <vector>
+
+NORI_NAMESPACE_BEGIN
+
+/// Segment of a photon path through the media (a short beam: it ends at the next collision)
+struct PhotonBeam {
+    Point3f o;
+    Vector3f d;
+    float length;
+    Color3f power;
+};
+
+/**
+ * \brief Bounding volume hierarchy over photon beams, for gathering them along camera rays
+ *
+ * Every beam is seen as a cylinder of the given radius around its segment, so a
+ * query returns the beams whose closest point to a camera ray segment lies within
+ * that radius (the support of a 1D beam-beam kernel).
+ */
+class BeamBVH {
+public:
+    /// Builds the hierarchy over beams, with blur radius `radius`
+    void build(std::vector<PhotonBeam>&& beams, float radius);
+
+    /**
+     * \brief Calls callback(beam, t, sinTheta) for every beam within the radius of ray in (0, tMax)
+     *
+     * t is the distance along ray of the closest point to the beam and sinTheta the sine of
+     * the angle between both. Beams (almost) parallel to the ray are skipped, the 1D kernel
+     * is singular there
+     */
+    template <typename Callback> void query(const Ray3f& ray, float tMax, const Callback& callback) const
+    {
+        if(m_nodes.empty())
+            return;
+        Ray3f segment(ray.o, ray.d, 0.f, tMax);
+        uint32_t stack[64];
+        int top = 0;
+        stack[top++] = 0;
+        while(top > 0)
+        {
+            uint32_t index = stack[--top];
+            const Node& node = m_nodes[index];
+            if(!node.bbox.rayIntersect(segment))
+                continue;
+            if(node.isLeaf())
+            {
+                for(uint32_t i = node.start; i < node.start + node.size; i++)
+                {
+                    // Closest points between the two lines, then both have to fall inside their segments
+                    const PhotonBeam& beam = m_beams[i];
+                    Vector3f w = ray.o - beam.o;
+                    float b = ray.d.dot(beam.d), d = ray.d.dot(w), e = beam.d.dot(w);
+                    float sin2 = 1.f - b * b;
+                    if(sin2 < 1e-4f)
+                        continue;
+                    float t = (b * e - d) / sin2;
+                    float v = (e - b * d) / sin2;
+                    if(t <= 0.f || t >= tMax || v <= 0.f || v >= beam.length)
+                        continue;
+                    if((ray(t) - (beam.o + v * beam.d)).squaredNorm() >= m_radius * m_radius)
+                        continue;
+                    callback(beam, t, std::sqrt(sin2));
+                }
+            }
+            else
+            {
+                stack[top++] = node.right;
+                stack[top++] = index + 1;
+            }
+        }
+    }
+
+    float getRadius() const { return m_radius; }
+
+    size_t size() const { return m_beams.size(); }
+
+private:
+    struct Node {
+        BoundingBox3f bbox;         /// Bounds of the beams below, grown by the radius
+        uint32_t start, size;       /// Leaves: range of m_beams
+        uint32_t right;             /// Inner nodes: index of the second child (the first one follows the node)
+        bool isLeaf() const { return size > 0; }
+    };
+
+    uint32_t buildRecursive(uint32_t start, uint32_t end, int depth);
+
+    std::vector<PhotonBeam> m_beams;
+    std::vector<Node> m_nodes;
+    float m_radius = 0.f;
+};
+
+NORI_NAMESPACE_END
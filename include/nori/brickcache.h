@@ -0,0 +1,84 @@
+/*
+    Date: 19-1-2023
+    Authors: Pedro José Pérez García
+    Comms: Part of our nori extensions for the final assignment
+            of the course "Modelling and Simullation of Appearance",
+            Master in Robotics, Graphics and Computer Vision (MRGCV),
+            Universidad de Zaragoza, course 2022-2023
+*/
+
+#pragma once
+
+#include <nori/common.h>
+#include <tbb/mutex.h>
+#include <functional>
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Bounded, thread-safe LRU cache of volume bricks
+ *
+ * Out-of-core volumes fault their bricks in on demand through this cache. There is
+ * a single instance per process (see instance()), shared by every volume, so that
+ * the memory budget holds no matter how many volumes the scene has.
+ *
+ * Bricks are handed out as shared pointers: evicting a brick that some thread is
+ * still reading only drops the cache reference, so readers never see freed memory.
+ */
+class BrickCache {
+public:
+    typedef std::vector<float> Brick;
+    typedef std::shared_ptr<const Brick> BrickRef;
+    typedef std::function<void(Brick&)> Loader;
+
+    /// The process-wide cache
+    static BrickCache& instance();
+
+    /// Unique id to build keys with, one per brick source (i.e. a volume file)
+    uint32_t registerSource();
+
+    /// Grows the memory budget of the cache (the budget never shrinks)
+    void reserve(size_t capacityBytes);
+
+    /// Returns brick `brick` of source `source`, calling load() to read it on a miss.
+    /// The loader runs without holding the cache lock, so several threads can read from disk at once
+    BrickRef get(uint32_t source, uint64_t brick, const Loader& load);
+
+    /// Drops every brick of a source (i.e. when the volume is reloaded or destroyed)
+    void evict(uint32_t source);
+
+    size_t getCapacity() const { return m_capacity; }
+    size_t getSize() const { return m_size; }
+
+private:
+    BrickCache() { }
+
+    struct Key {
+        uint32_t source;
+        uint64_t brick;
+        bool operator==(const Key& other) const { return source == other.source && brick == other.brick; }
+    };
+    struct KeyHash {
+        size_t operator()(const Key& key) const { return std::hash<uint64_t>()(key.brick * 0x9E3779B97F4A7C15ull ^ key.source); }
+    };
+    struct Entry {
+        BrickRef brick;
+        std::list<Key>::iterator lru;       /// Position in m_lru (front = most recently used)
+    };
+
+    /// Evicts least recently used bricks until the cache fits in its budget. Requires the lock
+    void shrink();
+
+    tbb::mutex m_mutex;
+    std::unordered_map<Key, Entry, KeyHash> m_bricks;
+    std::list<Key> m_lru;
+    size_t m_capacity = 0;
+    size_t m_size = 0;                      /// In bytes
+    uint32_t m_sources = 0;
+};
+
+NORI_NAMESPACE_END
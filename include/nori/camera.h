@@ -57,6 +57,15 @@ public:
         const Point2f &samplePosition,
         const Point2f &apertureSample) const = 0;
 
+    /**
+     * \brief Film position of the rays that leave the camera along
+     * direction \c d, the inverse of \ref sampleRay()
+     *
+     * \return
+     *    \c false if \c d falls outside of the film
+     */
+    virtual bool getPixelPosition(const Vector3f &d, Point2f &samplePosition) const = 0;
+
     /// Return the size of the output image in pixels
     const Vector2i &getOutputSize() const { return m_outputSize; }
 
@@ -191,7 +191,7 @@ public:
     }
 private:
     std::vector<float> m_cdf;
-    float m_sum, m_normalization;
+    float m_sum = 0.0f, m_normalization = 0.0f;
     bool m_normalized;
 };
 
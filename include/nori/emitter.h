@@ -127,6 +127,19 @@ public:
      */
     virtual Color3f eval(const EmitterQueryRecord &lRec) const = 0;
 
+    /**
+     * \brief Sample a ray leaving the emitter, for light tracing (i.e. photon shooting)
+     *
+     * \param ray               The sampled ray, leaving the emitter
+     * \param samplePosition    A uniformly distributed sample on \f$[0,1]^2\f$ for the origin
+     * \param sampleDirection   A uniformly distributed sample on \f$[0,1]^2\f$ for the direction
+     *
+     * \return The power carried by the ray: emitted radiance times the cosine at the origin,
+     *         divided by the joint density of origin and direction. Zero if the emitter
+     *         can't be sampled this way (the default)
+     */
+    virtual Color3f samplePhoton(Ray3f &ray, const Point2f &samplePosition, const Point2f &sampleDirection) const { return Color3f(0.f); }
+
     /**
      * \brief Virtual destructor
      * */
@@ -145,7 +158,8 @@ public:
 
 	EmitterType getEmitterType() const { return m_type; }
 
-	bool isDelta() const { return m_type == EmitterType::EMITTER_POINT; }
+	/// Lights that only light sampling can reach (the sun is no delta light, but too small to be hit)
+	bool isDelta() const { return m_type == EmitterType::EMITTER_POINT || m_type == EmitterType::EMITTER_DISTANT_DISK; }
 
 protected:
     /// Pointer to the mesh if the emitter is attached to a mesh
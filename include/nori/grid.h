@@ -0,0 +1,73 @@
+/*
+    Date: 19-1-2023
+    Authors: Pedro José Pérez García
+    Comms: Part of our nori extensions for the final assignment
+            of the course "Modelling and Simullation of Appearance",
+            Master in Robotics, Graphics and Computer Vision (MRGCV),
+            Universidad de Zaragoza, course 2022-2023
+*/
+
+#pragma once
+
+#include <nori/bbox.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Uniform grid over a bounding box, as used by the caches and majorant grids
+ *
+ * The longest axis of the box is split into `resolution` cells, and the other ones into as many
+ * cells of that size as fit (at least one), stretched a bit so that they cover the box exactly.
+ * Cells are indexed with x running fastest, then y, then z.
+ */
+struct UniformGrid {
+    BoundingBox3f bbox;
+    int cells[3] = {0, 0, 0};
+    Vector3f cellSize = Vector3f(0.f);
+
+    UniformGrid() { }
+
+    UniformGrid(const BoundingBox3f& bbox, int resolution) : bbox(bbox)
+    {
+        Vector3f extents = bbox.getExtents();
+        float size = extents.maxCoeff() / (float)std::max(1, resolution);
+        for(int i = 0; i < 3; i++)
+        {
+            cells[i] = size > 0.f ? std::max(1, (int)std::ceil(extents[i] / size - 1e-3f)) : 1;
+            cellSize[i] = extents[i] / cells[i];
+        }
+    }
+
+    size_t getCellCount() const { return (size_t)cells[0] * cells[1] * cells[2]; }
+
+    size_t index(int x, int y, int z) const { return ((size_t)z * cells[1] + y) * cells[0] + x; }
+
+    /// Corner of cell (x, y, z) closest to bbox.min
+    Point3f cellMin(int x, int y, int z) const
+    {
+        return bbox.min + Vector3f(x * cellSize.x(), y * cellSize.y(), z * cellSize.z());
+    }
+
+    /// p in cell units, measured from bbox.min (0 along the axes the grid is flat in)
+    Vector3f toLocal(const Point3f& p) const
+    {
+        Vector3f local(0.f);
+        for(int i = 0; i < 3; i++)
+            if(cellSize[i] > 0.f)
+                local[i] = (p[i] - bbox.min[i]) / cellSize[i];
+        return local;
+    }
+
+    /// Index of the cell holding p, -1 if p is outside the grid
+    int64_t cellAt(const Point3f& p) const
+    {
+        if(getCellCount() == 0 || !bbox.contains(p))
+            return -1;
+        int c[3];
+        for(int i = 0; i < 3; i++)
+            c[i] = cellSize[i] > 0.f ? std::min(cells[i] - 1, std::max(0, (int)((p[i] - bbox.min[i]) / cellSize[i]))) : 0;
+        return (int64_t)index(c[0], c[1], c[2]);
+    }
+};
+
+NORI_NAMESPACE_END
@@ -0,0 +1,88 @@
+/*
+    Date: 19-1-2023
+    Authors: Pedro José Pérez García
+    Comms: Part of our nori extensions for the final assignment
+            of the course "Modelling and Simullation of Appearance",
+            Master in Robotics, Graphics and Computer Vision (MRGCV),
+            Universidad de Zaragoza, course 2022-2023
+*/
+
+#pragma once
+
+#include <nori/bbox.h>
+#include <nori/dpdf.h>
+#include <vector>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Learned distribution of the radiance arriving at the scene media, for path guiding
+ *
+ * A kd-tree splits space adaptively (cells with many training records get split in
+ * two), and every cell holds a directional histogram over the sphere. The histogram
+ * is equal-area (cos(theta) x phi bins), so sampling a bin from its discrete pdf and
+ * then a uniform direction inside it is cheap, and so is evaluating the density.
+ *
+ * Training goes in iterations: the records of an iteration (radiance estimates that
+ * were sampled with the distributions of the previous one) replace the distributions
+ * of the cells they fall in, cells without records keep theirs.
+ */
+class GuidingField {
+public:
+    /// A radiance sample: an estimate of the radiance arriving at p from w, divided by the density w was sampled with
+    struct Record {
+        Point3f p;
+        Vector3f w;
+        float value;
+    };
+
+    /// Starts over with a single untrained cell covering bbox, cells are split when they get more than splitThreshold records
+    void init(const BoundingBox3f& bbox, size_t splitThreshold);
+
+    /// One training iteration: refines the tree where the records are dense and rebuilds the distributions from them
+    void update(const std::vector<Record>& records);
+
+    /// Whether the cell holding p has learned something (otherwise sample() and pdf() are useless there)
+    bool isTrained(const Point3f& p) const;
+
+    /// Samples a direction w at p, returns its density. The cell holding p has to be trained
+    float sample(const Point3f& p, const Point2f& sample, Vector3f& w) const;
+
+    /// Density of sampling w at p
+    float pdf(const Point3f& p, const Vector3f& w) const;
+
+    size_t getLeafCount() const { return m_leaves.size(); }
+
+private:
+    static constexpr int CosThetaBins = 8;
+    static constexpr int PhiBins = 16;
+    static constexpr int Bins = CosThetaBins * PhiBins;
+    static constexpr int MaxDepth = 24;
+
+    struct Node {
+        int axis;               /// Inner nodes: split axis, -1 for leaves
+        float split;            /// Inner nodes: split position along axis
+        uint32_t child;         /// Inner nodes: index of the first child (the second one follows it). Leaves: index into m_leaves
+        BoundingBox3f bbox;
+        int depth;
+    };
+
+    struct Leaf {
+        std::vector<float> histogram;   /// Accumulated record values of the current iteration
+        size_t count = 0;               /// Records of the current iteration
+        DiscretePDF dpdf;               /// Learned distribution over the bins, empty while untrained
+    };
+
+    /// Index into m_leaves of the cell holding p, -1 if p is outside the tree
+    int32_t leafAt(const Point3f& p) const;
+
+    /// Bin of direction w
+    int binOf(const Vector3f& w) const;
+
+    BoundingBox3f m_bbox;
+    size_t m_split_threshold = 0;
+    std::vector<Node> m_nodes;
+    std::vector<Leaf> m_leaves;
+};
+
+NORI_NAMESPACE_END
@@ -0,0 +1,65 @@
+/*
+    Date: 19-1-2023
+    Authors: Pedro José Pérez García
+    Comms: Part of our nori extensions for the final assignment
+            of the course "Modelling and Simullation of Appearance",
+            Master in Robotics, Graphics and Computer Vision (MRGCV),
+            Universidad de Zaragoza, course 2022-2023
+*/
+
+#pragma once
+
+#include <nori/common.h>
+
+NORI_NAMESPACE_BEGIN
+
+class Volume;
+
+/**
+ * \brief The media a point of a path is inside of, innermost last
+ *
+ * Fixed capacity and raw pointers (the scene owns the volumes), so paths can copy it
+ * and carry it around without allocating or touching reference counts. Crossing the
+ * boundary of a volume enters it, or leaves it if it was already in the stack. When
+ * no volume holds the point, the outer (enviromental) medium is the current one.
+ */
+class MediumStack {
+public:
+    static constexpr int Capacity = 8;
+
+    explicit MediumStack(const Volume* outer = nullptr) : m_outer(outer) { }
+
+    /// Medium the point is in: the innermost volume, or the outer medium
+    const Volume* current() const { return m_size > 0 ? m_media[m_size - 1] : m_outer; }
+
+    const Volume* getOuter() const { return m_outer; }
+
+    /// Crosses the boundary of volume. Entering more than Capacity nested volumes is ignored
+    void cross(const Volume* volume)
+    {
+        for(int i = m_size - 1; i >= 0; i--)
+        {
+            if(m_media[i] == volume)
+            {
+                for(int j = i; j < m_size - 1; j++)
+                    m_media[j] = m_media[j + 1];
+                m_size--;
+                return;
+            }
+        }
+        if(m_size < Capacity)
+            m_media[m_size++] = volume;
+    }
+
+    /// Volumes the point is in (the outer medium not included)
+    int size() const { return m_size; }
+
+    const Volume* operator[](int i) const { return m_media[i]; }
+
+private:
+    const Volume* m_media[Capacity];
+    int m_size = 0;
+    const Volume* m_outer;
+};
+
+NORI_NAMESPACE_END
@@ -127,10 +127,7 @@ public:
     const Emitter *getEmitter() const { return m_emitter; }
 
     /// Return a pointer to an attached volume
-    std::shared_ptr<Volume> getVolume() { return m_volume; }
-
-    /// Return a pointer to an attached volume (const version)
-    const std::shared_ptr<Volume> getVolume() const { return m_volume; }
+    const std::shared_ptr<Volume>& getVolume() const { return m_volume; }
 
     /// Return a pointer to the BSDF associated with this mesh
     const BSDF *getBSDF() const { return m_bsdf; }
@@ -93,6 +93,9 @@ public:
 
     virtual const Color3f get_mu_s() const = 0;
 
+    /// Average cosine between the propagation direction and the scattered one (0 for isotropic scattering)
+    virtual float getMeanCosine() const { return 0.f; }
+
     /**
      * \brief Return the type of object (i.e. Mesh/BSDF/etc.)
      * provided by this instance
@@ -32,6 +32,9 @@ class PropertyList {
 public:
     PropertyList() { }
 
+    /// Whether the property was specified at all
+    bool has(const std::string &name) const { return m_properties.find(name) != m_properties.end(); }
+
     /// Set a boolean property
     void setBoolean(const std::string &name, const bool &value);
     
@@ -0,0 +1,68 @@
+/*
+    Date: 19-1-2023
+    Authors: Pedro José Pérez García
+    Comms: Part of our nori extensions for the final assignment
+            of the course "Modelling and Simullation of Appearance",
+            Master in Robotics, Graphics and Computer Vision (MRGCV),
+            Universidad de Zaragoza, course 2022-2023
+*/
+
+#pragma once
+
+#include <nori/common.h>
+#include <nori/grid.h>
+#include <nori/color.h>
+#include <functional>
+#include <vector>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Sparse grid of in-scattered radiance inside the scene media
+ *
+ * Cells cover the bounds of the media, and only the cells where some medium has
+ * extinction store a value: the average over the sphere of the radiance arriving
+ * at the cell, estimated with pilot paths before rendering. Deep paths can then
+ * terminate into the cache at medium vertices instead of going on scattering.
+ *
+ * This is biased: the phase function is taken as isotropic at the cached vertices,
+ * and radiance is interpolated between cell centers.
+ */
+class RadianceCache {
+public:
+    /// Incident radiance at p from direction wi, estimated with a single path
+    typedef std::function<Color3f(Sampler*, const Point3f& p, const Vector3f& wi)> Estimator;
+
+    /// Whether a cell containing p has to be cached, i.e. some medium has extinction in it
+    typedef std::function<bool(const Point3f& p)> Occupancy;
+
+    /**
+     * \brief Builds the cache over bbox with the longest axis split into resolution cells
+     *
+     * Occupancy is tested at the center and corners of every cell. Every occupied cell
+     * gets samples estimates at uniformly distributed points and directions of the cell,
+     * computed in parallel with clones of sampler
+     */
+    void build(const BoundingBox3f& bbox, int resolution, int samples, const Sampler* sampler,
+        const Occupancy& occupied, const Estimator& estimate);
+
+    /// Interpolated in-scattered radiance at p (isotropic). False if no cached cell is near p
+    bool lookup(const Point3f& p, Color3f& L) const;
+
+    bool isBuilt() const { return !m_values.empty(); }
+
+private:
+    /// Index into m_values of cell (x, y, z), -1 if not cached
+    int32_t cellIndex(int x, int y, int z) const
+    {
+        if(x < 0 || y < 0 || z < 0 || x >= m_grid.cells[0] || y >= m_grid.cells[1] || z >= m_grid.cells[2])
+            return -1;
+        return m_index[m_grid.index(x, y, z)];
+    }
+
+    UniformGrid m_grid;
+    std::vector<int32_t> m_index;       /// Dense, one entry per cell
+    std::vector<Color3f> m_values;      /// Only for the occupied cells
+};
+
+NORI_NAMESPACE_END
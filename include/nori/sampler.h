@@ -77,6 +77,17 @@ public:
      */
     virtual void prepare(const ImageBlock &block) = 0;
 
+    /**
+     * \brief Prepare to generate samples for work that is not an image
+     * block (i.e. a cache cell or a batch of photons)
+     *
+     * The sampler is seeded like the block at offset (index, stream).
+     * Parallel loops seed every item by its index this way, instead of by
+     * the thread that happens to run it, so that their result does not
+     * depend on scheduling. stream tells apart different loops and passes.
+     */
+    void prepareStream(int index, int stream);
+
     /**
      * \brief Prepare to generate new samples
      * 
@@ -22,6 +22,8 @@
 #pragma once
 
 #include <nori/accel.h>
+#include <nori/volumebvh.h>
+#include <nori/mediumstack.h>
 
 NORI_NAMESPACE_BEGIN
 
@@ -70,9 +72,6 @@ public:
 	/// Return a the scene background
 	Color3f getBackground(const Ray3f& ray) const;
 
-    // Uniformly sample a volume 
-    const std::shared_ptr<Volume> sampleVolume(Sampler* sampler, std::vector<std::shared_ptr<Volume>> vols, float& pdf) const;
-
 	/// Sample emitter
 	const Emitter *sampleEmitter(float rnd, float &pdf) const;
 
@@ -88,10 +87,30 @@ public:
 		return m_enviromentalEmitter;
 	}
 
-    const std::shared_ptr<Volume> getEnviromentalVolumeMedium() const{
+    const std::shared_ptr<Volume>& getEnviromentalVolumeMedium() const{
         return m_enviromentalVolumeMedium;
     }
 
+    /// Return a reference to an array containing the volumes that emit light
+    const std::vector<std::shared_ptr<Volume>> &getEmissiveVolumes() const { return m_emissive_volumes; }
+
+    /// Uniformly sample an emissive volume (nullptr if there are none)
+    const Volume *sampleEmissiveVolume(float rnd, float &pdf) const;
+
+    /// Hierarchy over the bounds of the scene media, to track all overlapping media at once
+    const VolumeBVH &getVolumeBVH() const { return m_volume_bvh; }
+
+    /// Return the animation frame currently loaded in the scene volumes
+    int getFrame() const { return m_frame; }
+
+    /**
+     * \brief Load the given frame of every animated volume in the scene
+     *
+     * Must not be called while rendering. With prefetchNext, frame + 1
+     * is loaded in the background while the current frame renders
+     */
+    void setFrame(int frame, bool prefetchNext = false);
+
     /**
      * \brief Intersect a ray against all triangles stored in the scene
      * and return detailed intersection information
@@ -124,11 +143,33 @@ public:
      *
      * \return \c true if an intersection with a non-volumetric mesh was found
      */
-    bool rayIntersectThroughVolumes(Sampler* sampler, const Ray3f &ray, const Point3f& xt, Intersection& its_out, std::shared_ptr<Volume> startVol, std::vector<VolumetricSegmentRecord>& segs) const;
+    bool rayIntersectThroughVolumes(Sampler* sampler, const Ray3f &ray, const Point3f& xt, Intersection& its_out, const MediumStack& media, std::vector<VolumetricSegmentRecord>& segs) const;
 
-    bool rayIntersectThroughVolumes(Sampler* sampler, const Ray3f &ray, Intersection& its_out, std::shared_ptr<Volume> startVol, std::vector<VolumetricSegmentRecord>& segs) const;
+    bool rayIntersectThroughVolumes(Sampler* sampler, const Ray3f &ray, Intersection& its_out, const MediumStack& media, std::vector<VolumetricSegmentRecord>& segs) const;
 
-    bool shadowRayThroughVolumes(Sampler* sampler, const Ray3f& sray, std::shared_ptr<Volume> startVol, std::vector<VolumetricSegmentRecord>& segs_shadow, float& t) const;
+    /**
+     * \brief Transmittance from p to q, or 0 if a surface is in between
+     *
+     * A single traversal of the BVH tells whether some surface occludes the segment
+     * (and stops right there) and finds the volume boundaries along it. Then the media
+     * are tracked between the boundaries in order, starting in the media of p and crossing
+     * each boundary like paths do, or with combinedMedia all at once through
+     * the VolumeBVH. Once the transmittance is negligible, Russian roulette ends the
+     * tracking early.
+     */
+    Color3f transmittanceTo(Sampler* sampler, const Point3f& p, const Point3f& q, const MediumStack& media,
+        int lod, bool combinedMedia) const;
+
+    /**
+     * \brief Intersect a ray against the non-volumetric geometry only,
+     * going through the boundaries of the volumes
+     *
+     * its.t is the distance along the original ray. Meant to be used
+     * together with the VolumeBVH, which handles the media themselves
+     *
+     * \return \c true if an intersection with a non-volumetric mesh was found
+     */
+    bool rayIntersectSurface(const Ray3f &ray, Intersection &its) const;
 
     /**
      * \brief Intersect a ray against all triangles stored in the scene
@@ -174,8 +215,11 @@ private:
     std::vector<Mesh *> m_meshes;
 	std::vector<Emitter *> m_emitters;
 	std::vector<std::shared_ptr<Volume>> m_volumes;
+	std::vector<std::shared_ptr<Volume>> m_emissive_volumes;
+    VolumeBVH m_volume_bvh;
 	Emitter *m_enviromentalEmitter = nullptr;
     std::shared_ptr<Volume> m_enviromentalVolumeMedium;
+    int m_frame;
 	
     Integrator *m_integrator = nullptr;
     Sampler *m_sampler = nullptr;
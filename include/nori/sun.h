@@ -0,0 +1,62 @@
+/*
+    Date: 19-1-2023
+    Authors: Pedro José Pérez García
+    Comms: Part of our nori extensions for the final assignment
+            of the course "Modelling and Simullation of Appearance",
+            Master in Robotics, Graphics and Computer Vision (MRGCV),
+            Universidad de Zaragoza, course 2022-2023
+*/
+
+#pragma once
+
+#include <nori/emitter.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Distant disk light, i.e. the sun
+ *
+ * Lights from the directions within angular_radius of direction, with the given irradiance (at normal
+ * incidence). Sampling picks a direction of the disk uniformly, so shadows are soft. The disk is too
+ * small to be found by chance, so like point lights it is only reached by light sampling (see isDelta()).
+ * The atmosphere takes care of its transmittance, and lights its sky with it (see VolumeAtmosphere).
+ */
+class SunEmitter : public Emitter
+{
+public:
+    SunEmitter(const PropertyList &props);
+
+    virtual std::string toString() const;
+
+    // Only reached through sample(), like point lights
+    virtual Color3f eval(const EmitterQueryRecord & lRec) const
+    {
+        return 0.;
+    }
+
+    virtual Color3f sample(EmitterQueryRecord & lRec, const Point2f & sample, float optional_u) const;
+
+    virtual float pdf(const EmitterQueryRecord &lRec) const
+    {
+        return 1.;
+    }
+
+    /// Direction towards the sun
+    const Vector3f& getDirection() const { return m_direction; }
+
+    /// Irradiance at normal incidence
+    const Color3f& getIrradiance() const { return m_irradiance; }
+
+    float getAngularRadius() const { return m_angular_radius; }
+
+protected:
+    /// Distance of the sampled points, beyond any scene
+    static constexpr float Distance = 1e10f;
+
+    Vector3f m_direction;
+    Color3f m_irradiance;
+    float m_angular_radius;
+    float m_cos_max;
+};
+
+NORI_NAMESPACE_END
@@ -0,0 +1,65 @@
+/*
+    Date: 19-1-2023
+    Authors: Pedro José Pérez García
+    Comms: Part of our nori extensions for the final assignment
+            of the course "Modelling and Simullation of Appearance",
+            Master in Robotics, Graphics and Computer Vision (MRGCV),
+            Universidad de Zaragoza, course 2022-2023
+*/
+
+#pragma once
+
+#include <nori/common.h>
+#include <nori/grid.h>
+#include <nori/color.h>
+#include <functional>
+#include <vector>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Transmittance towards one light, cached on a grid over the scene media (a deep shadow volume)
+ *
+ * Every grid vertex stores the transmittance from the vertex to the light through all
+ * the media, averaged over points of the light, so shadow rays from medium vertices
+ * can read it instead of tracking the whole way through dense grids. Surfaces are not
+ * taken into account, occlusion is still tested with the shadow ray.
+ *
+ * On its own it is biased (interpolated, and averaged over the light), see the
+ * integrator for the stochastic correction that removes the bias.
+ */
+class TransmittanceCache {
+public:
+    /// Transmittance from p to the light, estimated with a single shadow ray
+    typedef std::function<Color3f(Sampler*, const Point3f& p)> Estimator;
+
+    /**
+     * \brief Builds the cache over bbox with the longest axis split into resolution cells
+     *
+     * Every grid vertex averages samples estimates, computed in parallel with clones of
+     * sampler. seed tells apart the sampler streams of different caches
+     */
+    void build(const BoundingBox3f& bbox, int resolution, int samples, const Sampler* sampler, int seed,
+        const Estimator& estimate);
+
+    /// Interpolated transmittance to the light from p. False if p is outside the cache
+    bool lookup(const Point3f& p, Color3f& tr) const;
+
+    bool isBuilt() const { return !m_values.empty(); }
+
+private:
+    const Color3f& vertex(int x, int y, int z) const
+    {
+        return m_values[vertexIndex(x, y, z)];
+    }
+
+    size_t vertexIndex(int x, int y, int z) const
+    {
+        return ((size_t)z * (m_grid.cells[1] + 1) + y) * (m_grid.cells[0] + 1) + x;
+    }
+
+    UniformGrid m_grid;
+    std::vector<Color3f> m_values;      /// One entry per grid vertex
+};
+
+NORI_NAMESPACE_END
@@ -18,29 +18,75 @@
 NORI_NAMESPACE_BEGIN
 
 /**
- * \brief Superclass for volumes (TODO: openVDB / 3d perlin noise textures support)
+ * \brief Superclass for volumes (.vol grids, see VolumeVDB, and procedural noise, see VolumeProcedural)
  */
 class Volume : public NoriObject
 {
 public:
 
-    virtual Point3f samplePathStep(const Ray3f& ray, const Intersection& its, Sampler*& sampler, Color3f& _beta, std::shared_ptr<Volume>& nextVolume, std::shared_ptr<Volume>& currentVolume, bool& sampledMedium) const = 0;
+    /// Samples the next path vertex along ray, in this medium up to its (sampledMedium is false if its.p was reached,
+    /// the caller then crosses the boundary there, if any). lod selects a coarser level of detail of the density (if any),
+    /// see Volumedatabase::sample_density()
+    virtual Point3f samplePathStep(const Ray3f& ray, const Intersection& its, Sampler*& sampler, Color3f& _beta, bool& sampledMedium, int lod = 0) const = 0;
 
     virtual float pdfFail(const Point3f& xz, const float& z, const Vector2f& sample) const = 0;
 
-    virtual Color3f transmittance(Sampler*& sampler, const Point3f& x0, const Point3f& xz) const = 0;
+    virtual Color3f transmittance(Sampler*& sampler, const Point3f& x0, const Point3f& xz, int lod = 0) const = 0;
 
     virtual Color3f sample_mu_t(const Point3f& p_world) const = 0;
 
     virtual Color3f sample_mu_a(const Point3f& p_world) const = 0;
 
-    const std::shared_ptr<PhaseFunction> getPhaseFunction() const
+    /// Extinction at p_world as tracked by samplePathStep(), for tracking overlapping media together (see VolumeBVH)
+    virtual Color3f extinction(const Point3f& p_world, int lod = 0) const { return mu_t; }
+
+    /// Upper bound of every channel of extinction() over the whole volume
+    virtual float getMajorant(int lod = 0) const { return mu_t.maxCoeff(); }
+
+    /// Whether the volume emits light (see emission())
+    virtual bool isEmissive() const { return false; }
+
+    /// Emitted radiance per unit length at p_world (the source term of the RTE, already scaled by mu_a)
+    virtual Color3f emission(const Point3f& p_world) const { return Color3f(0.f); }
+
+    /// Emission divided by the extinction that samplePathStep() tracks. That is, the weight of
+    /// the collision estimator of the emission at a medium interaction sampled by samplePathStep()
+    virtual Color3f emissionAtCollision(const Point3f& p_world) const { return Color3f(0.f); }
+
+    /// Samples a point p proportionally to the emission, for next event estimation.
+    /// Returns emission(p), pdf is with respect to world space volume (0 if nothing was sampled)
+    virtual Color3f sampleEmission(Sampler* sampler, Point3f& p, float& pdf) const { pdf = 0.f; return Color3f(0.f); }
+
+    /// Whether the in-scattering of the volume is precomputed (see precomputedScattering()), so paths
+    /// go through it without scattering, like the atmosphere (see VolumeAtmosphere)
+    virtual bool isPrecomputed() const { return false; }
+
+    /// In-scattered radiance along ray up to tMax (infinity if nothing is hit), with the transmittance of the segment in tr
+    virtual Color3f precomputedScattering(const Ray3f& ray, float tMax, Color3f& tr) const { tr = Color3f(1.f); return Color3f(0.f); }
+
+    /**
+     * \brief Select the frame of an animated volume (no-op for static ones)
+     *
+     * Must be called between renders, never while one is in progress.
+     * If prefetchNext is set, the volume may start loading frame + 1
+     * in the background so that it is ready for the next call
+     */
+    virtual void setFrame(int frame, bool prefetchNext) { }
+
+    const std::shared_ptr<PhaseFunction>& getPhaseFunction() const
     {
         /// WARNING: Might be nullptr, programmer has to check it
         /// TODO: He comprobado y aunque pueda ser nullptr, yo no lo leo mal nunca y siempre está inicializado
         return m_phase_function;
     }
 
+    /// Single scattering albedo, mu_s / mu_t (0 in the channels without extinction)
+    Color3f getAlbedo() const
+    {
+        Color3f mu_s = m_phase_function->get_mu_s();
+        return Color3f(mu_t.x() > 0.f ? mu_s.x() / mu_t.x() : 0.f, mu_t.y() > 0.f ? mu_s.y() / mu_t.y() : 0.f, mu_t.z() > 0.f ? mu_s.z() / mu_t.z() : 0.f);
+    }
+
     const bool isHeterogeneous() const
     {
         return m_heterogeneous;
@@ -77,7 +123,7 @@ struct VolumetricSegmentRecord {
 
         /// We choose only one volume for every segment
         ///     Using some importance sampling technique
-        std::shared_ptr<Volume> segment_vol;
+        const Volume* segment_vol = nullptr;
 
         /// This makes it have an associated pdf
         float vol_pdf = 1.f;
@@ -86,7 +132,7 @@ struct VolumetricSegmentRecord {
 
         /// Create a new record
         VolumetricSegmentRecord(const Point3f& x0, const Point3f& xs,
-            const std::shared_ptr<Volume>& segment_vol, const float& vol_pdf)
+            const Volume* segment_vol, const float& vol_pdf)
             : x0(x0), xs(xs), segment_vol(segment_vol), vol_pdf(vol_pdf) 
             { }
 };
@@ -0,0 +1,113 @@
+/*
+    Date: 19-1-2023
+    Authors: Pedro José Pérez García
+    Comms: Part of our nori extensions for the final assignment
+            of the course "Modelling and Simullation of Appearance",
+            Master in Robotics, Graphics and Computer Vision (MRGCV),
+            Universidad de Zaragoza, course 2022-2023
+*/
+
+#pragma once
+
+#include <nori/volume.h>
+#include <nori/bbox.h>
+#include <functional>
+#include <vector>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Bounding volume hierarchy over the regions of the scene media
+ *
+ * Every region is the world space bounding box of a volume mesh, together with a
+ * majorant of the extinction of its volume. Nodes store the sum of the majorants
+ * below them, which bounds the combined extinction anywhere inside the node, so
+ * empty subtrees are skipped and a ray gets a piecewise constant majorant of all
+ * the media it crosses in a single traversal.
+ *
+ * On top of it, free-flight sampling and transmittance track the summed extinction
+ * of all the overlapping media at once (spectral delta/ratio tracking), instead of
+ * tracking one medium per segment between boundaries. Media are assumed to fill
+ * the bounding box of their mesh. Grid media are empty outside their grid anyway,
+ * and volume meshes are boxes in practice.
+ *
+ * An optional global medium (the enviromental one) adds its extinction everywhere.
+ */
+class VolumeBVH {
+public:
+    struct Region {
+        BoundingBox3f bbox;
+        std::shared_ptr<Volume> volume;
+        float majorant;
+    };
+
+    /// Regions the hierarchy takes, so that the scratch space of a ray (the boundaries it crosses,
+    /// the media at a point) fits in fixed-size arrays on the stack
+    static constexpr uint32_t MaxRegions = 64;
+
+    /// Builds the hierarchy. Regions with a zero majorant are dropped, and there can be at most MaxRegions left
+    void build(std::vector<Region> regions, const std::shared_ptr<Volume>& global);
+
+    /// Whether there is any medium to track at all
+    bool empty() const { return m_regions.empty() && !m_global; }
+
+    /**
+     * \brief Samples a real collision along ray within (0, tMax), with every overlapping medium at once
+     *
+     * Returns true if a collision was sampled at ray(t), in medium `medium`. weight is
+     * the throughput of the null collisions up to t (1 for gray media). If a collision was sampled,
+     * albedo is the weight of the real one (mu_s / mu_t of the medium, for gray media)
+     */
+    bool sampleCollision(Sampler* sampler, const Ray3f& ray, float tMax, int lod, float& t,
+        const Volume*& medium, Color3f& weight, Color3f& albedo) const;
+
+    /// Ratio tracking estimate of the transmittance along ray within (0, tMax)
+    Color3f transmittance(Sampler* sampler, const Ray3f& ray, float tMax, int lod) const;
+
+    /// Summed extinction of the media at p
+    Color3f extinction(const Point3f& p, int lod) const;
+
+    /// Summed emission of the media at p divided by their summed (channel averaged) extinction,
+    /// the weight of the collision estimator at a real collision sampled by sampleCollision()
+    Color3f emissionAtCollision(const Point3f& p, int lod) const;
+
+    /// Summed in-scattering of the media at p: mu_s(p) of every medium times phase(medium),
+    /// its phase function value for the directions at hand
+    Color3f inScattering(const Point3f& p, int lod, const std::function<float(const Volume&)>& phase) const;
+
+    /// Narrows [tMin, tMax] to the span of ray that crosses some medium. False if none does
+    bool clip(const Ray3f& ray, float& tMin, float& tMax) const;
+
+private:
+    struct Node {
+        BoundingBox3f bbox;
+        float majorant;             /// Sum of the majorants of the regions below
+        uint32_t start, size;       /// Leaves: range of m_regions
+        uint32_t right;             /// Inner nodes: index of the second child (the first one follows the node)
+        bool isLeaf() const { return size > 0; }
+    };
+
+    /// Interval of the ray with a constant majorant
+    struct Segment {
+        float t0, t1, majorant;
+    };
+
+    /// Every region the ray pierces adds two boundaries, plus the trailing segment of the global medium
+    static constexpr uint32_t MaxSegments = 2 * MaxRegions + 1;
+
+    uint32_t buildRecursive(uint32_t start, uint32_t end);
+
+    /// Splits [0, tMax] into the intervals where the summed majorant of the regions pierced by the ray is constant.
+    /// Returns how many of segments (at most MaxSegments) were written
+    uint32_t majorantSegments(const Ray3f& ray, float tMax, Segment* segments) const;
+
+    /// Calls callback(region) for every region that contains p
+    template <typename Callback> void forEachRegionAt(const Point3f& p, const Callback& callback) const;
+
+    std::vector<Region> m_regions;
+    std::vector<Node> m_nodes;
+    std::shared_ptr<Volume> m_global;
+    float m_global_majorant = 0.f;
+};
+
+NORI_NAMESPACE_END
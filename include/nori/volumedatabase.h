@@ -11,28 +11,160 @@
 
 #include <fstream>
 #include <nori/bbox.h>
+#include <nori/brickcache.h>
+#include <nori/color.h>
 #include <nori/common.h>
+#include <nori/dpdf.h>
+#include <nori/intersection.h>
+#include <tbb/mutex.h>
 #include <string>
+#include <vector>
 
 NORI_NAMESPACE_BEGIN
 
+/// How the voxels of the full resolution grid are kept in memory
+struct VolumeStorageOptions {
+    /// Instead of loading the whole grid, split it into zlib compressed bricks in a companion
+    /// file (<filename>.zvol, created on first use) and fault them in through the BrickCache.
+    /// .zvol files are always loaded out of core. Only level 0 is bricked: the coarser levels of the
+    /// mip pyramid (avg and max, see MipLevel) stay in RAM on top of cache_bytes, about 2/7 of the
+    /// density grid: out of core grids may be up to some 3.5x the RAM left after the cache
+    bool out_of_core = false;
+    int brick_size = 32;                        /// Voxels per side of a brick (rounded up to even)
+    size_t cache_bytes = (size_t)512 << 20;     /// Budget of the (process-wide) brick cache
+};
+
 class Volumedatabase {
     public:
 
-        Volumedatabase(const std::string& filename, const Transform& trafo);
+        /// Two level sampling CDF of a grid, see buildSamplingCDF(). It lives with whoever samples the grid:
+        /// grids are shared (see AssetCache) and read only once loaded, while the CDF depends on the weight
+        struct SamplingCDF {
+            int32_t bricks[3] = {0, 0, 0};
+            DiscretePDF brickCDF;
+            std::vector<DiscretePDF> voxelCDFs;         /// Bricks with no weight have an empty one
+        };
+
+        Volumedatabase(const std::string& filename, const VolumeStorageOptions& storage = VolumeStorageOptions());
+        ~Volumedatabase();
+
+        /// Builds the database from an in-memory grid (i.e. a baked procedural volume).
+        /// data is indexed as in .vol files, ((z*cellsY + y)*cellsX + x)*channels + c, and bbox is in world space
+        Volumedatabase(std::vector<float>&& data, int cellsX, int cellsY, int cellsZ, int channels, const BoundingBox3f& bbox);
+
+        /// Loads another .vol file (i.e. the next frame of a sequence) into this database,
+        /// reusing the already allocated buffers whenever they are big enough
+        void reload(const std::string& filename);
+
+        /// File the grid was loaded from ("<memory>" for in-memory grids)
+        const std::string& getFilename() const { return m_volfilename; }
+
+        /// Sequences are given as a filename with a run of '#' (i.e. smoke_####.vol),
+        /// which gets replaced by the zero padded frame number
+        static bool isSequencePattern(const std::string& filename);
+        static std::string frameFilename(const std::string& pattern, int frame);
+
+        /// Density lookup. lod selects a level of the mip pyramid (0 is the full resolution grid)
+        Color3f sample_density(const Point3f& pos_world, int lod = 0);
+
+        /// Conservative (max) density over the footprint of the voxel of level lod containing pos_world
+        Color3f sample_majorant(const Point3f& pos_world, int lod = 0);
+
+        /// Free-flight sampling. If control > 0, decomposition tracking is used: the control density
+        /// is sampled analytically as a homogeneous medium and only the residual is delta tracked.
+        /// control is a single density for the whole grid, so it has to be at most getMinDensity(lod)
+        Point3f samplePathStep(const Ray3f& ray, const Intersection& its, Sampler* sampler, const Color3f& mu_s, const Color3f& mu_t, const float& control, Color3f& _beta, bool& sampledMedium, int lod = 0);
+
+        /// Ratio tracking, with the same (optional) control density as samplePathStep()
+        Color3f ratioTracking(Sampler* sampler, const Point3f& x0, const Point3f& xz, const float& mu_t, const float& control, int lod = 0);
+
+        /// Ratio tracking over ray(t), t in [0, tMax]. ray.d does not need to be normalized, distances are measured in t
+        /// (i.e. a world space ray taken to grid space keeps the distances of world space)
+        Color3f ratioTracking(Sampler* sampler, const Ray3f& ray, float tMax, const float& mu_t, const float& control, int lod = 0);
+
+        /// Minimum and maximum density stored in a level of the mip pyramid. Coarser levels are averages,
+        /// so their range is always contained in the one of level 0
+        float getMinDensity(int lod = 0) const { return m_mips[clampLOD(lod)].min; }
+        float getMaxDensity(int lod = 0) const { return m_mips[clampLOD(lod)].max_avg; }
+
+        /// Max over the full resolution voxels overlapping box (in grid space) of the average of their channels
+        float maxDensityIn(const BoundingBox3f& box) const;
+
+        /// Number of levels of the mip pyramid (including the full resolution grid)
+        int getLODCount() const { return (int)m_mips.size(); }
+
+        /// Builds a two level CDF (bricks, then voxels inside the brick) of the full resolution grid,
+        /// proportional to the average of its channels, times the max of `weight` over every voxel if given
+        /// (i.e. the density of an emission grid). Returns false if the product is zero everywhere
+        bool buildSamplingCDF(SamplingCDF& cdf, const Volumedatabase* weight = nullptr) const;
 
-        Color3f sample_density(const Point3f& pos_world);
+        /// Samples a point proportionally to the (piecewise constant) grid, with a CDF built by buildSamplingCDF().
+        /// pdf is with respect to volume in grid space
+        Point3f sampleVoxel(const SamplingCDF& cdf, Sampler* sampler, float& pdf) const;
 
-        Point3f samplePathStep(const Ray3f& ray, const Intersection& its, Sampler* sampler, const Color3f& mu_s, const Color3f& mu_t, Color3f& _beta, bool& sampledMedium);
+        /// Crops the (in core) grid to the smallest box holding every non-zero voxel, keeping one voxel
+        /// of margin wherever the grid had it, so that the border stays empty. Lossless, the bounding box
+        /// shrinks along with the grid. Returns false (leaving the grid untouched) if it is empty everywhere
+        bool cropToActive();
 
-        Color3f ratioTracking(Sampler* sampler, const Point3f& x0, const Point3f& xz, const float& mu_t);
+        /// Writes the (in core) grid as an optimized .vol, see loadVOLfile(), so that loading
+        /// it takes no pass over the voxels. Used by the voloptimize tool
+        void writeOptimizedVOL(const std::string& filename);
 
     private:
 
+        /// Loads a .vol or a .zvol, depending on the extension
+        void loadFile(const std::string& filename);
+
         //loadVOLdata loads the file into memory
         //readVOLdata stores the volume info in an appropiate way to use it later
         void loadVOLfile(const std::string& filename);
 
+        /// Reads the statistics and mip pyramid of an optimized (version 4) .vol, right after the
+        /// header of version 3. Returns the offset of the voxel data
+        uint64_t readOptimizedHeader(const std::string& filename);
+
+        /// Loads the header, brick index and mip pyramid of a .zvol. Bricks are read on demand
+        void loadZVOLfile(const std::string& filename);
+
+        /// Sets m_bbox from m_bb_*
+        void updateBoundingBox();
+
+        /// Computes mean/min/max (and whether the border is empty) of the full resolution grid and builds the mip pyramid
+        void computeStatistics();
+
+        /// Intersects the segment [tMin, tMax] of ray with the bounding box. Only when the border of the
+        /// grid is empty (the density outside is zero) and there is no control density, otherwise it is left as is.
+        /// Returns false if the segment misses the box
+        bool clipToBounds(const Ray3f& ray, float& tMin, float& tMax, float control) const;
+
+        /// Out-of-core mode: opens the .zvol companion of the .vol (writing it first if needed)
+        void openBricks(const std::string& filename, uint64_t dataOffset);
+
+        /// Splits the float payload of a .vol (at dataOffset) into compressed bricks, reading a slab
+        /// of bricks at a time, and appends the statistics and mip pyramid
+        void writeZVOL(const std::string& volFilename, uint64_t dataOffset, const std::string& zvolFilename);
+
+        /// Reads and decompresses brick number `brick` (padded to brick_size^3 voxels)
+        void readBrick(uint64_t brick, BrickCache::Brick& data) const;
+
+        /// Calls f(x0, y0, z0, nx, ny, nz, strideX, strideY, data) for blocks covering the full resolution grid,
+        /// where voxel (x0 + x, y0 + y, z0 + z) is data[((z*strideY + y)*strideX + x)*channels]. That is,
+        /// a single block for in-core grids and one per brick for out-of-core ones
+        template <typename F> void forEachBlock(const F& f) const;
+
+        /// Channels of voxel (x, y, z) of the full resolution grid (faulting its brick in when out of core)
+        const float* level0Voxel(int x, int y, int z) const;
+
+        /// Builds the average and max mip pyramids from VOL_data, halving the resolution at every level
+        void buildMipPyramid();
+
+        /// Voxel coordinates of level lod that contain pos_world (clamped to the grid)
+        void voxelCoords(const Point3f& pos_world, int lod, int& idx_x, int& idx_y, int& idx_z) const;
+
+        int clampLOD(int lod) const { return std::max(0, std::min(lod, (int)m_mips.size() - 1)); }
+
+
         template <typename T> T read(std::ifstream &f) {
             T v;
             f.read(reinterpret_cast<char *>(&v), sizeof(v));
@@ -46,7 +178,7 @@ class Volumedatabase {
         void convertVDBtoVOL(const std::string& filename, const std::string& gridname);
 
         template<typename T>
-        void writeGeneric(std::ofstream &f, T data)
+        void writeGeneric(std::ostream &f, T data)
         {
             f.write(reinterpret_cast<const char *>(&data), sizeof(data));
         }
@@ -60,9 +192,7 @@ class Volumedatabase {
         int32_t m_cellsZ;
         int32_t m_numChannels;
 
-        Transform m_transform;
-
-        //In local coordinates (IMPORTANT!)
+        //In grid coordinates (IMPORTANT!), the transform is applied by the volume that uses the grid
         float m_bb_xmin;
         float m_bb_xmax;
         float m_bb_ymin;
@@ -73,10 +203,38 @@ class Volumedatabase {
 
         double m_mean;
         float m_max;
+        float m_min;
+        bool m_empty_border;                /// Voxels on the faces of the grid are all zero, so (clamped) lookups outside the bounds are too
 
         std::ifstream VOL_stream;
-        int m_dataCount;
-        float* VOL_data;
+        uint64_t m_dataCount;
+        std::vector<float> VOL_data;            /// Empty when out of core, see level0Voxel()
+
+        VolumeStorageOptions m_storage;
+        std::string m_brickfilename;
+        int32_t m_bricksX, m_bricksY, m_bricksZ;
+
+        /// Entry of the brick index of a .zvol
+        struct BrickInfo {
+            uint64_t offset;                /// Of the compressed payload in the file
+            uint32_t size;                  /// Compressed size, 0 for uniform bricks
+            float min, max;                 /// Over the voxels of the grid (padding excluded)
+        };
+        std::vector<BrickInfo> m_brick_index;
+        uint32_t m_brick_source;                /// Key of this grid in the BrickCache (new one on every reload)
+        mutable std::ifstream m_brick_stream;
+        mutable tbb::mutex m_brick_mutex;
+
+        /// One level of the density mip pyramid. Every voxel of level i+1 covers (up to) 2x2x2 voxels
+        /// of level i, storing their average (used for lookups) and their max (conservative majorants)
+        struct MipLevel {
+            int32_t cellsX, cellsY, cellsZ;
+            std::vector<float> avg;         /// Empty for level 0, see level0Voxel()
+            std::vector<float> max;         /// Empty for level 0, see level0Voxel()
+            float min;                      /// Min of avg over the whole level
+            float max_avg;                  /// Max of avg over the whole level (majorant for tracking at this level)
+        };
+        std::vector<MipLevel> m_mips;
 };
 
 NORI_NAMESPACE_END
@@ -499,5 +499,140 @@ bool Accel::rayIntersect(const Ray3f &_ray, Intersection &its, bool shadowRay) c
 	return foundIntersection;
 }
 
+bool Accel::rayIntersectBoundaries(const Ray3f &_ray, BoundaryHit *hits, int maxHits,
+	int &nHits, bool &truncated) const {
+	n_UINT node_idx = 0, stack_idx = 0, stack[64];
+	nHits = 0;
+	truncated = false;
+
+	/* Use an adaptive ray epsilon */
+	Ray3f ray(_ray);
+	if (ray.mint == Epsilon)
+		ray.mint = std::max(ray.mint, ray.mint * ray.o.array().abs().maxCoeff());
+
+	if (m_nodes.empty() || ray.maxt < ray.mint)
+		return false;
+
+	while (true) {
+		const BVHNode &node = m_nodes[node_idx];
+
+		if (!node.bbox.rayIntersect(ray)) {
+			if (stack_idx == 0)
+				break;
+			node_idx = stack[--stack_idx];
+			continue;
+		}
+
+		if (node.isInner()) {
+			stack[stack_idx++] = node.inner.rightChild;
+			node_idx++;
+			assert(stack_idx < 64);
+		}
+		else {
+			for (n_UINT i = node.start(), end = node.end(); i < end; ++i) {
+				n_UINT idx = m_indices[i];
+				const Mesh *mesh = m_meshes[findMesh(idx)];
+
+				float u, v, t;
+				if (!mesh->rayIntersect(idx, ray, u, v, t))
+					continue;
+				/* Any surface occludes the whole segment */
+				if (!mesh->isVolume())
+					return true;
+
+				if (nHits < maxHits) {
+					hits[nHits++] = BoundaryHit{ t, mesh };
+					continue;
+				}
+				/* Full: keep the closest ones */
+				truncated = true;
+				int farthest = 0;
+				for (int j = 1; j < nHits; ++j)
+					if (hits[j].t > hits[farthest].t)
+						farthest = j;
+				if (t < hits[farthest].t)
+					hits[farthest] = BoundaryHit{ t, mesh };
+			}
+			if (stack_idx == 0)
+				break;
+			node_idx = stack[--stack_idx];
+			continue;
+		}
+	}
+
+	return false;
+}
+
+/// Distance from p to the triangle abc (closest point by Voronoi regions, from Ericson's Real-Time Collision Detection)
+static float distanceToTriangle(const Point3f &p, const Point3f &a, const Point3f &b, const Point3f &c) {
+	Vector3f ab = b - a, ac = c - a, ap = p - a;
+	float d1 = ab.dot(ap), d2 = ac.dot(ap);
+	if (d1 <= 0.f && d2 <= 0.f)
+		return ap.norm();
+	Vector3f bp = p - b;
+	float d3 = ab.dot(bp), d4 = ac.dot(bp);
+	if (d3 >= 0.f && d4 <= d3)
+		return bp.norm();
+	float vc = d1 * d4 - d3 * d2;
+	if (vc <= 0.f && d1 >= 0.f && d3 <= 0.f)
+		return (p - (a + ab * (d1 / (d1 - d3)))).norm();
+	Vector3f cp = p - c;
+	float d5 = ab.dot(cp), d6 = ac.dot(cp);
+	if (d6 >= 0.f && d5 <= d6)
+		return cp.norm();
+	float vb = d5 * d2 - d1 * d6;
+	if (vb <= 0.f && d2 >= 0.f && d6 <= 0.f)
+		return (p - (a + ac * (d2 / (d2 - d6)))).norm();
+	float va = d3 * d6 - d5 * d4;
+	if (va <= 0.f && (d4 - d3) >= 0.f && (d5 - d6) >= 0.f)
+		return (p - (b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6))))).norm();
+	float denom = 1.f / (va + vb + vc);
+	return (p - (a + ab * (vb * denom) + ac * (vc * denom))).norm();
+}
+
+float Accel::closestDistance(const Point3f &p, float maxDist) const {
+	n_UINT node_idx = 0, stack_idx = 0, stack[64];
+	float dist = maxDist;
+
+	if (m_nodes.empty())
+		return dist;
+
+	while (true) {
+		const BVHNode &node = m_nodes[node_idx];
+
+		if (node.bbox.distanceTo(p) >= dist) {
+			if (stack_idx == 0)
+				break;
+			node_idx = stack[--stack_idx];
+			continue;
+		}
+
+		if (node.isInner()) {
+			/* Closer child first, the other one is likely pruned by then */
+			n_UINT left = node_idx + 1, right = node.inner.rightChild;
+			if (m_nodes[right].bbox.squaredDistanceTo(p) < m_nodes[left].bbox.squaredDistanceTo(p))
+				std::swap(left, right);
+			stack[stack_idx++] = right;
+			node_idx = left;
+			assert(stack_idx < 64);
+		}
+		else {
+			for (n_UINT i = node.start(), end = node.end(); i < end; ++i) {
+				n_UINT idx = m_indices[i];
+				const Mesh *mesh = m_meshes[findMesh(idx)];
+				const MatrixXf &V = mesh->getVertexPositions();
+				const MatrixXu &F = mesh->getIndices();
+				dist = std::min(dist, distanceToTriangle(p, V.col(F(0, idx)), V.col(F(1, idx)), V.col(F(2, idx))));
+			}
+			if (stack_idx == 0)
+				break;
+			node_idx = stack[--stack_idx];
+			continue;
+		}
+	}
+
+	return dist;
+}
+
 NORI_NAMESPACE_END
 
@@ -0,0 +1,51 @@
+/*
+    Date: 19-1-2023
+    Authors: Pedro José Pérez García
+    Comms: Part of our nori extensions for the final assignment
+            of the course "Modelling and Simullation of Appearance",
+            Master in Robotics, Graphics and Computer Vision (MRGCV),
+            Universidad de Zaragoza, course 2022-2023
+*/
+
+#include <nori/adjoint.h>
+
+NORI_NAMESPACE_BEGIN
+
+void AdjointField::init(const BoundingBox3f& bbox, int resolution)
+{
+    m_grid = UniformGrid(bbox, resolution);
+    m_sum.assign(m_grid.getCellCount(), 0.);
+    m_count.assign(m_grid.getCellCount(), 0);
+}
+
+void AdjointField::update(const std::vector<Record>& records)
+{
+    for(const Record& record : records)
+    {
+        int64_t cell = m_grid.cellAt(record.p);
+        if(cell < 0 || !std::isfinite(record.value) || record.value < 0.f)
+            continue;
+        m_sum[cell] += record.value;
+        m_count[cell]++;
+    }
+}
+
+bool AdjointField::lookup(const Point3f& p, float& L) const
+{
+    int64_t cell = m_count.empty() ? -1 : m_grid.cellAt(p);
+    if(cell < 0 || m_count[cell] < MinRecords)
+        return false;
+    L = (float)(m_sum[cell] / m_count[cell]);
+    return true;
+}
+
+size_t AdjointField::getTrainedCount() const
+{
+    size_t trained = 0;
+    for(uint32_t count : m_count)
+        if(count >= MinRecords)
+            trained++;
+    return trained;
+}
+
+NORI_NAMESPACE_END
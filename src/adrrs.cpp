@@ -0,0 +1,59 @@
+/*
+    Date: 19-1-2023
+    Authors: Pedro José Pérez García
+    Comms: Part of our nori extensions for the final assignment
+            of the course "Modelling and Simullation of Appearance",
+            Master in Robotics, Graphics and Computer Vision (MRGCV),
+            Universidad de Zaragoza, course 2022-2023
+*/
+
+#include <nori/adrrs.h>
+
+NORI_NAMESPACE_BEGIN
+
+void AdjointRRS::init(const BoundingBox3f& bbox, int resolution, const Vector2i& imageSize)
+{
+    m_field.init(bbox, resolution);
+    m_image_size = imageSize;
+    m_pixel_sum.assign((size_t)imageSize.x() * imageSize.y(), 0.);
+    m_iterations = 0;
+}
+
+void AdjointRRS::update(const std::vector<AdjointField::Record>& records, const std::vector<float>& pixelLuminance)
+{
+    m_field.update(records);
+    for(size_t i = 0; i < m_pixel_sum.size() && i < pixelLuminance.size(); i++)
+        m_pixel_sum[i] += pixelLuminance[i];
+    m_iterations++;
+}
+
+float AdjointRRS::getPixelEstimate(const Point2i& pixel) const
+{
+    if(m_iterations == 0 || pixel.x() < 0 || pixel.y() < 0 || pixel.x() >= m_image_size.x() || pixel.y() >= m_image_size.y())
+        return 0.f;
+    return (float)(m_pixel_sum[(size_t)pixel.y() * m_image_size.x() + pixel.x()] / m_iterations);
+}
+
+int AdjointRRS::copies(Sampler* sampler, const Point3f& x, float pixelEstimate, Color3f& beta, bool& rouletteDone) const
+{
+    float Lx;
+    if(!(pixelEstimate > 0.f) || !m_field.lookup(x, Lx))
+        return 1;
+    rouletteDone = true;
+
+    /// Window [2 / (1 + s), 2 s / (1 + s)] around the pixel estimate, relative to it
+    const float s = 5.f;
+    float ratio = beta.getLuminance() * Lx / pixelEstimate;
+    if(ratio < 2.f / (1.f + s))
+    {
+        float survival = std::max(0.01f, ratio);
+        if(sampler->next1D() >= survival)
+            return 0;
+        beta /= survival;
+    }
+    else if(ratio > 2.f * s / (1.f + s))
+        return (int)std::min((float)m_max_split, std::ceil(ratio));
+    return 1;
+}
+
+NORI_NAMESPACE_END
@@ -72,6 +72,18 @@ public:
         return eval(lRec) / pdf(lRec);		//Comprobar operaciones (mult y div.)
 	}
 
+	// Cosine weighted directions around the normal, so the power is just radiance * pi * area
+	virtual Color3f samplePhoton(Ray3f & ray, const Point2f & samplePosition, const Point2f & sampleDirection) const {
+		if (!m_mesh)
+			throw NoriException("There is no shape attached to this Area light!");
+		Point3f p;
+		Normal3f n;
+		Point2f uv;
+		m_mesh->samplePosition(samplePosition, p, n, uv);
+		ray = Ray3f(p, Frame(n).toWorld(Warp::squareToCosineHemisphere(sampleDirection)));
+		return m_radiance->eval(uv) * M_PI / m_mesh->pdf(p);
+	}
+
 	// Returns probability with respect to solid angle given by all the information inside the emitterqueryrecord.
 	// Assumes all information about the intersection point is already provided inside.
 	// WARNING: Use with care. Malformed EmitterQueryRecords can result in undefined behavior. 
@@ -0,0 +1,567 @@
+/*
+    Date: 19-1-2023
+    Authors: Pedro José Pérez García
+    Comms: Part of our nori extensions for the final assignment
+            of the course "Modelling and Simullation of Appearance",
+            Master in Robotics, Graphics and Computer Vision (MRGCV),
+            Universidad de Zaragoza, course 2022-2023
+*/
+
+#include <nori/integrator.h>
+#include <nori/scene.h>
+#include <nori/emitter.h>
+#include <nori/bsdf.h>
+#include <nori/mesh.h>
+#include <nori/volume.h>
+#include <nori/phasefunction.h>
+#include <nori/mediumstack.h>
+#include <nori/sampler.h>
+#include <nori/warp.h>
+#include <vector>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Bidirectional path tracing with medium and surface vertices (Veach 1997, Lafortune and Willems 1996)
+ *
+ * Every camera sample traces a camera subpath and a light subpath, both through the media like
+ * path_mis_participating_media does (free-flight sampling with the volumes, phase function sampling
+ * at medium vertices, volume boundaries crossed without making a vertex), and connects every prefix
+ * of one with every prefix of the other. Each strategy is weighted with the balance heuristic over all
+ * the strategies that could have built the same path, from the densities of both subpaths (as in pbrt-v3,
+ * the densities of the free-flight sampling are left out of the weights, which keeps them a partition
+ * of unity). The strategy with a single light vertex samples the light anew, like next event estimation.
+ *
+ * Light subpaths start from area and point lights (see Emitter::samplePhoton()). The environment and the
+ * sun are only reached by the camera subpath and by light sampling, combined like path_mis does. Connecting
+ * light subpaths to the camera (light tracing) is not done, the image is rendered pixel by pixel.
+ */
+class BDPTParticipating : public Integrator
+{
+public:
+    BDPTParticipating(const PropertyList &props)
+    {
+        /// Longest path (in segments) that the connections build
+        m_max_depth = std::max(1, props.getInteger("max_depth", 16));
+
+        /// Subpaths go through Russian roulette after this many vertices
+        m_rr_depth = std::max(1, props.getInteger("rr_depth", 3));
+    }
+
+    Color3f Li(const Scene* scene, Sampler* sampler, const Ray3f& ray) const
+    {
+        std::vector<PathVertex> camera, light;
+        camera.reserve(m_max_depth + 2);
+        light.reserve(m_max_depth);
+
+        Color3f L(0.f);
+        cameraSubpath(scene, sampler, ray, camera, L);
+        lightSubpath(scene, sampler, light);
+
+        for(int t = 2; t <= (int)camera.size(); t++)
+        {
+            /// Light sampling does not need the light subpath, which may be empty
+            for(int s = 0; s <= std::max(1, (int)light.size()); s++)
+            {
+                if(s + t - 2 > m_max_depth)
+                    break;
+                if(s == 0)
+                    L += emission(scene, camera, t);
+                else if(s == 1)
+                    L += lightSampling(scene, sampler, camera, light, t);
+                else
+                    L += connect(scene, sampler, camera, light, s, t);
+            }
+        }
+        return L;
+    }
+
+    std::string toString() const
+    {
+        return tfm::format(
+            "BDPTParticipating[\n"
+            "  max_depth = %d\n"
+            "  rr_depth = %d\n"
+            "]", m_max_depth, m_rr_depth);
+    }
+
+private:
+    int m_max_depth;
+    int m_rr_depth;
+
+    enum class VertexType { Camera, Light, Surface, Medium };
+
+    /**
+     * \brief Vertex of a subpath
+     *
+     * beta is the throughput of the subpath up to (and including the free-flight weight of) the vertex.
+     * pdfFwd is the area density (volume density for medium vertices) with which the subpath sampled it,
+     * pdfRev the one with which the other subpath would have sampled it, both for the MIS weights
+     */
+    struct PathVertex {
+        VertexType type;
+        Point3f p;
+        Normal3f n = Normal3f(0.f);         // Surfaces and area lights, zero otherwise
+        Vector3f wi = Vector3f(0.f);        // Towards the previous vertex
+        Intersection its;                   // Surfaces
+        const Volume* medium = nullptr;     // Medium vertices
+        const Emitter* emitter = nullptr;   // Light vertices
+        MediumStack media;
+        Color3f beta = Color3f(1.f);
+        float pdfFwd = 0.f;
+        float pdfRev = 0.f;
+        float pdfPos = 1.f;                 // Light vertices, density of the position on the light
+        bool delta = false;
+
+        bool onSurface() const { return !n.isZero(); }
+    };
+
+    MediumStack mediaAt(const Scene* scene, const Point3f& p) const
+    {
+        MediumStack media(scene->getEnviromentalVolumeMedium().get());
+        for(const Mesh* mesh : scene->getMeshes())
+            if(mesh->isVolume() && mesh->getBoundingBox().contains(p))
+                media.cross(mesh->getVolume().get());
+        return media;
+    }
+
+    /// Lights that start light subpaths (the rest have no position to start from)
+    static bool isFinite(const Emitter* em)
+    {
+        return em->getEmitterType() == EmitterType::EMITTER_POINT || em->getEmitterType() == EmitterType::EMITTER_AREA;
+    }
+
+    /// Emitter of a vertex that can act as a light: a light vertex, or a camera vertex on an emitter
+    static const Emitter* emitterOf(const PathVertex& v)
+    {
+        if(v.type == VertexType::Light)
+            return v.emitter;
+        if(v.type == VertexType::Surface && v.its.mesh->isEmitter())
+            return v.its.mesh->getEmitter();
+        return nullptr;
+    }
+
+    /// Solid angle density at from towards to, as an area (volume) density at to
+    static float toArea(float pdf, const PathVertex& from, const PathVertex& to)
+    {
+        Vector3f w = to.p - from.p;
+        float dist2 = w.squaredNorm();
+        if(dist2 == 0.f)
+            return 0.f;
+        if(to.onSurface())
+            pdf *= std::abs(to.n.dot(w / std::sqrt(dist2)));
+        return pdf / dist2;
+    }
+
+    /// Scattering function at v from its previous vertex towards wo (the BSDF, or the phase function)
+    static Color3f f(const PathVertex& v, const Vector3f& wo)
+    {
+        if(v.type == VertexType::Surface)
+            return v.its.mesh->getBSDF()->eval(BSDFQueryRecord(v.its.toLocal(v.wi), v.its.toLocal(wo), v.its.uv, ESolidAngle));
+        if(v.type == VertexType::Medium)
+        {
+            PFQueryRecord pfRecord(v.wi, wo);
+            return Color3f(v.medium->getPhaseFunction()->eval(pfRecord));
+        }
+        return Color3f(0.f);
+    }
+
+    /// Cosine of the shading normal of v with w, for connections (1 at medium vertices)
+    static float cosine(const PathVertex& v, const Vector3f& w)
+    {
+        return v.type == VertexType::Surface ? std::abs(v.its.shFrame.n.dot(w)) : 1.f;
+    }
+
+    /// Solid angle density of sampling wo at v, coming from wi
+    static float pdfDirection(const PathVertex& v, const Vector3f& wi, const Vector3f& wo)
+    {
+        if(v.type == VertexType::Surface)
+            return v.its.mesh->getBSDF()->pdf(BSDFQueryRecord(v.its.toLocal(wi), v.its.toLocal(wo), v.its.uv, ESolidAngle));
+        PFQueryRecord pfRecord(wi, wo);
+        return v.medium->getPhaseFunction()->pdf(pfRecord);
+    }
+
+    /// Density of light subpaths starting at the position of v (choosing the emitter included)
+    float pdfLightOrigin(const Scene* scene, const PathVertex& v) const
+    {
+        const Emitter* em = emitterOf(v);
+        float pdfPos = v.type == VertexType::Light ? v.pdfPos : v.its.mesh->pdf(v.p);
+        return scene->pdfEmitter(em) * pdfPos;
+    }
+
+    /// Area density at to of the direction a light subpath leaving light vertex v takes
+    float pdfLight(const PathVertex& v, const PathVertex& to) const
+    {
+        const Emitter* em = emitterOf(v);
+        Vector3f w = (to.p - v.p).normalized();
+        float pdf = em->getEmitterType() == EmitterType::EMITTER_POINT ? INV_FOURPI : std::max(0.f, v.n.dot(w)) * INV_PI;
+        return toArea(pdf, v, to);
+    }
+
+    /// Area density at next of v sampling it, having been reached from prev (see pdfLight() for light vertices)
+    float pdf(const PathVertex* prev, const PathVertex& v, const PathVertex& next) const
+    {
+        if(v.type == VertexType::Light || !prev)
+            return pdfLight(v, next);
+        Vector3f wp = (prev->p - v.p).normalized();
+        Vector3f wn = (next.p - v.p).normalized();
+        return toArea(pdfDirection(v, wp, wn), v, next);
+    }
+
+    /**
+     * \brief Random walk through the scene from ray, appending a vertex per scattering event to path
+     *
+     * pdf is the solid angle density of ray.d at the last vertex of path. Emission is not gathered here,
+     * except by camera subpaths (Lescape given) from the environment and from precomputed media
+     */
+    void randomWalk(const Scene* scene, Sampler* sampler, Ray3f ray, MediumStack media, Color3f beta, float pdf,
+        int maxVertices, std::vector<PathVertex>& path, Color3f* Lescape) const
+    {
+        while((int)path.size() < maxVertices)
+        {
+            Intersection its;
+            bool foundIntersection = scene->rayIntersect(ray, its);
+            const Volume* medium = media.current();
+            bool sampledMedium = false;
+            Point3f xt;
+            if(medium && medium->isPrecomputed())
+            {
+                Color3f tr;
+                Color3f Ls = medium->precomputedScattering(ray, foundIntersection ? its.t : std::numeric_limits<float>::infinity(), tr);
+                if(Lescape)
+                    *Lescape += beta * Ls;
+                beta *= tr;
+            }
+            else if(foundIntersection && medium)
+            {
+                Color3f _beta(1.f);
+                xt = medium->samplePathStep(ray, its, sampler, _beta, sampledMedium);
+                beta *= _beta;
+            }
+            if(beta.isZero() || !beta.allFinite())
+                return;
+
+            int prev = (int)path.size() - 1;
+            PathVertex v;
+            v.media = media;
+            v.wi = -ray.d;
+            v.beta = beta;
+            if(sampledMedium)
+            {
+                v.type = VertexType::Medium;
+                v.p = xt;
+                v.medium = medium;
+            }
+            else
+            {
+                if(!foundIntersection)
+                {
+                    if(Lescape)
+                        *Lescape += beta * environmentEmission(scene, path.back(), ray.d, pdf);
+                    return;
+                }
+                /// Medium boundaries are no vertices
+                if(its.mesh->isVolume())
+                {
+                    ray = Ray3f(its.p, ray.d);
+                    media.cross(its.mesh->getVolume().get());
+                    continue;
+                }
+                v.type = VertexType::Surface;
+                v.p = its.p;
+                v.n = its.geoFrame.n;
+                v.its = its;
+            }
+            v.pdfFwd = toArea(pdf, path[prev], v);
+            path.push_back(v);
+            if((int)path.size() == maxVertices)
+                return;
+
+            /// Continuation, with the reverse density for the previous vertex
+            PathVertex& cur = path.back();
+            Vector3f wo;
+            float pdfRev;
+            if(cur.type == VertexType::Medium)
+            {
+                PFQueryRecord pfRecord(cur.wi);
+                beta *= medium->getPhaseFunction()->sample(pfRecord, sampler->next2D());
+                wo = pfRecord.wo;
+                pdf = pfRecord.m_pdf;
+                PFQueryRecord revRecord(wo, cur.wi);
+                pdfRev = medium->getPhaseFunction()->pdf(revRecord);
+            }
+            else
+            {
+                const BSDF* bsdf = cur.its.mesh->getBSDF();
+                BSDFQueryRecord bRec(cur.its.toLocal(cur.wi), cur.its.uv);
+                Color3f fs = bsdf->sample(bRec, sampler->next2D());
+                if(fs.isZero() || !fs.allFinite())
+                    return;
+                beta *= fs;
+                wo = cur.its.toWorld(bRec.wo);
+                if(bRec.measure == EDiscrete)
+                {
+                    cur.delta = true;
+                    pdf = 0.f;
+                    pdfRev = 0.f;
+                }
+                else
+                {
+                    pdf = bsdf->pdf(bRec);
+                    pdfRev = bsdf->pdf(BSDFQueryRecord(bRec.wo, bRec.wi, cur.its.uv, ESolidAngle));
+                }
+            }
+            path[prev].pdfRev = toArea(pdfRev, cur, path[prev]);
+            ray = Ray3f(cur.p, wo);
+
+            /// Russian roulette, as in path_mis_participating_media
+            if((int)path.size() > m_rr_depth)
+            {
+                float rr = std::max(0.01f, 1 - beta.y());
+                if(sampler->next1D() < rr)
+                    return;
+                beta /= (1.f - rr);
+            }
+        }
+    }
+
+    /// Camera subpath. Whatever it gathers with a single strategy (the environment seen directly, precomputed media) goes to L
+    void cameraSubpath(const Scene* scene, Sampler* sampler, const Ray3f& ray, std::vector<PathVertex>& path, Color3f& L) const
+    {
+        PathVertex v;
+        v.type = VertexType::Camera;
+        v.p = ray.o;
+        v.media = mediaAt(scene, ray.o);
+        path.push_back(v);
+        randomWalk(scene, sampler, ray, v.media, Color3f(1.f), 1.f, m_max_depth + 1, path, &L);
+    }
+
+    /// Light subpath, empty if the chosen emitter cannot start one
+    void lightSubpath(const Scene* scene, Sampler* sampler, std::vector<PathVertex>& path) const
+    {
+        float pdfChoose;
+        const Emitter* em = scene->sampleEmitter(sampler->next1D(), pdfChoose);
+        Point2f samplePosition = sampler->next2D(), sampleDirection = sampler->next2D();
+        if(!em || !isFinite(em) || !(pdfChoose > 0.f))
+            return;
+
+        PathVertex v;
+        v.type = VertexType::Light;
+        v.emitter = em;
+        Color3f Le;
+        Vector3f wo;
+        float pdfDir;
+        if(em->getEmitterType() == EmitterType::EMITTER_POINT)
+        {
+            /// Uniform directions, the power being 4 pi times the intensity
+            Ray3f ray;
+            Le = em->samplePhoton(ray, samplePosition, sampleDirection) * INV_FOURPI;
+            v.p = ray.o;
+            wo = ray.d;
+            pdfDir = INV_FOURPI;
+        }
+        else
+        {
+            /// A point of the light (its density by area in lRec.pdf), and a cosine weighted direction
+            EmitterQueryRecord lRec(Point3f(0.f));
+            em->sample(lRec, samplePosition, 0.f);
+            v.p = lRec.p;
+            v.n = lRec.n;
+            v.pdfPos = lRec.pdf;
+            Vector3f local = Warp::squareToCosineHemisphere(sampleDirection);
+            wo = Frame(lRec.n).toWorld(local);
+            pdfDir = local.z() * INV_PI;
+            Le = em->eval(EmitterQueryRecord(em, lRec.p + wo, lRec.p, lRec.n, lRec.uv));
+        }
+        if(Le.isZero() || !(pdfDir > 0.f) || !(v.pdfPos > 0.f))
+            return;
+
+        v.media = mediaAt(scene, v.p);
+        v.pdfFwd = pdfChoose * v.pdfPos;
+        v.beta = Le / v.pdfFwd;
+        path.push_back(v);
+
+        float cosine = v.onSurface() ? std::abs(v.n.dot(wo)) : 1.f;
+        Color3f beta = Le * cosine / (v.pdfFwd * pdfDir);
+        randomWalk(scene, sampler, Ray3f(v.p, wo), v.media, beta, pdfDir, m_max_depth, path, nullptr);
+    }
+
+    /// Environment reached by the camera subpath after vertex last, whose continuation had density pdfDir. Against light sampling there
+    Color3f environmentEmission(const Scene* scene, const PathVertex& last, const Vector3f& d, float pdfDir) const
+    {
+        const Emitter* env = scene->getEnvironmentalEmitter();
+        if(!env)
+            return Color3f(0.f);
+        Color3f Le = scene->getBackground(Ray3f(last.p, d));
+        if(last.type == VertexType::Camera || last.delta)
+            return Le;
+        EmitterQueryRecord envRecord(last.p);
+        envRecord.wi = d;
+        float pdfLight = scene->pdfEmitter(env) * env->pdf(envRecord);
+        if(!(pdfLight > 0.f) || std::isinf(pdfLight))
+            return Le;
+        return Le * pdfDir / (pdfDir + pdfLight);
+    }
+
+    /// Strategy s = 0: the camera subpath reached an emitter at its vertex t - 1
+    Color3f emission(const Scene* scene, std::vector<PathVertex>& camera, int t) const
+    {
+        PathVertex& pt = camera[t - 1];
+        const Emitter* em = emitterOf(pt);
+        if(!em || pt.type != VertexType::Surface)
+            return Color3f(0.f);
+        EmitterQueryRecord er(em, camera[t - 2].p, pt.p, pt.its.shFrame.n, pt.its.uv);
+        Color3f Le = em->eval(er);
+        if(Le.isZero())
+            return Color3f(0.f);
+        std::vector<PathVertex> light;
+        return pt.beta * Le * misWeight(scene, camera, light, 0, t, nullptr);
+    }
+
+    /// Strategy s = 1: light sampling from the camera vertex t - 1
+    Color3f lightSampling(const Scene* scene, Sampler* sampler, std::vector<PathVertex>& camera, std::vector<PathVertex>& light, int t) const
+    {
+        const PathVertex& pt = camera[t - 1];
+        if(pt.delta)
+            return Color3f(0.f);
+        float pdfChoose;
+        const Emitter* em = scene->sampleEmitter(sampler->next1D(), pdfChoose);
+        Point2f sample = sampler->next2D();
+        float u = sampler->next1D();
+        if(!em || !(pdfChoose > 0.f))
+            return Color3f(0.f);
+        EmitterQueryRecord lRec(pt.p);
+        Color3f Le = em->sample(lRec, sample, u);
+        if(Le.isZero())
+            return Color3f(0.f);
+
+        Color3f fx = f(pt, lRec.wi) * cosine(pt, lRec.wi);
+        if(fx.isZero())
+            return Color3f(0.f);
+        Color3f tr = scene->transmittanceTo(sampler, pt.p, pt.p + lRec.wi * lRec.dist, pt.media, 0, false);
+        if(tr.isZero())
+            return Color3f(0.f);
+        Color3f L = pt.beta * fx * tr * Le / pdfChoose;
+
+        if(em->isDelta() && !isFinite(em))
+            return L;
+        if(!isFinite(em))
+        {
+            /// The environment: against the camera subpath reaching it
+            float pdfLight = pdfChoose * em->pdf(lRec);
+            float pdfDir = pdfDirection(pt, pt.wi, lRec.wi);
+            return L * pdfLight / (pdfLight + pdfDir);
+        }
+
+        PathVertex sampled;
+        sampled.type = VertexType::Light;
+        sampled.emitter = em;
+        sampled.p = lRec.p;
+        if(em->getEmitterType() == EmitterType::EMITTER_AREA)
+        {
+            sampled.n = lRec.n;
+            sampled.pdfPos = lRec.pdf;
+        }
+        sampled.pdfFwd = pdfChoose * sampled.pdfPos;
+        return L * misWeight(scene, camera, light, 1, t, &sampled);
+    }
+
+    /// Strategies s >= 2, t >= 2: the light vertex s - 1 connected to the camera vertex t - 1
+    Color3f connect(const Scene* scene, Sampler* sampler, std::vector<PathVertex>& camera, std::vector<PathVertex>& light, int s, int t) const
+    {
+        const PathVertex& qs = light[s - 1];
+        const PathVertex& pt = camera[t - 1];
+        if(qs.delta || pt.delta)
+            return Color3f(0.f);
+        Vector3f d = pt.p - qs.p;
+        float dist2 = d.squaredNorm();
+        if(dist2 < Epsilon * Epsilon)
+            return Color3f(0.f);
+        d /= std::sqrt(dist2);
+
+        Color3f L = qs.beta * f(qs, d) * f(pt, -d) * pt.beta;
+        if(L.isZero())
+            return Color3f(0.f);
+        L *= cosine(qs, d) * cosine(pt, d) / dist2;
+        L *= scene->transmittanceTo(sampler, qs.p, pt.p, qs.media, 0, false);
+        if(L.isZero())
+            return Color3f(0.f);
+        return L * misWeight(scene, camera, light, s, t, nullptr);
+    }
+
+    /**
+     * \brief Balance heuristic weight of strategy (s, t) over the strategies that build the same path
+     *
+     * The densities of the vertices next to the connection change with it, so they are computed for it
+     * and restored afterwards. The ratios of the densities of every other strategy to this one then
+     * follow from walking both subpaths outwards (Veach 1997, section 10.2). Delta vertices can not be
+     * connected, which rules out the strategies that would. Strategies with a single camera vertex
+     * are not done, and neither are they counted. sampled replaces the first light vertex for s = 1
+     */
+    float misWeight(const Scene* scene, std::vector<PathVertex>& camera, std::vector<PathVertex>& light, int s, int t, PathVertex* sampled) const
+    {
+        if(s + t == 2)
+            return 1.f;
+
+        PathVertex* qs = s > 0 ? (s == 1 && sampled ? sampled : &light[s - 1]) : nullptr;
+        PathVertex* pt = &camera[t - 1];
+        PathVertex* qsMinus = s > 1 ? &light[s - 2] : nullptr;
+        PathVertex* ptMinus = &camera[t - 2];
+
+        /// Saved to restore them afterwards
+        PathVertex qsSaved = qs ? *qs : PathVertex(), ptSaved = *pt;
+        float qsMinusRev = qsMinus ? qsMinus->pdfRev : 0.f, ptMinusRev = ptMinus->pdfRev;
+
+        pt->delta = false;
+        if(qs)
+            qs->delta = false;
+        pt->pdfRev = s > 0 ? pdf(qsMinus, *qs, *pt) : pdfLightOrigin(scene, *pt);
+        if(s > 0)
+            ptMinus->pdfRev = pdf(qs, *pt, *ptMinus);
+        else
+        {
+            /// pt acts as a light vertex
+            PathVertex asLight = *pt;
+            asLight.n = pt->its.shFrame.n;
+            ptMinus->pdfRev = pdfLight(asLight, *ptMinus);
+        }
+        if(qs)
+            qs->pdfRev = pdf(ptMinus, *pt, *qs);
+        if(qsMinus)
+            qsMinus->pdfRev = pdf(pt, *qs, *qsMinus);
+
+        auto remap = [](float f) { return f != 0.f ? f : 1.f; };
+        float sum = 0.f;
+        float ri = 1.f;
+        for(int i = t - 1; i > 1; i--)
+        {
+            ri *= remap(camera[i].pdfRev) / remap(camera[i].pdfFwd);
+            if(!camera[i].delta && !camera[i - 1].delta)
+                sum += ri;
+        }
+        ri = 1.f;
+        for(int i = s - 1; i >= 0; i--)
+        {
+            const PathVertex& li = (i == 0 && sampled) ? *sampled : light[i];
+            ri *= remap(li.pdfRev) / remap(li.pdfFwd);
+            bool deltaBefore = i > 0 ? light[i - 1].delta : emitterOf(li)->isDelta();
+            if(!li.delta && !deltaBefore)
+                sum += ri;
+        }
+
+        if(qs)
+        {
+            qs->pdfRev = qsSaved.pdfRev;
+            qs->delta = qsSaved.delta;
+        }
+        pt->pdfRev = ptSaved.pdfRev;
+        pt->delta = ptSaved.delta;
+        if(qsMinus)
+            qsMinus->pdfRev = qsMinusRev;
+        ptMinus->pdfRev = ptMinusRev;
+        return 1.f / (1.f + sum);
+    }
+};
+
+NORI_REGISTER_CLASS(BDPTParticipating, "bdpt");
+NORI_NAMESPACE_END
@@ -0,0 +1,70 @@
+/*
+    Date: 19-1-2023
+    Authors: Pedro José Pérez García
+    Comms: Part of our nori extensions for the final assignment
+            of the course "Modelling and Simullation of Appearance",
+            Master in Robotics, Graphics and Computer Vision (MRGCV),
+            Universidad de Zaragoza, course 2022-2023
+*/
+
+#include <nori/beambvh.h>
+#include <algorithm>
+
+NORI_NAMESPACE_BEGIN
+
+void BeamBVH::build(std::vector<PhotonBeam>&& beams, float radius)
+{
+    m_beams = std::move(beams);
+    m_radius = radius;
+    m_nodes.clear();
+    if(!m_beams.empty())
+    {
+        m_nodes.reserve(2 * m_beams.size() / 4 + 1);
+        buildRecursive(0, (uint32_t)m_beams.size(), 0);
+    }
+}
+
+uint32_t BeamBVH::buildRecursive(uint32_t start, uint32_t end, int depth)
+{
+    uint32_t index = (uint32_t)m_nodes.size();
+    m_nodes.push_back(Node());
+
+    BoundingBox3f bbox, centroids;
+    for(uint32_t i = start; i < end; i++)
+    {
+        const PhotonBeam& beam = m_beams[i];
+        Point3f p1 = beam.o + beam.length * beam.d;
+        bbox.expandBy(beam.o);
+        bbox.expandBy(p1);
+        centroids.expandBy(0.5f * (beam.o + p1));
+    }
+    bbox.min -= Vector3f(m_radius);
+    bbox.max += Vector3f(m_radius);
+
+    // Plain median split on the centroids, with the depth capped to fit the query stack
+    Node node;
+    node.bbox = bbox;
+    node.start = start;
+    node.size = 0;
+    node.right = 0;
+    if(end - start <= 4 || depth >= 48)
+    {
+        node.size = end - start;
+        m_nodes[index] = node;
+        return index;
+    }
+
+    int axis = centroids.getLargestAxis();
+    uint32_t mid = (start + end) / 2;
+    std::nth_element(m_beams.begin() + start, m_beams.begin() + mid, m_beams.begin() + end,
+        [axis](const PhotonBeam& a, const PhotonBeam& b) {
+            return a.o[axis] + 0.5f * a.length * a.d[axis] < b.o[axis] + 0.5f * b.length * b.d[axis];
+        });
+
+    buildRecursive(start, mid, depth + 1);
+    node.right = buildRecursive(mid, end, depth + 1);
+    m_nodes[index] = node;
+    return index;
+}
+
+NORI_NAMESPACE_END
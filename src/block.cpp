@@ -20,10 +20,17 @@
 #include <nori/bitmap.h>
 #include <nori/rfilter.h>
 #include <nori/bbox.h>
+#include <nori/sampler.h>
 #include <tbb/tbb.h>
 
 NORI_NAMESPACE_BEGIN
 
+void Sampler::prepareStream(int index, int stream) {
+    ImageBlock block(Vector2i(1, 1), nullptr);
+    block.setOffset(Point2i(index, stream));
+    prepare(block);
+}
+
 ImageBlock::ImageBlock(const Vector2i &size, const ReconstructionFilter *filter) 
         : m_offset(0, 0), m_size(size) {
     if (filter) {
@@ -0,0 +1,93 @@
+/*
+    Date: 19-1-2023
+    Authors: Pedro José Pérez García
+    Comms: Part of our nori extensions for the final assignment
+            of the course "Modelling and Simullation of Appearance",
+            Master in Robotics, Graphics and Computer Vision (MRGCV),
+            Universidad de Zaragoza, course 2022-2023
+*/
+
+#include <nori/brickcache.h>
+
+NORI_NAMESPACE_BEGIN
+
+BrickCache& BrickCache::instance()
+{
+    static BrickCache cache;
+    return cache;
+}
+
+uint32_t BrickCache::registerSource()
+{
+    tbb::mutex::scoped_lock lock(m_mutex);
+    return m_sources++;
+}
+
+void BrickCache::reserve(size_t capacityBytes)
+{
+    tbb::mutex::scoped_lock lock(m_mutex);
+    m_capacity = std::max(m_capacity, capacityBytes);
+}
+
+BrickCache::BrickRef BrickCache::get(uint32_t source, uint64_t brick, const Loader& load)
+{
+    Key key = {source, brick};
+    {
+        tbb::mutex::scoped_lock lock(m_mutex);
+        auto it = m_bricks.find(key);
+        if(it != m_bricks.end())
+        {
+            m_lru.splice(m_lru.begin(), m_lru, it->second.lru);
+            return it->second.brick;
+        }
+    }
+
+    // Miss: read the brick without blocking the other threads
+    std::shared_ptr<Brick> data = std::make_shared<Brick>();
+    load(*data);
+
+    tbb::mutex::scoped_lock lock(m_mutex);
+    auto it = m_bricks.find(key);
+    if(it != m_bricks.end())
+    {
+        // Another thread loaded it in the meantime, keep theirs
+        m_lru.splice(m_lru.begin(), m_lru, it->second.lru);
+        return it->second.brick;
+    }
+    m_lru.push_front(key);
+    m_bricks[key] = Entry{data, m_lru.begin()};
+    m_size += data->size() * sizeof(float);
+    shrink();
+    return data;
+}
+
+void BrickCache::evict(uint32_t source)
+{
+    tbb::mutex::scoped_lock lock(m_mutex);
+    for(auto it = m_lru.begin(); it != m_lru.end(); )
+    {
+        if(it->source == source)
+        {
+            auto entry = m_bricks.find(*it);
+            m_size -= entry->second.brick->size() * sizeof(float);
+            m_bricks.erase(entry);
+            it = m_lru.erase(it);
+        }
+        else
+            ++it;
+    }
+}
+
+void BrickCache::shrink()
+{
+    // Always keep the most recent brick, even if on its own it is over budget
+    while(m_size > m_capacity && m_lru.size() > 1)
+    {
+        auto entry = m_bricks.find(m_lru.back());
+        m_size -= entry->second.brick->size() * sizeof(float);
+        m_bricks.erase(entry);
+        m_lru.pop_back();
+    }
+}
+
+NORI_NAMESPACE_END
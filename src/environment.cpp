@@ -15,6 +15,7 @@
 #include <nori/emitter.h>
 #include <nori/bitmap.h>
 #include <nori/warp.h>
+#include <nori/assetcache.h>
 #include <filesystem/resolver.h>
 #include <fstream>
 
@@ -25,7 +26,6 @@ class EnvironmentEmitter : public Emitter {
 public:
 	EnvironmentEmitter(const PropertyList& props) {
 		m_type = EmitterType::EMITTER_ENVIRONMENT;
-		m_environment = 0;
 
 		std::string m_environment_name = props.getString("filename", "null");
 
@@ -37,17 +37,14 @@ public:
 		{
 			cout << "Loading Environment Map: " << filename.str() << endl;
 
-			m_environment = new Bitmap(filename.str());
+			std::string path = filename.make_absolute().str();
+			m_environment = AssetCache<const Bitmap>::instance().get(path, [&]() {
+				return std::make_shared<const Bitmap>(path);
+			});
 			cout << "Loaded " << m_environment_name << " - SIZE [" << m_environment->rows() << ", " << m_environment->cols() << "]" << endl;
 		}
 		m_radiance = props.getColor("radiance", Color3f(1.));
 	}
-	~EnvironmentEmitter()
-	{
-		if (m_environment)
-			delete m_environment;
-	}
-
 	virtual std::string toString() const {
 		return tfm::format(
 			"AreaLight[\n"
@@ -107,7 +104,7 @@ public:
 
 protected:
 	Color3f m_radiance;
-	Bitmap *m_environment;
+	std::shared_ptr<const Bitmap> m_environment;
 	std::string m_environment_name;
 };
 
@@ -0,0 +1,143 @@
+/*
+    Date: 19-1-2023
+    Authors: Pedro José Pérez García
+    Comms: Part of our nori extensions for the final assignment
+            of the course "Modelling and Simullation of Appearance",
+            Master in Robotics, Graphics and Computer Vision (MRGCV),
+            Universidad de Zaragoza, course 2022-2023
+*/
+
+#include <nori/guiding.h>
+
+NORI_NAMESPACE_BEGIN
+
+void GuidingField::init(const BoundingBox3f& bbox, size_t splitThreshold)
+{
+    m_bbox = bbox;
+    m_split_threshold = std::max((size_t)1, splitThreshold);
+    m_nodes.clear();
+    m_leaves.clear();
+
+    Node root;
+    root.axis = -1;
+    root.split = 0.f;
+    root.child = 0;
+    root.bbox = bbox;
+    root.depth = 0;
+    m_nodes.push_back(root);
+    m_leaves.push_back(Leaf());
+}
+
+void GuidingField::update(const std::vector<Record>& records)
+{
+    for(Leaf& leaf : m_leaves)
+    {
+        leaf.histogram.assign(Bins, 0.f);
+        leaf.count = 0;
+    }
+
+    for(const Record& record : records)
+    {
+        int32_t leaf = leafAt(record.p);
+        if(leaf < 0 || !std::isfinite(record.value) || record.value < 0.f)
+            continue;
+        m_leaves[leaf].histogram[binOf(record.w)] += record.value;
+        m_leaves[leaf].count++;
+    }
+
+    // Dense cells are split in two at the middle of their longest axis, both halves start from the histogram of the whole cell
+    size_t nNodes = m_nodes.size();
+    for(size_t i = 0; i < nNodes; i++)
+    {
+        if(m_nodes[i].axis >= 0 || m_nodes[i].depth >= MaxDepth || m_leaves[m_nodes[i].child].count <= m_split_threshold)
+            continue;
+        Node node = m_nodes[i];
+        int axis = node.bbox.getLargestAxis();
+        float split = 0.5f * (node.bbox.min[axis] + node.bbox.max[axis]);
+
+        Node left = node, right = node;
+        left.depth = right.depth = node.depth + 1;
+        left.bbox.max[axis] = split;
+        right.bbox.min[axis] = split;
+        right.child = (uint32_t)m_leaves.size();
+        Leaf half = m_leaves[node.child];
+        half.count /= 2;
+        m_leaves[node.child].count -= half.count;
+        m_leaves.push_back(half);
+
+        m_nodes[i].axis = axis;
+        m_nodes[i].split = split;
+        m_nodes[i].child = (uint32_t)m_nodes.size();
+        m_nodes.push_back(left);
+        m_nodes.push_back(right);
+    }
+
+    for(Leaf& leaf : m_leaves)
+    {
+        float sum = 0.f;
+        for(float value : leaf.histogram)
+            sum += value;
+        if(sum <= 0.f)
+            continue;
+        leaf.dpdf.clear();
+        leaf.dpdf.reserve(Bins);
+        for(float value : leaf.histogram)
+            leaf.dpdf.append(value);
+        leaf.dpdf.normalize();
+    }
+}
+
+bool GuidingField::isTrained(const Point3f& p) const
+{
+    int32_t leaf = leafAt(p);
+    return leaf >= 0 && m_leaves[leaf].dpdf.size() == Bins;
+}
+
+float GuidingField::sample(const Point3f& p, const Point2f& sample, Vector3f& w) const
+{
+    const DiscretePDF& dpdf = m_leaves[leafAt(p)].dpdf;
+
+    // The bin, then a uniform direction inside it (reusing the first dimension)
+    float u = sample.x(), binPdf;
+    size_t bin = dpdf.sampleReuse(u, binPdf);
+    int cosThetaBin = (int)bin / PhiBins, phiBin = (int)bin % PhiBins;
+    float cosTheta = std::min(1.f, std::max(-1.f, -1.f + 2.f * (cosThetaBin + u) / CosThetaBins));
+    float sinTheta = std::sqrt(std::max(0.f, 1.f - cosTheta * cosTheta));
+    float phi = 2.f * M_PI * (phiBin + sample.y()) / PhiBins;
+    w = Vector3f(sinTheta * std::cos(phi), sinTheta * std::sin(phi), cosTheta);
+
+    return binPdf * Bins * INV_FOURPI;
+}
+
+float GuidingField::pdf(const Point3f& p, const Vector3f& w) const
+{
+    int32_t leaf = leafAt(p);
+    if(leaf < 0 || m_leaves[leaf].dpdf.size() != Bins)
+        return 0.f;
+    return m_leaves[leaf].dpdf[binOf(w)] * Bins * INV_FOURPI;
+}
+
+int32_t GuidingField::leafAt(const Point3f& p) const
+{
+    if(m_nodes.empty() || !m_bbox.contains(p))
+        return -1;
+    uint32_t index = 0;
+    while(m_nodes[index].axis >= 0)
+    {
+        const Node& node = m_nodes[index];
+        index = node.child + (p[node.axis] < node.split ? 0 : 1);
+    }
+    return (int32_t)m_nodes[index].child;
+}
+
+int GuidingField::binOf(const Vector3f& w) const
+{
+    int cosThetaBin = std::min(CosThetaBins - 1, std::max(0, (int)((w.z() + 1.f) * 0.5f * CosThetaBins)));
+    float phi = std::atan2(w.y(), w.x());
+    if(phi < 0.f)
+        phi += 2.f * M_PI;
+    int phiBin = std::min(PhiBins - 1, std::max(0, (int)(phi * INV_TWOPI * PhiBins)));
+    return cosThetaBin * PhiBins + phiBin;
+}
+
+NORI_NAMESPACE_END
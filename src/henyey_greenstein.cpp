@@ -60,7 +60,8 @@ public:
     /// Draw a a sample from the BRDF model
     float sample(PFQueryRecord &pRec, const Point2f &sample) const
     {
-        pRec.wo = Warp::squareToHenyeyGreenstein(sample, g);
+        /// Around wi, as eval() and pdf() measure the angle against it
+        pRec.wo = Frame(pRec.wi).toWorld(Warp::squareToHenyeyGreenstein(sample, g));
         float retVal = eval(pRec);
         pRec.m_pdf = pdf(pRec);
         //std::cout << "WO: " << pRec.wo.toString() << std::endl;
@@ -72,6 +73,12 @@ public:
         return g;
     }
 
+    /// eval() measures the angle against wi, which points back along the propagation direction
+    float getMeanCosine() const
+    {
+        return -g;
+    }
+
     /// TODO: Is this always constant?????
     const Color3f get_mu_s() const
     {
@@ -171,6 +171,7 @@ int main(int argc, char **argv) {
 
     bool nogui = false;
     std::string sceneName = "";
+    int firstFrame = -1, lastFrame = -1;
 
     for (int i = 1; i < argc; ++i) {
         std::string token(argv[i]);
@@ -190,6 +191,20 @@ int main(int argc, char **argv) {
         }
         else if(token == "--nogui" || token == "-b")
             nogui = true;
+        else if(token == "--frames") {
+            /// Render an animated volume sequence, one image per frame
+            if (i+2 >= argc) {
+                cerr << "\"--frames\" argument expects the first and last frame following it." << endl;
+                return -1;
+            }
+            firstFrame = atoi(argv[i+1]);
+            lastFrame = atoi(argv[i+2]);
+            i += 2;
+            if (firstFrame < 0 || lastFrame < firstFrame) {
+                cerr << "\"--frames\" argument expects 0 <= first <= last." << endl;
+                return -1;
+            }
+        }
         else
         {
             filesystem::path path(argv[i]);
@@ -232,11 +247,28 @@ int main(int argc, char **argv) {
 
     if (sceneName != "") {
         try {
-            std::unique_ptr<NoriObject> root(loadFromXML(argv[1]));
+            std::unique_ptr<NoriObject> root(loadFromXML(sceneName));
 
             /* When the XML root object is a scene, start rendering it .. */
             if (root->getClassType() == NoriObject::EScene)
-                render(static_cast<Scene*>(root.get()), argv[1], nogui);
+            {
+                Scene* scene = static_cast<Scene*>(root.get());
+                if (firstFrame < 0)
+                    render(scene, sceneName, nogui);
+                else
+                {
+                    std::string baseName = sceneName;
+                    size_t lastdot = baseName.find_last_of(".");
+                    if (lastdot != std::string::npos)
+                        baseName.erase(lastdot, std::string::npos);
+
+                    /* The next frame is loaded in the background while the current one renders */
+                    for (int frame = firstFrame; frame <= lastFrame; ++frame) {
+                        scene->setFrame(frame, frame < lastFrame);
+                        render(scene, tfm::format("%s_%04i.xml", baseName, frame), nogui);
+                    }
+                }
+            }
         }
         catch (const std::exception& e) {
             cerr << "[FATAL ERROR]: " << e.what() << endl;
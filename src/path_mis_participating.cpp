@@ -4,51 +4,483 @@
 #include <nori/emitter.h>
 #include <nori/bsdf.h>
 #include <nori/volume.h>
+#include <nori/mediumstack.h>
 #include <nori/phasefunction.h>
+#include <nori/radiancecache.h>
+#include <nori/guiding.h>
+#include <nori/adrrs.h>
+#include <nori/transmittancecache.h>
+#include <nori/mesh.h>
+#include <nori/camera.h>
+#include <nori/sampler.h>
+#include <nori/timer.h>
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
 #include <exception>
+#include <unordered_map>
 
 NORI_NAMESPACE_BEGIN
 
 class PathTracingMISParticipatingMedia : public Integrator
 {
+    /// Part of a path segment that crosses some medium, where equiangular sampling places its points.
+    /// medium is the one the segment is in, or nullptr with combined_media (all media are tracked at once),
+    /// and media the media its points are in
+    struct MediumSpan {
+        Ray3f ray;
+        float tMin = 0.f, tMax = 0.f;
+        const Volume* medium = nullptr;
+        MediumStack media;
+        bool valid = false;
+    };
+
+    /// Medium vertex of a training path: the radiance gathered before its continuation and the throughput
+    /// after it, from which the radiance arriving along the continuation is recovered once the path ends
+    struct GuidingVertex {
+        Point3f p;
+        Vector3f wo;
+        Color3f L;
+        Color3f beta;
+        float pdf;
+    };
+
+    /// Vertex of a training path for the adjoint estimate: the radiance gathered and the throughput before it scatters
+    struct AdjointVertex {
+        Point3f p;
+        Color3f L;
+        Color3f beta;
+    };
+
+    /// State of a path between vertices, from which split copies go on (see AdjointRRS::split())
+    struct PathState {
+        Color3f beta = Color3f(1.f);
+        Point3f prevP;
+        float prevPdf = 0.f;
+        bool specularBounce = false;
+        bool prevSingleScattered = false;
+        int bounces = 0;
+        /// Mean radiance (luminance) of the pixel of the path, the target of adjoint-driven roulette (0 if unknown)
+        float pixelEstimate = 0.f;
+    };
+
+    /// Homogeneous medium where diffusion jumps happen: distances to the closest surface at the centers of a grid over its bounds
+    struct DiffusionMedium {
+        static constexpr int Resolution = 16;
+        BoundingBox3f bounds;
+        std::vector<float> clearance;
+
+        Point3f cellCenter(int x, int y, int z) const
+        {
+            return bounds.min + bounds.getExtents().cwiseProduct(Vector3f(x + 0.5f, y + 0.5f, z + 0.5f)) / (float)Resolution;
+        }
+
+        /// Lower bound of the distance from p to the closest surface (distances change no faster than p moves away from the center)
+        float clearanceAt(const Point3f& p) const
+        {
+            if(!bounds.contains(p))
+                return 0.f;
+            Vector3f rel = (p - bounds.min).cwiseQuotient(bounds.getExtents()) * (float)Resolution;
+            int x = std::min(Resolution - 1, std::max(0, (int)rel.x()));
+            int y = std::min(Resolution - 1, std::max(0, (int)rel.y()));
+            int z = std::min(Resolution - 1, std::max(0, (int)rel.z()));
+            return clearance[(z * Resolution + y) * Resolution + x] - (p - cellCenter(x, y, z)).norm();
+        }
+    };
+
 public:
-    PathTracingMISParticipatingMedia(const PropertyList &props){ }
+    PathTracingMISParticipatingMedia(const PropertyList &props)
+    {
+        /// Level of detail of heterogeneous densities: from lod_start_depth on (-1 disables it),
+        /// every lod_depth_step bounces we go one level coarser in the mip pyramid, up to lod_max_level
+        m_lod_start_depth = props.getInteger("lod_start_depth", -1);
+        m_lod_depth_step = std::max(1, props.getInteger("lod_depth_step", 2));
+        m_lod_max_level = props.getInteger("lod_max_level", 3);
+
+        /// Track every medium overlapping a ray at once through the VolumeBVH of the scene, instead of
+        /// switching the current medium at each volume boundary (where overlapping media are not handled)
+        m_combined_media = props.getBoolean("combined_media", false);
+
+        /// Radiance cache: paths terminate into it at medium vertices from cache_depth bounces on. It is built
+        /// before rendering over the media bounds, cache_resolution cells along the longest axis, with
+        /// cache_samples pilot paths per cell. Biased (isotropic, interpolated), but much faster for high albedo media
+        m_radiance_cache = props.getBoolean("radiance_cache", false);
+        m_cache_depth = std::max(1, props.getInteger("cache_depth", 4));
+        m_cache_resolution = std::max(1, props.getInteger("cache_resolution", 16));
+        m_cache_samples = std::max(1, props.getInteger("cache_samples", 64));
+
+        /// Equiangular sampling: on every path segment through a medium, one more scattering point is placed
+        /// towards a point or area light, MIS-combined with the collisions. For lights inside the media
+        m_equiangular = props.getBoolean("equiangular", false);
+
+        /// Single scattering: camera rays through homogeneous media get the light they in-scatter once from point and
+        /// area lights by quadrature, over single_scattering_nodes points along the ray, instead of from their collisions
+        m_single_scattering = props.getBoolean("single_scattering", false);
+        m_single_scattering_nodes = std::max(1, props.getInteger("single_scattering_nodes", 8));
+
+        /// Path guiding: before rendering, guiding_iterations rounds of guiding_spp paths per pixel learn where
+        /// the radiance arriving at the media comes from. Medium vertices then sample their continuation from
+        /// that distribution with probability guiding_fraction, and from the phase function otherwise
+        m_guiding = props.getBoolean("guiding", false);
+        m_guiding_iterations = std::max(1, props.getInteger("guiding_iterations", 4));
+        m_guiding_spp = std::max(1, props.getInteger("guiding_spp", 1));
+        m_guiding_fraction = std::min(1.f, std::max(0.f, props.getFloat("guiding_fraction", 0.5f)));
+
+        /// Shadow cache: before rendering, the transmittance towards every point and area light is cached over the
+        /// heterogeneous media (shadow_cache_resolution cells along the longest axis, shadow_cache_samples shadow rays
+        /// per vertex). Shadow rays from medium vertices where the cache is under shadow_cache_threshold are tracked
+        /// only with probability proportional to it (Russian roulette, unbiased), or with shadow_cache_biased they
+        /// just read the cached transmittance
+        m_shadow_cache = props.getBoolean("shadow_cache", false);
+        m_shadow_cache_resolution = std::max(1, props.getInteger("shadow_cache_resolution", 24));
+        m_shadow_cache_samples = std::max(1, props.getInteger("shadow_cache_samples", 8));
+        m_shadow_cache_threshold = std::max(0.f, props.getFloat("shadow_cache_threshold", 0.1f));
+        m_shadow_cache_biased = props.getBoolean("shadow_cache_biased", false);
+
+        /// Diffusion: medium vertices of dense homogeneous media that are at least diffusion_depth transport mean free paths
+        /// away from any boundary skip the random walk inside that sphere, jumping to its surface with the survival that
+        /// diffusion theory predicts. Biased (no light sampling inside the sphere), but dense high albedo media no longer
+        /// need hundreds of scattering events per path. Not available with combined_media
+        m_diffusion = props.getBoolean("diffusion", false);
+        m_diffusion_depth = std::max(1.f, props.getFloat("diffusion_depth", 8.f));
+
+        /// Adjoint-driven Russian roulette and splitting (ADRRS): before rendering, adrrs_iterations rounds of adrrs_spp
+        /// paths per pixel learn a coarse estimate of the radiance leaving the vertices (adrrs_resolution cells along the
+        /// longest axis of the scene). Paths whose expected contribution falls well below that of their first vertex are
+        /// killed, and those well above it are split into up to adrrs_max_split copies. Unbiased
+        m_adrrs = props.getBoolean("adrrs", false);
+        m_adrrs_iterations = std::max(1, props.getInteger("adrrs_iterations", 4));
+        m_adrrs_spp = std::max(1, props.getInteger("adrrs_spp", 1));
+        m_adrrs_resolution = std::max(1, props.getInteger("adrrs_resolution", 32));
+        m_adrrs_max_split = std::max(1, props.getInteger("adrrs_max_split", 8));
+        m_adjoint = AdjointRRS(m_adrrs_max_split);
+    }
+
+    void preprocess(const Scene* scene)
+    {
+        // Guiding goes first, so the pilot paths of the cache are guided too
+        if(m_guiding)
+            trainGuiding(scene);
+        // Before the cache too, its pilot paths already use the learned roulette
+        if(m_adrrs)
+            trainAdjoint(scene);
+        if(m_radiance_cache)
+            buildRadianceCache(scene);
+        if(m_shadow_cache)
+            buildShadowCaches(scene);
+        if(m_diffusion)
+            gatherDiffusionBounds(scene);
+    }
+
+    /// Clearance grids of the homogeneous media where diffusion jumps happen
+    void gatherDiffusionBounds(const Scene* scene)
+    {
+        m_diffusion_media.clear();
+        for(const Mesh* mesh : scene->getMeshes())
+        {
+            if(mesh->isVolume() && !mesh->getVolume()->isHeterogeneous())
+                m_diffusion_media[mesh->getVolume().get()] = buildClearance(scene, mesh);
+        }
+        if(m_combined_media)
+            std::cout << "Diffusion: not available with combined_media, ignored" << std::endl;
+    }
+
+    /// Distance to the closest surface at the cell centers of a grid on the bounds of the (closed) volume mesh,
+    /// with nearest surface queries on the scene BVH
+    DiffusionMedium buildClearance(const Scene* scene, const Mesh* volumeMesh) const
+    {
+        DiffusionMedium dm;
+        dm.bounds = volumeMesh->getBoundingBox();
+        dm.clearance.resize(DiffusionMedium::Resolution * DiffusionMedium::Resolution * DiffusionMedium::Resolution);
+
+        const Accel* accel = scene->getAccel();
+        tbb::parallel_for(tbb::blocked_range<int>(0, (int)dm.clearance.size()), [&](const tbb::blocked_range<int>& range) {
+            for(int i = range.begin(); i < range.end(); i++)
+            {
+                int x = i % DiffusionMedium::Resolution;
+                int y = (i / DiffusionMedium::Resolution) % DiffusionMedium::Resolution;
+                int z = i / (DiffusionMedium::Resolution * DiffusionMedium::Resolution);
+                dm.clearance[i] = accel->closestDistance(dm.cellCenter(x, y, z));
+            }
+        });
+        return dm;
+    }
+
+    /// One transmittance cache per light that has a position to aim at, over the heterogeneous media
+    void buildShadowCaches(const Scene* scene)
+    {
+        BoundingBox3f bbox;
+        for(const Mesh* mesh : scene->getMeshes())
+            if(mesh->isVolume() && mesh->getVolume()->isHeterogeneous())
+                bbox.expandBy(mesh->getBoundingBox());
+        if(!bbox.isValid())
+        {
+            std::cout << "Shadow cache: the scene has no heterogeneous media, nothing to cache" << std::endl;
+            return;
+        }
+
+        Timer timer;
+        const std::vector<Emitter*>& lights = scene->getLights();
+        for(size_t i = 0; i < lights.size(); i++)
+        {
+            const Emitter* em = lights[i];
+            if(!coversEquiangular(em))
+                continue;
+            // Media only: surfaces are left to the shadow ray itself
+            m_shadow_caches[em].build(bbox, m_shadow_cache_resolution, m_shadow_cache_samples, scene->getSampler(), -256 - (int)i,
+                [&](Sampler* sampler, const Point3f& p) {
+                    EmitterQueryRecord emitterRecord(p);
+                    em->sample(emitterRecord, sampler->next2D(), 0.f);
+                    if(!(emitterRecord.dist > Epsilon))
+                        return Color3f(1.f);
+                    return scene->getVolumeBVH().transmittance(sampler, Ray3f(p, emitterRecord.wi), emitterRecord.dist - Epsilon, 0);
+                });
+        }
+        std::cout << "Built shadow caches: " << m_shadow_caches.size() << " lights, resolution " << m_shadow_cache_resolution
+            << ", " << m_shadow_cache_samples << " shadow rays per vertex (took " << timer.elapsedString() << ")" << std::endl;
+    }
+
+    /// Traces spp paths per pixel and turns their vertices into training records (for guiding and/or the adjoint estimate),
+    /// and their radiance into the mean luminance of every pixel. Rows are seeded with Sampler::prepareStream(), seed being their stream
+    void trainingPass(const Scene* scene, int spp, int seed, std::vector<GuidingField::Record>* guidingRecords,
+        std::vector<AdjointField::Record>* adjointRecords, std::vector<float>* pixelLuminance = nullptr) const
+    {
+        const Camera* camera = scene->getCamera();
+        Vector2i size = camera->getOutputSize();
+        if(pixelLuminance)
+            pixelLuminance->assign((size_t)size.x() * size.y(), 0.f);
+        std::vector<std::vector<GuidingField::Record>> rowGuiding(size.y());
+        std::vector<std::vector<AdjointField::Record>> rowAdjoint(size.y());
+        tbb::parallel_for(tbb::blocked_range<int>(0, size.y()), [&](const tbb::blocked_range<int>& range) {
+            std::unique_ptr<Sampler> sampler(scene->getSampler()->clone());
+            std::vector<GuidingVertex> vertices;
+            std::vector<AdjointVertex> adjointVertices;
+            for(int y = range.begin(); y < range.end(); y++)
+            {
+                sampler->prepareStream(y, seed);
+                for(int x = 0; x < size.x(); x++)
+                {
+                    // Camera paths start with the pixel estimate of the previous passes, for adjoint-driven roulette
+                    PathState start;
+                    start.pixelEstimate = m_adrrs ? m_adjoint.getPixelEstimate(Point2i(x, y)) : 0.f;
+                    double pixelSum = 0.;
+                    int pixelCount = 0;
+                    for(int s = 0; s < spp; s++)
+                    {
+                        Ray3f ray;
+                        Point2f pixelSample = Point2f((float)x, (float)y) + sampler->next2D();
+                        camera->sampleRay(ray, pixelSample, sampler->next2D());
+                        MediumStack media(scene->getEnviromentalVolumeMedium().get());
+                        vertices.clear();
+                        adjointVertices.clear();
+                        start.prevP = ray.o;
+                        Color3f L = LiRec(scene, sampler.get(), ray, media, 0, guidingRecords ? &vertices : nullptr,
+                            adjointRecords ? &adjointVertices : nullptr, &start);
+                        if(!L.isValid())
+                            continue;
+                        pixelSum += L.getLuminance();
+                        pixelCount++;
+                        for(const GuidingVertex& v : vertices)
+                        {
+                            // Radiance along the continuation: what the path gathered after the vertex, over the throughput there
+                            float throughput = v.beta.getLuminance();
+                            if(throughput <= 0.f || v.pdf <= 0.f)
+                                continue;
+                            float Lin = std::max(0.f, Color3f(L - v.L).getLuminance()) / throughput;
+                            rowGuiding[y].push_back(GuidingField::Record{v.p, v.wo, Lin / v.pdf});
+                        }
+                        for(const AdjointVertex& v : adjointVertices)
+                        {
+                            float throughput = v.beta.getLuminance();
+                            if(throughput > 0.f)
+                                rowAdjoint[y].push_back(AdjointField::Record{v.p, std::max(0.f, Color3f(L - v.L).getLuminance()) / throughput});
+                        }
+                    }
+                    if(pixelLuminance && pixelCount > 0)
+                        (*pixelLuminance)[(size_t)y * size.x() + x] = (float)(pixelSum / pixelCount);
+                }
+            }
+        });
+
+        for(int y = 0; y < size.y(); y++)
+        {
+            if(guidingRecords)
+                guidingRecords->insert(guidingRecords->end(), rowGuiding[y].begin(), rowGuiding[y].end());
+            if(adjointRecords)
+                adjointRecords->insert(adjointRecords->end(), rowAdjoint[y].begin(), rowAdjoint[y].end());
+        }
+    }
+
+    /// Learns the guiding distributions, every round sampling with the ones of the previous round
+    void trainGuiding(const Scene* scene)
+    {
+        Timer timer;
+        m_guide.init(scene->getBoundingBox(), 1000);
+        for(int iteration = 0; iteration < m_guiding_iterations; iteration++)
+        {
+            std::vector<GuidingField::Record> records;
+            trainingPass(scene, m_guiding_spp, -16 - iteration, &records, nullptr);
+            m_guide.update(records);
+            std::cout << "Guiding iteration " << iteration + 1 << "/" << m_guiding_iterations << ": "
+                << records.size() << " records, " << m_guide.getLeafCount() << " cells" << std::endl;
+        }
+        std::cout << "Trained guiding distributions (took " << timer.elapsedString() << ")" << std::endl;
+    }
+
+    /// Learns the adjoint estimate, every round killing and splitting paths with the estimate of the previous rounds
+    void trainAdjoint(const Scene* scene)
+    {
+        Timer timer;
+        m_adjoint.init(scene->getBoundingBox(), m_adrrs_resolution, scene->getCamera()->getOutputSize());
+        for(int iteration = 0; iteration < m_adrrs_iterations; iteration++)
+        {
+            std::vector<AdjointField::Record> records;
+            std::vector<float> pixelLuminance;
+            trainingPass(scene, m_adrrs_spp, -64 - iteration, nullptr, &records, &pixelLuminance);
+            m_adjoint.update(records, pixelLuminance);
+            std::cout << "ADRRS iteration " << iteration + 1 << "/" << m_adrrs_iterations << ": "
+                << records.size() << " records, " << m_adjoint.getTrainedCount() << " cells" << std::endl;
+        }
+        std::cout << "Trained adjoint estimate (took " << timer.elapsedString() << ")" << std::endl;
+    }
+
+    void buildRadianceCache(const Scene* scene)
+    {
+        // Bounds of the bounded media, the global one (if any) is only cached inside them
+        BoundingBox3f bbox;
+        for(const Mesh* mesh : scene->getMeshes())
+            if(mesh->isVolume())
+                bbox.expandBy(mesh->getBoundingBox());
+        if(!bbox.isValid())
+        {
+            std::cout << "Radiance cache: the scene has no bounded media, nothing to cache" << std::endl;
+            return;
+        }
+
+        m_cache.build(bbox, m_cache_resolution, m_cache_samples, scene->getSampler(),
+            [&](const Point3f& p) {
+                return !scene->getVolumeBVH().extinction(p, 0).isZero();
+            },
+            [&](Sampler* sampler, const Point3f& p, const Vector3f& wi) {
+                // Full paths (the cache is still empty) starting inside the medium that holds p
+                MediumStack media = mediaAt(scene, p);
+                return LiRec(scene, sampler, Ray3f(p, wi), media, 0);
+            });
+    }
     
     Color3f Li(const Scene* scene, Sampler* sampler, const Ray3f& ray) const
     {
         /// TODO: We assume that the medium the camera is inside is the global one
-        std::shared_ptr<Volume> currentVolumeMedium = scene->getEnviromentalVolumeMedium();
-        return LiRec(scene, sampler, ray, currentVolumeMedium, 0);
+        MediumStack media(scene->getEnviromentalVolumeMedium().get());
+        if(!m_adrrs)
+            return LiRec(scene, sampler, ray, media, 0);
+
+        /// Adjoint-driven roulette weighs the path against the estimate of its pixel
+        PathState start;
+        start.prevP = ray.o;
+        Point2f pixel;
+        if(scene->getCamera()->getPixelPosition(ray.d, pixel))
+            start.pixelEstimate = m_adjoint.getPixelEstimate(Point2i((int)pixel.x(), (int)pixel.y()));
+        return LiRec(scene, sampler, ray, media, 0, nullptr, nullptr, &start);
     }
 
-    Color3f LiRec(const Scene* scene, Sampler* sampler, Ray3f ray, std::shared_ptr<Volume>& currentVolumeMedium, int depth) const
+    /// media holds the media the path is in, and is updated as it crosses volume boundaries.
+    /// vertices, if given, gets the medium vertices of the path for guiding training, and adjointVertices
+    /// its scattering vertices for adjoint training. The path goes on from resume, if given: split copies, and camera
+    /// paths that carry the estimate of their pixel
+    Color3f LiRec(const Scene* scene, Sampler* sampler, Ray3f ray, MediumStack& media, int depth,
+        std::vector<GuidingVertex>* vertices = nullptr, std::vector<AdjointVertex>* adjointVertices = nullptr,
+        const PathState* resume = nullptr) const
     {
         /// TODO: Change this for testing and faster rendering, I guess
         const int maxDepth = 9999999999;
 
-        bool specularBounce = false;
         Color3f L(0.f);
-        Color3f beta(1.f, 1.f, 1.f);     //Same notation as PBR Book, this would be Tr() / p(t) or Tr() / 1-cdf() depending on the interaction
+        PathState path;
+        if(resume)
+            path = *resume;
+        else
+            path.prevP = ray.o;
+        Color3f& beta = path.beta;     //Same notation as PBR Book, this would be Tr() / p(t) or Tr() / 1-cdf() depending on the interaction
+        bool& specularBounce = path.specularBounce;
+
+        /// The continuation sampled at a vertex is also its indirect MIS sample: the emission it reaches is weighted
+        /// against the light sampling done there, with the vertex position and the density of its direction
+        Point3f& prevP = path.prevP;
+        float& prevPdf = path.prevPdf;
+        bool& prevSingleScattered = path.prevSingleScattered;      // The previous vertex had its single scattering done by quadrature
+
+        /// Copies of a split path go on in the media the path is in at the vertex
+        auto traceSplit = [&](PathState& split, Ray3f& splitRay) {
+            MediumStack splitMedia = media;
+            return LiRec(scene, sampler, splitRay, splitMedia, 0, nullptr, nullptr, &split);
+        };
 
-        for(int bounces = 0; ; ++bounces)
+        for(int bounces = path.bounces; ; ++bounces)
         {
             //std::cout << "---------------------------------------------------" << std::endl;
             Intersection its;
             Point3f xt;
-            bool foundIntersection = scene->rayIntersect(ray, its); 
-            std::shared_ptr<Volume> nextVolumeMedium;
+            bool foundIntersection;
+            const Volume* medium = media.current();     // The one that scatters at a medium vertex
             bool sampledMedium = false;
+            bool singleScattered = false;
+            bool rouletteDone = false;      // Adjoint-driven roulette already decided at this vertex
+            MediumSpan span;
 
+            if(m_combined_media)
+            {
+                /// Volume boundaries are not path vertices here, the media are all tracked together
+                foundIntersection = scene->rayIntersectSurface(ray, its);
+                float t;
+                Color3f weight, albedo;
+                float tMax = foundIntersection ? its.t : std::numeric_limits<float>::infinity();
+                if(m_equiangular)
+                {
+                    span = mediumSpan(scene, media, ray, tMax);
+                    L += beta * equiangularSampling(scene, sampler, span, lodForDepth(bounces));
+                }
+                sampledMedium = scene->getVolumeBVH().sampleCollision(sampler, ray, tMax, lodForDepth(bounces), t, medium, weight, albedo);
+                beta *= weight;
+                if(sampledMedium)
+                {
+                    xt = ray(t);
+                    if((bounces == 0 || specularBounce) && !scene->getEmissiveVolumes().empty())
+                        L += beta * scene->getVolumeBVH().emissionAtCollision(xt, lodForDepth(bounces));
+                    beta *= albedo;
+                }
+            }
+            /// Precomputed media (i.e. an atmosphere) give the in-scattering of the whole segment at once, the path goes through them
+            else if(medium && medium->isPrecomputed())
+            {
+                foundIntersection = scene->rayIntersect(ray, its);
+                Color3f tr;
+                L += beta * medium->precomputedScattering(ray, foundIntersection ? its.t : std::numeric_limits<float>::infinity(), tr);
+                beta *= tr;
+            }
             /// If we intersect anything and our current ray comes from any medium
             /// Sample the participating medium, if present
-            if(foundIntersection && currentVolumeMedium)
+            else if((foundIntersection = scene->rayIntersect(ray, its)) && medium)
             {
                 // The intersection distance will be stored in its.t
                 // So we sample an interaction
                 // And later we will check if it's < its.t or >= its.t to get a medium interaction or geometry intersection
+                singleScattered = m_single_scattering && bounces == 0 && !medium->isHeterogeneous();
+                if(singleScattered)
+                    L += beta * singleScattering(scene, sampler, medium, media, ray, its.t);
+                else if(m_equiangular)
+                {
+                    span = mediumSpan(scene, media, ray, its.t);
+                    L += beta * equiangularSampling(scene, sampler, span, lodForDepth(bounces));
+                }
                 Color3f _beta(1.f);
-                xt = currentVolumeMedium->samplePathStep(ray, its, sampler, _beta, nextVolumeMedium, currentVolumeMedium, sampledMedium);
+                Color3f betaPrev = beta;        // Throughput before the free-flight sampling weight
+                xt = medium->samplePathStep(ray, its, sampler, _beta, sampledMedium, lodForDepth(bounces));
                 beta *= _beta;
+
+                /// Volumetric emission: like with surface emitters, only segments that next event estimation
+                /// did not account for use the collision estimator. Before the isBlack check, as purely absorbing media emit too
+                if(sampledMedium && (bounces == 0 || specularBounce) && medium->isEmissive())
+                    L += betaPrev * medium->emissionAtCollision(xt);
             }
 
             if(sqrt(beta.abs2().sum()) < Epsilon) // isBlack check
@@ -60,74 +492,100 @@ public:
             if(sampledMedium)
             {
                 if(bounces >= maxDepth) break;              //check this
-                L += beta * inscattering(scene, sampler, currentVolumeMedium, xt, ray.d);
-                PFQueryRecord pfqr(-ray.d);
-                currentVolumeMedium->getPhaseFunction()->sample(pfqr, sampler->next2D());
-                ray = Ray3f(xt, pfqr.wo);
-                specularBounce = false;
+
+                /// Deep enough: the cache holds the rest of the path (the in-scattered radiance at xt)
+                Color3f Lcache;
+                if(bounces >= m_cache_depth && m_cache.isBuilt() && m_cache.lookup(xt, Lcache))
+                {
+                    L += beta * Lcache;
+                    break;
+                }
+                if(adjointVertices)
+                    adjointVertices->push_back(AdjointVertex{xt, L, beta});
+                int copies = 1;
+                if(m_adrrs && (copies = m_adjoint.copies(sampler, xt, path.pixelEstimate, beta, rouletteDone)) == 0)
+                    break;
+                /// Whether the path goes on with a diffusion jump is known beforehand, light sampling takes it into account
+                float jumpRadius = diffusionRadius(medium, xt);
+                L += beta * inscattering(scene, sampler, medium, media, xt, ray.d, lodForDepth(bounces), &span, singleScattered, jumpRadius > 0.f);
+                const PhaseFunction* pf = medium->getPhaseFunction().get();
+                Vector3f wo = -ray.d;
+                L += beta * volumeEmissionSampling(scene, sampler, media, xt, [&](const Vector3f& wi) {
+                    PFQueryRecord pfRecord(wo, wi);
+                    return Color3f(pf->eval(pfRecord));
+                }, lodForDepth(bounces));
+                L += AdjointRRS::split(copies, bounces, path, [&](PathState& split, Ray3f& splitRay) {
+                    return continueFromMedium(sampler, medium, xt, ray.d, singleScattered, jumpRadius, split, splitRay);
+                }, traceSplit);
+                Vector3f wi = ray.d;
+                if(!continueFromMedium(sampler, medium, xt, wi, singleScattered, jumpRadius, path, ray))
+                    break;
+                if(vertices && m_guiding && !specularBounce)
+                    vertices->push_back(GuidingVertex{xt, ray.d, L, beta, prevPdf});
             }
             else
             {
-
-                if(bounces == 0 || specularBounce)
+                /// Emission reached by the path: in full from the camera and after discrete bounces (light sampling
+                /// cannot find it), otherwise weighted against the light sampling of the previous vertex
+                bool fullEmission = bounces == 0 || specularBounce;
+                if(!foundIntersection)
                 {
-                    if(foundIntersection)
-                    {
-                        if(its.mesh->isEmitter())
-                        {
-                            EmitterQueryRecord er(its.mesh->getEmitter(), ray.o, its.p, its.shFrame.n, its.uv);
-                            L += beta * its.mesh->getEmitter()->eval(er);
-                            return L;           /// TODO: ojo! a lo mejor este return sobra!
-                        }
-                    }
-                    else
+                    const Emitter* env = scene->getEnvironmentalEmitter();
+                    if(env)
                     {
-                        L += beta * scene->getBackground(ray);
-                        return L;               /// TODO: ojo! a lo mejor este return sobra!
+                        EmitterQueryRecord envRecord(prevP);
+                        envRecord.wi = ray.d;
+                        L += beta * scene->getBackground(ray) * (fullEmission ? 1.f : emitterHitWeight(scene, env, envRecord, prevPdf));
                     }
+                    break;
+                }
+                if(its.mesh->isEmitter() && !(prevSingleScattered && coversEquiangular(its.mesh->getEmitter())))
+                {
+                    const Emitter* em = its.mesh->getEmitter();
+                    EmitterQueryRecord er(em, prevP, its.p, its.shFrame.n, its.uv);
+                    er.pdf = its.mesh->pdf(its.p);
+                    L += beta * em->eval(er) * (fullEmission ? 1.f : emitterHitWeight(scene, em, er, prevPdf));
+                    if(fullEmission)
+                        return L;           /// TODO: ojo! a lo mejor este return sobra!
                 }
 
-                /// Terminate path if no intersection was found or maxDepth was reached
-                if(!foundIntersection || bounces >= maxDepth)
-                    break;  /// TODO: Revisar, si se va a la nada no tengo que ponerle la luz de fondo?
+                /// Terminate path if maxDepth was reached
+                if(bounces >= maxDepth)
+                    break;
                 
                 /// Skip over medium boundaries
                 if(its.mesh->isVolume())
                 {
                     ray = Ray3f(its.p, ray.d);  /// TODO: Sumo epsilon o no?
                     bounces--;
-                    
-                    if(!sampledMedium && currentVolumeMedium == nextVolumeMedium)
-                    {
-                        currentVolumeMedium = scene->getEnviromentalVolumeMedium();
-                    }
-                    else
-                    {
-                        currentVolumeMedium = nextVolumeMedium;
-                    }
+                    media.cross(its.mesh->getVolume().get());
                     continue;
                 }
 
-                /// Sample illumination from lights to find attenuated path contribution
-                L += beta * directLight(scene, sampler, currentVolumeMedium, its, ray.d);
+                if(adjointVertices)
+                    adjointVertices->push_back(AdjointVertex{its.p, L, beta});
+                int copies = 1;
+                if(m_adrrs && (copies = m_adjoint.copies(sampler, its.p, path.pixelEstimate, beta, rouletteDone)) == 0)
+                    break;
 
-                /// TODO: Creo que esto lo puedo hacer directamente en el UniformSampleOneLight (que mejor le dejo el nombre original o ké)
-                /// Sample BSDF to get new path direction
-                BSDFQueryRecord materialRecord = BSDFQueryRecord(its.toLocal(-ray.d), its.uv); //Esto me lo están sacando de los sample_direct, sample_material, sample_pf aquí para poder reusar el mismo método en todas partes
-                Color3f fs = its.mesh->getBSDF()->sample(materialRecord, sampler->next2D());
+                /// Sample illumination from lights to find attenuated path contribution
+                L += beta * directLight(scene, sampler, media, its, ray.d, lodForDepth(bounces));
+                const BSDF* bsdf = its.mesh->getBSDF();
+                L += beta * volumeEmissionSampling(scene, sampler, media, its.p, [&](const Vector3f& wi) {
+                    BSDFQueryRecord bRec(its.toLocal(-ray.d), its.toLocal(wi), its.uv, ESolidAngle);
+                    return Color3f(bsdf->eval(bRec) * std::abs(its.shFrame.n.dot(wi)));
+                }, lodForDepth(bounces));
 
-                /// TODO: revisar
-                if(sqrt(fs.abs2().sum()) < Epsilon || isnan(fs.x()) || isnan(fs.y()) || isnan(fs.z()))     // If isBlack() or pdf == 0 (which produces NaNs in fs)
-                {
+                L += AdjointRRS::split(copies, bounces, path, [&](PathState& split, Ray3f& splitRay) {
+                    return continueFromSurface(sampler, its, ray.d, split, splitRay);
+                }, traceSplit);
+                Vector3f wi = ray.d;
+                if(!continueFromSurface(sampler, its, wi, path, ray))
                     break;
-                }
-                beta *= fs;     //TODO: acomodar luego a lo que me vaya pidiendo el codiguín
-                specularBounce = !its.mesh->getBSDF()->isDiffuse();
-                ray = Ray3f(its.p + ray.d * Epsilon, its.toWorld(materialRecord.wo));
             }
 
             /// Possibly terminate the path with Russian Roulette
-            if(bounces > 3)
+            if(bounces > 3 && !rouletteDone)
             {
                 float rr = std::max(0.01f, 1 - beta.y());
                 if(sampler->next1D() < rr)
@@ -203,41 +661,306 @@ public:
     
     std::string toString() const
     {
-        return "Path Tracing Sampling Integrator for Single Scattering with Multiple Importance Sampling[]";
+        return tfm::format(
+            "Path Tracing Sampling Integrator for Single Scattering with Multiple Importance Sampling[\n"
+            "  lod_start_depth = %d\n"
+            "  lod_depth_step = %d\n"
+            "  lod_max_level = %d\n"
+            "  combined_media = %s\n"
+            "  radiance_cache = %s (cache_depth = %d, cache_resolution = %d, cache_samples = %d)\n"
+            "  equiangular = %s\n"
+            "  single_scattering = %s (single_scattering_nodes = %d)\n"
+            "  guiding = %s (guiding_iterations = %d, guiding_spp = %d, guiding_fraction = %f)\n"
+            "  shadow_cache = %s (shadow_cache_resolution = %d, shadow_cache_samples = %d, shadow_cache_threshold = %f, shadow_cache_biased = %s)\n"
+            "  diffusion = %s (diffusion_depth = %f)\n"
+            "  adrrs = %s (adrrs_iterations = %d, adrrs_spp = %d, adrrs_resolution = %d, adrrs_max_split = %d)\n"
+            "]", m_lod_start_depth, m_lod_depth_step, m_lod_max_level, m_combined_media,
+            m_radiance_cache, m_cache_depth, m_cache_resolution, m_cache_samples, m_equiangular,
+            m_single_scattering, m_single_scattering_nodes,
+            m_guiding, m_guiding_iterations, m_guiding_spp, m_guiding_fraction,
+            m_shadow_cache, m_shadow_cache_resolution, m_shadow_cache_samples, m_shadow_cache_threshold, m_shadow_cache_biased,
+            m_diffusion, m_diffusion_depth,
+            m_adrrs, m_adrrs_iterations, m_adrrs_spp, m_adrrs_resolution, m_adrrs_max_split);
     }
 
 private:
-    Color3f getCameraDirectIllumination(const Scene* scene, Sampler* sampler, const Ray3f& ray) const
+    int m_lod_start_depth;
+    int m_lod_depth_step;
+    int m_lod_max_level;
+    bool m_combined_media;
+    bool m_radiance_cache;
+    int m_cache_depth;
+    int m_cache_resolution;
+    int m_cache_samples;
+    RadianceCache m_cache;
+    bool m_equiangular;
+    bool m_single_scattering;
+    int m_single_scattering_nodes;
+    bool m_guiding;
+    int m_guiding_iterations;
+    int m_guiding_spp;
+    float m_guiding_fraction;
+    GuidingField m_guide;
+    bool m_shadow_cache;
+    int m_shadow_cache_resolution;
+    int m_shadow_cache_samples;
+    float m_shadow_cache_threshold;
+    bool m_shadow_cache_biased;
+    std::unordered_map<const Emitter*, TransmittanceCache> m_shadow_caches;
+    bool m_diffusion;
+    float m_diffusion_depth;
+    std::unordered_map<const Volume*, DiffusionMedium> m_diffusion_media;
+    bool m_adrrs;
+    int m_adrrs_iterations;
+    int m_adrrs_spp;
+    int m_adrrs_resolution;
+    int m_adrrs_max_split;
+    AdjointRRS m_adjoint;
+
+    /// Media a path starting at p is in: the volumes of the volume meshes whose bounds hold p, inside the enviromental one
+    MediumStack mediaAt(const Scene* scene, const Point3f& p) const
     {
-        return Color3f(0., 0., 0.);
+        MediumStack media(scene->getEnviromentalVolumeMedium().get());
+        for(const Mesh* mesh : scene->getMeshes())
+            if(mesh->isVolume() && mesh->getBoundingBox().contains(p))
+                media.cross(mesh->getVolume().get());
+        return media;
     }
 
-    float balanceHeuristic(float px_wx, float py_wx) const
+    /// Span of ray within (0, tMax) where equiangular sampling applies, for a path in media
+    MediumSpan mediumSpan(const Scene* scene, const MediumStack& media, const Ray3f& ray, float tMax) const
     {
-        return (px_wx / (px_wx + py_wx));
+        MediumSpan span;
+        span.ray = ray;
+        span.tMax = tMax;
+        span.media = media;
+        if(m_combined_media)
+            span.valid = scene->getVolumeBVH().clip(ray, span.tMin, span.tMax);
+        else
+        {
+            span.medium = media.current();
+            span.valid = span.medium && span.medium->getMajorant() > 0.f && tMax > 0.f;
+        }
+        return span;
     }
 
-    float powerHeuristic(float px_wx, float py_wx, float beta) const
+    /// Lights that equiangular sampling and the single scattering quadrature handle (they need a point to aim at)
+    bool coversEquiangular(const Emitter* em) const
     {
-        return (pow(px_wx, beta) / pow(px_wx + py_wx, beta));
+        return em->getEmitterType() == EmitterType::EMITTER_POINT || em->getEmitterType() == EmitterType::EMITTER_AREA;
+    }
+
+    /// Density of equiangular sampling of distance t on span, towards the light point y. 0 if y is on the ray
+    float equiangularPdf(const MediumSpan& span, const Point3f& y, float t) const
+    {
+        float delta, D, thetaA, thetaB;
+        if(!equiangularAngles(span, y, delta, D, thetaA, thetaB))
+            return 0.f;
+        return D / ((thetaB - thetaA) * (D * D + (t - delta) * (t - delta)));
     }
 
-    bool emitterShRayIntersectFree(const Scene *scene, Sampler* sampler, const Ray3f &sray, const EmitterQueryRecord& emitterRecord, std::shared_ptr<Volume> currVolMedium, std::vector<VolumetricSegmentRecord>& segs_shadow) const
+    /// delta is the distance along the ray to the projection of y, D the distance from y to the ray,
+    /// and [thetaA, thetaB] the angles under which the ends of the span are seen from y
+    bool equiangularAngles(const MediumSpan& span, const Point3f& y, float& delta, float& D, float& thetaA, float& thetaB) const
     {
-        float t;
-        if(!scene->shadowRayThroughVolumes(sampler, sray, currVolMedium, segs_shadow, t))
+        delta = (y - span.ray.o).dot(span.ray.d);
+        D = (span.ray(delta) - y).norm();
+        if(D < Epsilon)
+            return false;
+        thetaA = std::atan((span.tMin - delta) / D);
+        thetaB = std::isinf(span.tMax) ? float(0.5 * M_PI) : std::atan((span.tMax - delta) / D);
+        return thetaB > thetaA;
+    }
+
+    /// Deterministic stand-in for the density of distance sampling at distance t of span, mu_t exp(-mu_t (t - tMin))
+    /// with the extinction at that point. Exact for a single homogeneous medium, and any such function keeps the
+    /// MIS combination with equiangular sampling unbiased
+    float distancePdf(const Scene* scene, const MediumSpan& span, float t, int lod) const
+    {
+        Point3f x = span.ray(t);
+        Color3f mu_t = span.medium ? span.medium->extinction(x, lod) : scene->getVolumeBVH().extinction(x, lod);
+        float mu = mu_t.sum() / 3.f;
+        return mu * std::exp(-mu * (t - span.tMin));
+    }
+
+    /// MIS weight of a scattering point at distance t of span sampled by distance sampling, lit by light point y
+    float distanceWeight(const Scene* scene, const MediumSpan& span, const Point3f& y, float t, int lod) const
+    {
+        float pdfDistance = distancePdf(scene, span, t, lod);
+        float pdfEquiangular = equiangularPdf(span, y, t);
+        return pdfDistance > 0.f ? pdfDistance / (pdfDistance + pdfEquiangular) : 0.f;
+    }
+
+    /**
+     * \brief Equiangular sampling (Kulla and Fajardo 2012) of in-scattered light along span
+     *
+     * Picks a light and a point y on it like light sampling does, then a distance t on the span with
+     * density proportional to the inverse squared distance to y, so that lights inside the media do not
+     * produce the fireflies of distance sampling. Returns Tr(o, x) sum(mu_s f) Le Tr(x, y) G / pdf, weighted
+     * against distance sampling with distanceWeight() and against phase function sampling like
+     * emitterSamplingPF() does
+     */
+    Color3f equiangularSampling(const Scene* scene, Sampler* sampler, const MediumSpan& span, int lod) const
+    {
+        if(!span.valid)
+            return Color3f(0.f);
+        float pdflight;
+        const Emitter* em = scene->sampleEmitter(sampler->next1D(), pdflight);
+        EmitterQueryRecord lightRecord(span.ray.o);
+        em->sample(lightRecord, sampler->next2D(), 0.f);
+        float u = sampler->next1D();
+        float delta, D, thetaA, thetaB;
+        if(!coversEquiangular(em) || !equiangularAngles(span, lightRecord.p, delta, D, thetaA, thetaB))
+            return Color3f(0.f);
+
+        float t = delta + D * std::tan(thetaA + u * (thetaB - thetaA));
+        float pdf = D / ((thetaB - thetaA) * (D * D + (t - delta) * (t - delta)));
+        Point3f x = span.ray(t);
+        Vector3f wi = lightRecord.p - x;
+        float dist = wi.norm();
+        if(!(pdf > 0.f) || dist < Epsilon)
+            return Color3f(0.f);
+        wi /= dist;
+
+        /// The light as seen from x, with the weight light sampling gets against phase function sampling there
+        PFQueryRecord pfRecord(-span.ray.d, wi);
+        Color3f Le;
+        float w_light = 1.f;
+        if(em->isDelta())
         {
-            //std::cout << "emitterShRayIntersectFree NO INTERSECTA" << std::endl;
-            return true;
+            EmitterQueryRecord pointRecord(x);
+            Le = em->sample(pointRecord, Point2f(0.5f), 0.f);
         }
         else
         {
-           //std::cout << "emitterShRayIntersectFree SI INTERSECTA" << std::endl;
-            return (t > (emitterRecord.dist - Epsilon));            
+            EmitterQueryRecord areaRecord(em, x, lightRecord.p, lightRecord.n, lightRecord.uv);
+            areaRecord.pdf = lightRecord.pdf;
+            float pdfLight = em->pdf(areaRecord);
+            if(!(pdfLight > 0.f) || std::isinf(pdfLight))
+                return Color3f(0.f);
+            Le = em->eval(areaRecord) / pdfLight;
+            const Volume* medium = span.medium ? span.medium : mediaAt(scene, x).current();
+            w_light = balanceHeuristic(lightPdf(scene, em, areaRecord), continuationPdf(medium->getPhaseFunction().get(), x, pfRecord));
         }
+        if(Le.isZero())
+            return Color3f(0.f);
+
+        Color3f scattering;
+        if(span.medium)
+            scattering = span.medium->getAlbedo() * span.medium->extinction(x, lod) * span.medium->getPhaseFunction()->eval(pfRecord);
+        else
+            scattering = scene->getVolumeBVH().inScattering(x, lod, [&](const Volume& volume) {
+                return volume.getPhaseFunction()->eval(pfRecord);
+            });
+        if(scattering.isZero())
+            return Color3f(0.f);
+
+        Color3f trLight = scene->transmittanceTo(sampler, x, lightRecord.p, span.media, lod, m_combined_media);
+        if(trLight.isZero())
+            return Color3f(0.f);
+        Color3f trCamera = span.medium ? span.medium->transmittance(sampler, span.ray.o, x, lod)
+                                       : scene->getVolumeBVH().transmittance(sampler, span.ray, t, lod);
+
+        float w_equiangular = pdf / (pdf + distancePdf(scene, span, t, lod));
+        return trCamera * scattering * Le * trLight * (w_equiangular * w_light / (pdf * pdflight));
     }
 
-    Color3f emitterSampling(const Scene* scene, Sampler* sampler, std::shared_ptr<Volume> currentVolumeMedium, const Intersection& its, const Vector3f& w, float& w_mis_dir) const
+    /**
+     * \brief Single scattering along ray, up to tMax, inside the homogeneous medium
+     *
+     * Integrates Tr(o, x) mu_s f Le Tr(x, y) G over the segment for every point and area light, with nodes evenly
+     * spaced in the angle under which the light point y sees the ray: the equiangular change of variables cancels
+     * the inverse squared distance, so few nodes suffice even for lights right next to the ray. A single random
+     * offset is shared by all the nodes, and area lights use one sampled point for all of them. Light sampling
+     * and the emission hits of the first collision leave these lights to it (see LiRec())
+     */
+    Color3f singleScattering(const Scene* scene, Sampler* sampler, const Volume* medium, const MediumStack& media, const Ray3f& ray, float tMax) const
+    {
+        Color3f L(0.f);
+        MediumSpan span = mediumSpan(scene, media, ray, tMax);
+        if(!span.valid)
+            return L;
+        const PhaseFunction* pf = medium->getPhaseFunction().get();
+        Color3f mu_s = medium->getAlbedo() * medium->extinction(ray.o);
+        float offset = sampler->next1D();
+
+        for(const Emitter* em : scene->getLights())
+        {
+            if(!coversEquiangular(em))
+                continue;
+            EmitterQueryRecord lightRecord(ray.o);
+            em->sample(lightRecord, sampler->next2D(), 0.f);
+            float delta, D, thetaA, thetaB;
+            if(!equiangularAngles(span, lightRecord.p, delta, D, thetaA, thetaB))
+                continue;
+
+            float dTheta = (thetaB - thetaA) / m_single_scattering_nodes;
+            for(int i = 0; i < m_single_scattering_nodes; i++)
+            {
+                float t = delta + D * std::tan(thetaA + (i + offset) * dTheta);
+                Point3f x = ray(t);
+                Vector3f wi = lightRecord.p - x;
+                float dist = wi.norm();
+                if(dist < Epsilon)
+                    continue;
+                wi /= dist;
+
+                Color3f Le;
+                if(em->isDelta())
+                {
+                    EmitterQueryRecord pointRecord(x);
+                    Le = em->sample(pointRecord, Point2f(0.5f), 0.f);
+                }
+                else
+                {
+                    EmitterQueryRecord areaRecord(em, x, lightRecord.p, lightRecord.n, lightRecord.uv);
+                    areaRecord.pdf = lightRecord.pdf;
+                    float pdfLight = em->pdf(areaRecord);
+                    if(!(pdfLight > 0.f) || std::isinf(pdfLight))
+                        continue;
+                    Le = em->eval(areaRecord) / pdfLight;
+                }
+                PFQueryRecord pfRecord(-ray.d, wi);
+                Color3f scattering = mu_s * pf->eval(pfRecord) * Le;
+                if(scattering.isZero())
+                    continue;
+                Color3f trLight = scene->transmittanceTo(sampler, x, lightRecord.p, media, 0, false);
+                if(trLight.isZero())
+                    continue;
+
+                /// dt = (D^2 + (t - delta)^2) / D dtheta
+                float dt = dTheta * (D * D + (t - delta) * (t - delta)) / D;
+                L += medium->transmittance(sampler, ray.o, x) * scattering * trLight * dt;
+            }
+        }
+        return L;
+    }
+
+    /// Mip level used for density lookups at a given path depth. Late bounces barely
+    /// see high frequency detail, so they can use the (cache friendly) coarse levels
+    int lodForDepth(int depth) const
+    {
+        if(m_lod_start_depth < 0 || depth < m_lod_start_depth)
+            return 0;
+        return std::min(m_lod_max_level, 1 + (depth - m_lod_start_depth) / m_lod_depth_step);
+    }
+
+    Color3f getCameraDirectIllumination(const Scene* scene, Sampler* sampler, const Ray3f& ray) const
+    {
+        return Color3f(0., 0., 0.);
+    }
+
+    float balanceHeuristic(float px_wx, float py_wx) const
+    {
+        return (px_wx / (px_wx + py_wx));
+    }
+
+    float powerHeuristic(float px_wx, float py_wx, float beta) const
+    {
+        return (pow(px_wx, beta) / pow(px_wx + py_wx, beta));
+    }
+
+    Color3f emitterSampling(const Scene* scene, Sampler* sampler, const MediumStack& media, const Intersection& its, const Vector3f& w, float& w_mis_dir, int lod) const
     {
         Color3f Lems(0.f);
         float pdflight(1.f);
@@ -250,52 +973,87 @@ private:
 
         Color3f Le = em->sample(emitterRecord, sampler->next2D(), 0.f);
         
-        Ray3f shadowray(its.p, emitterRecord.wi);
         //std::cout << "EmitterSampling: Pre-ShadowRay" << std::endl;
-        std::vector<VolumetricSegmentRecord> shadow_vsr;
-        if(emitterShRayIntersectFree(scene, sampler, shadowray, emitterRecord, currentVolumeMedium, shadow_vsr) && materialRecord.measure != EDiscrete)
+        Color3f tr(0.f);
+        if(materialRecord.measure != EDiscrete)
+            tr = scene->transmittanceTo(sampler, its.p, its.p + emitterRecord.wi * emitterRecord.dist, media, lod, m_combined_media);
+        if(!tr.isZero())
         {
             //std::cout << "EmitterSampling: IN-ShadowRay" << std::endl;
             BSDFQueryRecord bsdfRecord(its.toLocal(-w), its.toLocal(emitterRecord.wi), its.uv, ESolidAngle);
             //Color3f mu_s = currentVolumeMedium->getPhaseFunction()->get_mu_s();
-            Lems = Le * volumetric_transmittance(sampler, shadow_vsr) * its.mesh->getBSDF()->eval(bsdfRecord) * abs(its.shFrame.n.dot(emitterRecord.wi)) / pdflight;
+            Lems = Le * tr * its.mesh->getBSDF()->eval(bsdfRecord) * abs(its.shFrame.n.dot(emitterRecord.wi)) / pdflight;
 
-            //MIS for emitter sampling
-            pdir_wdir = em->pdf(emitterRecord);
+            //MIS for emitter sampling, against the BSDF sampled continuation of the path (see LiRec())
+            pdir_wdir = lightPdf(scene, em, emitterRecord);
             pbsdf_wdir = its.mesh->getBSDF()->pdf(bsdfRecord);
-            
-            if(!its.mesh->getBSDF()->isDiffuse())
-                pbsdf_wdir = emitterRecord.pdf; 
             w_mis_dir = balanceHeuristic(pdir_wdir, pbsdf_wdir);
+
+            /// BSDF sampling never hits a delta light, light sampling is its only strategy
+            if(em->isDelta())
+                w_mis_dir = 1.f;
         }
         //std::cout << "EmitterSampling: Post-ShadowRay" << std::endl;
         return Lems;
         
     }
 
-    Color3f volumetric_transmittance(Sampler*& sampler, const std::vector<VolumetricSegmentRecord>& vsr) const
+    /**
+     * \brief Next event estimation of volumetric emission
+     *
+     * Samples a point y of an emissive volume and returns f(x -> y) * Tr(x, y) * Le(y) / (|y - x|^2 pdf(y)),
+     * where f(wi) is the phase function or the BSDF (times the cosine) at x
+     */
+    template <typename F>
+    Color3f volumeEmissionSampling(const Scene* scene, Sampler* sampler, const MediumStack& media, const Point3f& x, const F& f, int lod) const
     {
-        //std::cout << "VOL_TRANS: [";
-        Color3f throughput(1.f);
+        // Checked first, so scenes without emissive volumes draw no extra random numbers
+        if(scene->getEmissiveVolumes().empty())
+            return Color3f(0.f);
+        float pdfVolume, pdf;
+        const Volume* vol = scene->sampleEmissiveVolume(sampler->next1D(), pdfVolume);
+        Point3f y;
+        Color3f Le = vol->sampleEmission(sampler, y, pdf);
+        if(pdf <= 0.f || Le.isZero())
+            return Color3f(0.f);
 
-        // for(size_t i = 0; i < vsr.size(); i++)
-        // {
-        //     std::cout << "[" << vsr[i].segment_vol->isHeterogeneous() << " " << vsr[i].x0.toString() << " " << vsr[i].xs.toString() << "]";
-        // }
-        // std::cout << "]" << std::endl;
-        
-        for(size_t i = 0; i < vsr.size(); i++)
+        Vector3f d = y - x;
+        float dist2 = d.squaredNorm();
+        if(dist2 < Epsilon * Epsilon)
+            return Color3f(0.f);
+        float dist = std::sqrt(dist2);
+        Vector3f wi = d / dist;
+        Color3f fx = f(wi);
+        if(fx.isZero())
+            return Color3f(0.f);
+        return fx * scene->transmittanceTo(sampler, x, y, media, lod, m_combined_media) * Le / (dist2 * pdf * pdfVolume);
+    }
+
+    /// Shadow transmittance from a medium vertex x towards the point y of em (0 if occluded), using the shadow cache of em when
+    /// it has one: shadow rays the cache deems dark survive with probability C / shadow_cache_threshold (at least 5%), and the
+    /// survivors are traced and reweighted. A correction term C + (T - C) / p would not need the roulette, but it goes negative
+    /// and pixels drop negative samples. Occlusion is not cached, shadow_cache_biased only tests it
+    Color3f cachedShadowTransmittance(const Scene* scene, Sampler* sampler, const Emitter* em, const MediumStack& media, const Point3f& x, const Point3f& y, int lod) const
+    {
+        Color3f cached;
+        auto it = m_shadow_caches.find(em);
+        if(it == m_shadow_caches.end() || !it->second.lookup(x, cached))
+            return scene->transmittanceTo(sampler, x, y, media, lod, m_combined_media);
+        if(m_shadow_cache_biased)
         {
-            Color3f a = vsr[i].segment_vol->transmittance(sampler, vsr[i].x0, vsr[i].xs);
-            float pdf = 1.0f; //vsr[i].vol_pdf;                                               /////// TODO: QUITAR
-            throughput *= (a / pdf);
+            Intersection its;
+            Vector3f d = y - x;
+            float dist = d.norm();
+            return scene->rayIntersectSurface(Ray3f(x, d / dist, Epsilon, dist - Epsilon), its) ? Color3f(0.f) : cached;
         }
-        return throughput;
+        float survival = m_shadow_cache_threshold > 0.f ? std::min(1.f, std::max(0.05f, cached.maxCoeff() / m_shadow_cache_threshold)) : 1.f;
+        if(survival < 1.f && sampler->next1D() >= survival)
+            return Color3f(0.f);
+        return scene->transmittanceTo(sampler, x, y, media, lod, m_combined_media) / survival;
     }
 
-
     /// Emitter Sampling, but the weights for MIS are calculated using phase function instead of BSDF
-    Color3f emitterSamplingPF(const Scene* scene, Sampler* sampler, std::shared_ptr<Volume> currentVolumeMedium, const Point3f& xt, const Vector3f& w, float& w_mis_dir) const
+    Color3f emitterSamplingPF(const Scene* scene, Sampler* sampler, const Volume* medium, const MediumStack& media, const Point3f& xt, const Vector3f& w, float& w_mis_dir, int lod, const MediumSpan* span = nullptr, bool singleScattered = false, bool jumped = false) const
     {
         Color3f Lems(Epsilon);
         float pdflight(1.f);
@@ -306,199 +1064,199 @@ private:
         EmitterQueryRecord emitterRecord(xt);
         Intersection shray_its;
         Color3f Le = em->sample(emitterRecord, sampler->next2D(), 0.f);
-        
-        Ray3f shadowray = Ray3f(xt, emitterRecord.wi);
 
-        std::vector<VolumetricSegmentRecord> shadow_vsr;
-        if(emitterShRayIntersectFree(scene, sampler, shadowray, emitterRecord, currentVolumeMedium, shadow_vsr))
+        /// The single scattering quadrature already holds the light this vertex would get from em
+        if(singleScattered && coversEquiangular(em))
+            return Color3f(0.f);
+        
+        Color3f tr = cachedShadowTransmittance(scene, sampler, em, media, xt, xt + emitterRecord.wi * emitterRecord.dist, lod);
+        if(!tr.isZero())
         {
             /// Compute Phase Function value using Emitter Sampling sampled direction
             PFQueryRecord pfRecord(-w, emitterRecord.wi);
             //Color3f mu_s = currentVolumeMedium->getPhaseFunction()->get_mu_s();
-            Lems = Le * volumetric_transmittance(sampler, shadow_vsr) * currentVolumeMedium->getPhaseFunction()->eval(pfRecord) / pdflight;      /// TODO: He quitado el * mu_s en las reformas a iterativo según PBRBook
+            Lems = Le * tr * medium->getPhaseFunction()->eval(pfRecord) / pdflight;      /// TODO: He quitado el * mu_s en las reformas a iterativo según PBRBook
 
-            //MIS weight for emitter sampling
-            pdir_wdir = em->pdf(emitterRecord);
-            ppf_wdir = currentVolumeMedium->getPhaseFunction()->pdf(pfRecord);
+            //MIS weight for emitter sampling, against the sampled continuation of the path (see LiRec())
+            pdir_wdir = lightPdf(scene, em, emitterRecord);
+            ppf_wdir = continuationPdf(medium->getPhaseFunction().get(), xt, pfRecord);
             
             w_mis_dir = balanceHeuristic(pdir_wdir, ppf_wdir);
-            
+
+            /// Phase function sampling never hits a delta light, and jumping vertices do not sample the phase
+            /// function at all: light sampling is their only strategy
+            if(em->isDelta() || jumped)
+                w_mis_dir = 1.f;
+
+            /// This vertex was sampled by distance sampling along span, which equiangular sampling shares
+            if(span && span->valid && coversEquiangular(em))
+                w_mis_dir *= distanceWeight(scene, *span, emitterRecord.p, (xt - span->ray.o).dot(span->ray.d), lod);
         }
         return Lems;
     }
 
 
-    Color3f brdfSampling(const Scene* scene, Sampler* sampler, std::shared_ptr<Volume> currentVolumeMedium, const Intersection& its, const Vector3f& w, float& w_mis_indir, Vector3f& wo_brdf, Color3f& fs) const
+    /// Light sampling at a surface vertex, weighted against the BSDF sampled continuation of the path
+    Color3f directLight(const Scene* scene, Sampler* sampler, const MediumStack& media, const Intersection& its, const Vector3f& w, int lod) const
     {
-        Color3f Lmat(Epsilon);
-        //Second parameter, its wo, is random, since it will get properly calculated with sample()
-        BSDFQueryRecord materialRecord = BSDFQueryRecord(its.toLocal(-w), its.toLocal(w), its.uv, ESolidAngle);
-        fs = its.mesh->getBSDF()->sample(materialRecord, sampler->next2D());
-        Intersection itsaux;
-        Ray3f ray(its.p, its.toWorld(materialRecord.wo));
-
-        std::vector<VolumetricSegmentRecord> vsr_shadow;
-        float inf = std::numeric_limits<float>::infinity();
-        bool intersects_aux = scene->rayIntersectThroughVolumes(sampler, ray, itsaux, currentVolumeMedium, vsr_shadow);
-        // std::cout << "POST INTERSECT 2" << std::endl;
-        if((intersects_aux && itsaux.mesh->isEmitter()) || (!intersects_aux && scene->getEnvironmentalEmitter()))
-        {
-            float pbsdf_wbsdf = its.mesh->getBSDF()->pdf(materialRecord);
-            float pdir_wbsdf(0.f);
-            Color3f emit, transmittance;
-            if(intersects_aux && itsaux.mesh->isEmitter())
-            {
-                // Normal light emitters case
-                EmitterQueryRecord emitterRecordAux(itsaux.mesh->getEmitter(), its.p, itsaux.p, itsaux.shFrame.n, itsaux.uv);
-                pdir_wbsdf = (pow(emitterRecordAux.dist, 2.0f) / abs(emitterRecordAux.n.dot(emitterRecordAux.wi)));//emitterRecordAux.emitter->pdf(emitterRecordAux) * scene->pdfEmitter(emitterRecordAux.emitter);
-                emit = emitterRecordAux.emitter->eval(emitterRecordAux);
-                transmittance = volumetric_transmittance(sampler, vsr_shadow);
-            }
-            else
-            {
-                //Enviromental emitters case
-                EmitterQueryRecord emitterRecordAux(its.p);
-                //emitterRecordAux.emitter->sample(emitterRecordAux, sampler->next2D(), 0.);
-                scene->getEnvironmentalEmitter()->sample(emitterRecordAux, sampler->next2D(), 0.f);
-                pdir_wbsdf = scene->getEnvironmentalEmitter()->pdf(emitterRecordAux);
-                emit = scene->getEnvironmentalEmitter()->eval(emitterRecordAux);
-                transmittance = volumetric_transmittance(sampler, vsr_shadow);
-            }
-
-            if(materialRecord.measure == EDiscrete)
-            {
-                pbsdf_wbsdf = 1.f;
-            }
-            w_mis_indir = balanceHeuristic(pbsdf_wbsdf, pdir_wbsdf);
-            
-            Lmat = fs * emit * transmittance;
-        }
-        wo_brdf = its.toWorld(materialRecord.wo);
-        //std::cout << "WO_BRDF: " << wo_brdf.x() << " " << wo_brdf.y() << " " << wo_brdf.z() << std::endl;
-        return Lmat;
+        float w_mis_dir(0.f);
+        Color3f Lems = emitterSampling(scene, sampler, media, its, w, w_mis_dir, lod);
+        if(!isnan(w_mis_dir))
+                Lems *= w_mis_dir;
+        return Lems;
     }
 
-    Color3f phaseFunctionSampling(const Scene* scene, Sampler* sampler, std::shared_ptr<Volume> currentVolumeMedium, const Point3f& xt, const Vector3f& w, float& w_mis_indir, Vector3f& wo_pf, float& fs) const
+    /// Light sampling at a medium vertex, weighted against the phase function (or guided) sampled continuation of the path.
+    /// Vertices that take a diffusion jump have no such continuation, jumped tells so
+    Color3f inscattering(const Scene* scene, Sampler* sampler, const Volume* medium, const MediumStack& media, const Point3f& xt, const Vector3f& w, int lod, const MediumSpan* span = nullptr, bool singleScattered = false, bool jumped = false) const
     {
-        Color3f Lpf(0.f);
-
-        PFQueryRecord pfRecord(-w);
-        fs = currentVolumeMedium->getPhaseFunction()->sample(pfRecord, sampler->next2D());
-        wo_pf = pfRecord.wo;
-        Intersection itsaux;
+        float w_mis_dir(0.f);
+        Color3f Lems = emitterSamplingPF(scene, sampler, medium, media, xt, w, w_mis_dir, lod, span, singleScattered, jumped);
+        if(!isnan(w_mis_dir))
+                Lems *= w_mis_dir;
+        return Lems;
+    }
 
-        Ray3f ray(xt, pfRecord.wo);
-        std::vector<VolumetricSegmentRecord> vsr_shadow;
-        bool intersects_aux = scene->rayIntersectThroughVolumes(sampler, ray, itsaux, currentVolumeMedium, vsr_shadow);
-        if((intersects_aux && itsaux.mesh->isEmitter()) || (!intersects_aux && scene->getEnvironmentalEmitter()))
+    /// Samples the continuation of a medium vertex at xt reached along d, updating path (beta, the MIS data of the vertex) and ray.
+    /// jumpRadius is the one of diffusionRadius(). False if the path ends there
+    bool continueFromMedium(Sampler* sampler, const Volume* medium, Point3f xt, const Vector3f& d, bool singleScattered,
+        float jumpRadius, PathState& path, Ray3f& ray) const
+    {
+        const PhaseFunction* pf = medium->getPhaseFunction().get();
+        PFQueryRecord pfqr(-d);
+        path.specularBounce = false;
+        path.prevSingleScattered = singleScattered;
+        if(jumpRadius > 0.f)
         {
-            float ppf_wpf = pfRecord.m_pdf;
-            float pdir_wpf(0.f);
-            Color3f emit, transmittance;
-            if(intersects_aux && itsaux.mesh->isEmitter())
-            {
-                // Normal light emitters case
-                EmitterQueryRecord emitterRecordAux(itsaux.mesh->getEmitter(), xt, itsaux.p, itsaux.geoFrame.n, itsaux.uv);
-                emitterRecordAux.emitter->sample(emitterRecordAux, sampler->next2D(), 0.);
-                emitterRecordAux = EmitterQueryRecord(itsaux.mesh->getEmitter(), xt, itsaux.p, itsaux.geoFrame.n, itsaux.uv);
-                pdir_wpf = (pow(emitterRecordAux.dist, 2.0f) / abs(emitterRecordAux.n.dot(emitterRecordAux.wi)));//emitterRecordAux.emitter->pdf(emitterRecordAux) * scene->pdfEmitter(emitterRecordAux.emitter);
-                emit = emitterRecordAux.emitter->eval(emitterRecordAux);
-                transmittance = volumetric_transmittance(sampler, vsr_shadow);
-            }
+            diffusionJump(sampler, medium, jumpRadius, xt, path.beta);
+            /// The radiance leaving the sphere is close to isotropic. The exit point is not a light
+            /// sampling vertex, so what its continuation reaches counts in full
+            pfqr.wo = Warp::squareToUniformSphere(sampler->next2D());
+            path.specularBounce = true;
+            path.prevSingleScattered = false;
+        }
+        else if(m_guiding)
+        {
+            /// One-sample MIS between the learned distribution and the phase function (this one alone where nothing was learned)
+            Point2f sample = sampler->next2D();
+            if(sampler->next1D() < guidingFraction(xt))
+                m_guide.sample(xt, sample, pfqr.wo);
             else
-            {
-                //Enviromental emitters case
-                EmitterQueryRecord emitterRecordAux(xt);
-                //emitterRecordAux.emitter->sample(emitterRecordAux, sampler->next2D(), 0.);
-                scene->getEnvironmentalEmitter()->sample(emitterRecordAux, sampler->next2D(), 0.f);
-                pdir_wpf = scene->getEnvironmentalEmitter()->pdf(emitterRecordAux);
-                emit = scene->getEnvironmentalEmitter()->eval(emitterRecordAux);
-                transmittance = volumetric_transmittance(sampler, vsr_shadow);
-            }
-
-            w_mis_indir = balanceHeuristic(ppf_wpf, pdir_wpf);
-
-            //Color3f mu_s = currentVolumeMedium->getPhaseFunction()->get_mu_s();
-            Lpf = fs * emit * transmittance;   /// TODO: He quitado el * mu_s en las reformas a iterativo según PBRBook
+                pf->sample(pfqr, sample);
+            float pdf = continuationPdf(pf, xt, pfqr);
+            if(pdf <= 0.f)
+                return false;
+            path.beta *= pf->eval(pfqr) / pdf;
+            path.prevPdf = pdf;
         }
-        return Lpf;
+        else
+        {
+            path.beta *= pf->sample(pfqr, sampler->next2D());
+            path.prevPdf = pfqr.m_pdf;
+        }
+        path.prevP = xt;
+        ray = Ray3f(xt, pfqr.wo);
+        return true;
     }
 
+    /// Samples the continuation of a surface vertex its reached along d, like continueFromMedium()
+    bool continueFromSurface(Sampler* sampler, const Intersection& its, const Vector3f& d, PathState& path, Ray3f& ray) const
+    {
+        /// TODO: Creo que esto lo puedo hacer directamente en el UniformSampleOneLight (que mejor le dejo el nombre original o ké)
+        /// Sample BSDF to get new path direction
+        const BSDF* bsdf = its.mesh->getBSDF();
+        BSDFQueryRecord materialRecord = BSDFQueryRecord(its.toLocal(-d), its.uv); //Esto me lo están sacando de los sample_direct, sample_material, sample_pf aquí para poder reusar el mismo método en todas partes
+        Color3f fs = bsdf->sample(materialRecord, sampler->next2D());
+
+        /// TODO: revisar
+        if(sqrt(fs.abs2().sum()) < Epsilon || isnan(fs.x()) || isnan(fs.y()) || isnan(fs.z()))     // If isBlack() or pdf == 0 (which produces NaNs in fs)
+            return false;
+        path.beta *= fs;
+        path.specularBounce = materialRecord.measure == EDiscrete;
+        path.prevSingleScattered = false;
+        path.prevPdf = path.specularBounce ? 0.f : bsdf->pdf(materialRecord);
+        path.prevP = its.p;
+        ray = Ray3f(its.p, its.toWorld(materialRecord.wo));
+        return true;
+    }
 
-    Color3f directLight(const Scene* scene, Sampler* sampler, std::shared_ptr<Volume> currentVolumeMedium, const Intersection& its, const Vector3f& w) const
+    /// Probability of sampling the continuation of a medium vertex at x from the guiding distribution
+    float guidingFraction(const Point3f& x) const
     {
-        Color3f Lems(0.f), Lmat(0.f), fs_bsdf(0.f);
-        float w_mis_dir(0.f), w_mis_indir(0.f);
-        Vector3f wo_brdf;
+        return m_guiding && m_guide.isTrained(x) ? m_guiding_fraction : 0.f;
+    }
 
-        Lems = emitterSampling(scene, sampler, currentVolumeMedium, its, w, w_mis_dir);
-        if(!isnan(w_mis_dir))
-                Lems *= w_mis_dir;
-        //std::cout << "directLight postEmitterSampling" << std::endl;
-        Lmat = brdfSampling(scene, sampler, currentVolumeMedium, its, w, w_mis_indir, wo_brdf, fs_bsdf);
-        //std::cout << "directLight postBRDFSampling" << std::endl;
-        if(!isnan(w_mis_indir))
-                Lmat *= w_mis_indir;
-
-        Color3f Lnee = Lems + Lmat;
-        return Lnee;
-        
-        /*
-        float prob_alive = 0.95f;
-        if(n_bounces > 2 && sampler->next1D() > prob_alive)
-        {
-            return Lnee;
-        }    
+    /// Density of the continuation of a medium vertex at x along pfRecord.wo: the phase function, mixed with the guiding distribution
+    float continuationPdf(const PhaseFunction* pf, const Point3f& x, PFQueryRecord& pfRecord) const
+    {
+        float fraction = guidingFraction(x);
+        float pdf = (1.f - fraction) * pf->pdf(pfRecord);
+        if(fraction > 0.f)
+            pdf += fraction * m_guide.pdf(x, pfRecord.wo);
+        return pdf;
+    }
 
-        Ray3f newRay(its.p, wo_brdf);
-        if(n_bounces > 2)
-            return Lnee * (fs_bsdf * LiRec(scene, sampler, Ray3f(its.p, wo_brdf), xzVolumeMedium, n_bounces + 1) / (prob_alive));
-        else
-            return Lnee * (fs_bsdf * LiRec(scene, sampler, Ray3f(its.p, wo_brdf), xzVolumeMedium, n_bounces + 1));
-        */
+    /// Density of light sampling of emitterRecord (its reference point being the vertex), choosing the emitter included
+    float lightPdf(const Scene* scene, const Emitter* em, const EmitterQueryRecord& emitterRecord) const
+    {
+        return scene->pdfEmitter(em) * em->pdf(emitterRecord);
     }
 
-    Color3f inscattering(const Scene* scene, Sampler* sampler, std::shared_ptr<Volume> currentVolumeMedium, const Point3f& xt, const Vector3f& w) const
+    /// MIS weight of the emission of em reached by a continuation sampled with density pdfDir
+    float emitterHitWeight(const Scene* scene, const Emitter* em, const EmitterQueryRecord& emitterRecord, float pdfDir) const
     {
-        
-        Color3f Lems(0.f), Lpf(0.f);
-        float w_mis_dir(0.f), w_mis_pf(0.f), fs_pf(Epsilon);
-        Vector3f wo_pf;
+        float pdfLight = lightPdf(scene, em, emitterRecord);
+        if(!(pdfLight > 0.f) || std::isinf(pdfLight))
+            return 1.f;
+        return balanceHeuristic(pdfDir, pdfLight);
+    }
 
-        Lems = emitterSamplingPF(scene, sampler, currentVolumeMedium, xt, w, w_mis_dir);
-        if(!isnan(w_mis_dir))
-                Lems *= w_mis_dir;
+    /**
+     * \brief Radius of the diffusion jump from a medium vertex xt (Fleck and Canfield's random walk procedure)
+     *
+     * Deep inside a dense homogeneous medium, the random walk from xt until it leaves the largest sphere
+     * around it that only holds that medium is replaced by its diffusion limit: the walk leaves the sphere
+     * at a uniformly distributed point, and survives absorption with probability kR / sinh(kR), where
+     * k = sqrt(3 mu_a mu_tr) and mu_tr = mu_s (1 - mean cosine) + mu_a (similarity theory). The sphere
+     * keeps one transport mean free path away from the boundaries, where diffusion does not hold.
+     * Returns 0 (no jump) if the sphere is under diffusion_depth mean free paths. The choice takes no
+     * random numbers, so it is made before the light sampling at xt, see diffusionJump()
+     */
+    float diffusionRadius(const Volume* medium, const Point3f& xt) const
+    {
+        if(!m_diffusion || m_combined_media)
+            return 0.f;
+        auto it = m_diffusion_media.find(medium);
+        if(it == m_diffusion_media.end())
+            return 0.f;
 
-        Lpf = phaseFunctionSampling(scene, sampler, currentVolumeMedium, xt, w, w_mis_pf, wo_pf, fs_pf);
-        if(!isnan(w_mis_pf))
-                Lpf *= w_mis_pf;
+        Color3f mu_a, mu_tr;
+        diffusionCoefficients(medium, xt, mu_a, mu_tr);
+        float mfp = 1.f / mu_tr.minCoeff();
+        float radius = it->second.clearanceAt(xt) - mfp;
+        return radius < mfp * m_diffusion_depth ? 0.f : radius;
+    }
 
-        Color3f Lnee = Lems + Lpf;
-        
-        return Lnee * fs_pf;    /// fs_pf???
-        /*
-        float prob_alive = 0.95f;
-        if(n_bounces > 2 && sampler->next1D() > prob_alive)
+    /// Diffusion jump of the given radius from xt (see diffusionRadius()): moves xt to the sphere and weights beta by the survival to absorption
+    void diffusionJump(Sampler* sampler, const Volume* medium, float radius, Point3f& xt, Color3f& beta) const
+    {
+        Color3f mu_a, mu_tr;
+        diffusionCoefficients(medium, xt, mu_a, mu_tr);
+        for(int i = 0; i < 3; i++)
         {
-            return Lnee;
-        }    
-
-        /// HERE
-        /// @brief 
-        /// @param scene 
-        /// @param sampler 
-        /// @param currentVolumeMedium 
-        /// @param xtVolumeMedium 
-        /// @param xt 
-        /// @param w 
-        /// @param n_bounces 
-        /// @return 
-        fs_pf = 1.0f;
-        if(n_bounces > 2)
-            return Lnee * (fs_pf * LiRec(scene, sampler, Ray3f(xt, wo_pf), xtVolumeMedium, n_bounces + 1) / prob_alive);
-        else
-            return Lnee * (fs_pf * LiRec(scene, sampler, Ray3f(xt, wo_pf), xtVolumeMedium, n_bounces + 1));
-        */
+            float kR = std::sqrt(3.f * mu_a[i] * mu_tr[i]) * radius;
+            beta[i] *= kR > 1e-4f ? kR / std::sinh(kR) : 1.f;
+        }
+        xt += radius * Warp::squareToUniformSphere(sampler->next2D());
+    }
+
+    /// Absorption and transport coefficients of medium at xt, for diffusion jumps
+    void diffusionCoefficients(const Volume* medium, const Point3f& xt, Color3f& mu_a, Color3f& mu_tr) const
+    {
+        const PhaseFunction* pf = medium->getPhaseFunction().get();
+        Color3f mu_s = pf->get_mu_s();
+        mu_a = (medium->sample_mu_t(xt) - mu_s).cwiseMax(0.f);
+        mu_tr = mu_s * (1.f - pf->getMeanCosine()) + mu_a;
     }
 };
 
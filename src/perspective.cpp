@@ -108,6 +108,18 @@ public:
         return Color3f(1.0f);
     }
 
+    bool getPixelPosition(const Vector3f &d, Point2f &samplePosition) const {
+        /* Back to local camera space, and onto the near plane */
+        Vector3f local = m_cameraToWorld.inverse() * d;
+        if (local.z() <= 0.0f)
+            return false;
+        Point3f sample = m_sampleToCamera.inverse() * Point3f(local * (m_nearClip / local.z()));
+
+        samplePosition = Point2f(sample.x() * m_outputSize.x(), sample.y() * m_outputSize.y());
+        return samplePosition.x() >= 0.0f && samplePosition.y() >= 0.0f &&
+            samplePosition.x() < m_outputSize.x() && samplePosition.y() < m_outputSize.y();
+    }
+
     void addChild(NoriObject *obj, const std::string& name = "none") {
         switch (obj->getClassType()) {
             case EReconstructionFilter:
@@ -0,0 +1,333 @@
+/*
+    Date: 19-1-2023
+    Authors: Pedro José Pérez García
+    Comms: Part of our nori extensions for the final assignment
+            of the course "Modelling and Simullation of Appearance",
+            Master in Robotics, Graphics and Computer Vision (MRGCV),
+            Universidad de Zaragoza, course 2022-2023
+*/
+
+#include <nori/integrator.h>
+#include <nori/scene.h>
+#include <nori/emitter.h>
+#include <nori/bsdf.h>
+#include <nori/mesh.h>
+#include <nori/phasefunction.h>
+#include <nori/beambvh.h>
+#include <nori/sampler.h>
+#include <nori/timer.h>
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+#include <algorithm>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Progressive photon beams (Jarosz et al. 2011), for single and multiple scattering in media
+ *
+ * Before rendering, photons are shot from the emitters through the media (tracked all
+ * together with the VolumeBVH of the scene) and every segment they travel inside a medium
+ * is stored as a short beam, ending at the next collision. Camera rays then gather the beams
+ * they pass close to with the 1D beam-beam estimator, instead of sampling scattering
+ * vertices in the media. Surfaces are path traced as usual (next event estimation and
+ * BSDF sampling), and every camera segment, including the ones leaving a surface, gathers
+ * beams, so light scattered by the media onto surfaces is accounted for too.
+ *
+ * Beams are traced in several passes, each one with a smaller blur radius than the last
+ * (r_{i+1} = r_i (i + alpha) / (i + 1)). Every camera sample picks one pass at random, so the
+ * average over the samples of a pixel is the progressive estimate, which is consistent.
+ *
+ * Only area and point emitters shoot photons (see Emitter::samplePhoton()), and emissive
+ * media are not handled.
+ */
+class PhotonBeams : public Integrator
+{
+public:
+    PhotonBeams(const PropertyList &props)
+    {
+        /// Photons shot per pass, and number of passes (each one with its own beams and radius)
+        m_photons = std::max(1, props.getInteger("photons", 10000));
+        m_num_passes = std::max(1, props.getInteger("passes", 8));
+
+        /// Blur radius of the first pass. If not given (0), 0.5% of the scene bounding box diagonal
+        m_beam_radius = props.getFloat("beam_radius", 0.f);
+
+        /// Radius reduction of the progressive passes, in (0, 1). Lower shrinks faster
+        m_alpha = clamp(props.getFloat("alpha", 0.7f), 0.01f, 0.99f);
+
+        /// Surface bounces of camera paths, and scattering events of photons
+        m_max_depth = std::max(1, props.getInteger("max_depth", 16));
+    }
+
+    void preprocess(const Scene* scene)
+    {
+        m_passes.clear();
+        const VolumeBVH& media = scene->getVolumeBVH();
+        if(media.empty())
+        {
+            std::cout << "Photon beams: the scene has no media, rendering surfaces only" << std::endl;
+            return;
+        }
+
+        std::vector<const Emitter*> emitters;
+        for(const Emitter* emitter : scene->getLights())
+        {
+            Ray3f ray;
+            if(!emitter->samplePhoton(ray, Point2f(0.5f), Point2f(0.5f)).isZero())
+                emitters.push_back(emitter);
+        }
+        if(emitters.empty())
+        {
+            std::cout << "Photon beams: no emitter can shoot photons (only area and point lights can)" << std::endl;
+            return;
+        }
+
+        Timer timer;
+        float radius = m_beam_radius > 0.f ? m_beam_radius : 0.005f * scene->getBoundingBox().getExtents().norm();
+        size_t beamCount = 0;
+        m_passes.resize(m_num_passes);
+        for(int pass = 0; pass < m_num_passes; pass++)
+        {
+            m_passes[pass].build(tracePass(scene, emitters, pass), radius);
+            beamCount += m_passes[pass].size();
+            radius *= (pass + 1 + m_alpha) / (pass + 2);
+        }
+
+        std::cout << "Photon beams: " << beamCount << " beams from " << m_photons * m_num_passes << " photons in "
+            << m_num_passes << " passes, final radius " << m_passes.back().getRadius()
+            << " (took " << timer.elapsedString() << ")" << std::endl;
+    }
+
+    Color3f Li(const Scene* scene, Sampler* sampler, const Ray3f& cameraRay) const
+    {
+        const BeamBVH* beams = nullptr;
+        if(!m_passes.empty())
+            beams = &m_passes[std::min(m_num_passes - 1, (int)(sampler->next1D() * m_num_passes))];
+
+        Color3f L(0.f);
+        Color3f beta(1.f);
+        Ray3f ray = cameraRay;
+        bool specularBounce = true;
+        for(int bounces = 0; ; bounces++)
+        {
+            Intersection its;
+            bool foundIntersection = scene->rayIntersectSurface(ray, its);
+            float tMax = foundIntersection ? its.t : std::numeric_limits<float>::infinity();
+
+            Color3f tr(1.f);
+            if(beams)
+                L += beta * gatherBeams(scene, sampler, *beams, ray, tMax, tr);
+            else
+                tr = scene->getVolumeBVH().transmittance(sampler, ray, tMax, 0);
+            beta *= tr;
+            if(beta.isZero())
+                break;
+
+            if(!foundIntersection)
+            {
+                if(specularBounce)
+                    L += beta * scene->getBackground(ray);
+                break;
+            }
+
+            /// Emitters seen after a diffuse bounce are already accounted for by next event estimation
+            if(its.mesh->isEmitter())
+            {
+                if(specularBounce)
+                {
+                    EmitterQueryRecord er(its.mesh->getEmitter(), ray.o, its.p, its.shFrame.n, its.uv);
+                    L += beta * its.mesh->getEmitter()->eval(er);
+                }
+                break;
+            }
+            if(bounces >= m_max_depth)
+                break;
+
+            const BSDF* bsdf = its.mesh->getBSDF();
+            if(bsdf->isDiffuse())
+                L += beta * directLight(scene, sampler, its, ray.d);
+
+            BSDFQueryRecord bRec(its.toLocal(-ray.d), its.uv);
+            Color3f fs = bsdf->sample(bRec, sampler->next2D());
+            if(!fs.isValid() || fs.isZero())
+                break;
+            beta *= fs;
+            specularBounce = !bsdf->isDiffuse();
+            ray = Ray3f(its.p, its.toWorld(bRec.wo));
+
+            /// Possibly terminate the path with Russian Roulette
+            if(bounces > 3)
+            {
+                float rr = std::max(0.01f, 1 - beta.y());
+                if(sampler->next1D() < rr)
+                    break;
+                beta /= (1.f - rr);
+            }
+        }
+        return L;
+    }
+
+    std::string toString() const
+    {
+        return tfm::format(
+            "PhotonBeams[\n"
+            "  photons = %d\n"
+            "  passes = %d\n"
+            "  beam_radius = %f\n"
+            "  alpha = %f\n"
+            "  max_depth = %d\n"
+            "]", m_photons, m_num_passes, m_beam_radius, m_alpha, m_max_depth);
+    }
+
+private:
+    int m_photons;
+    int m_num_passes;
+    float m_beam_radius;
+    float m_alpha;
+    int m_max_depth;
+    std::vector<BeamBVH> m_passes;
+
+    /// Traces the photons of a pass, in parallel chunks (seeded with Sampler::prepareStream())
+    std::vector<PhotonBeam> tracePass(const Scene* scene, const std::vector<const Emitter*>& emitters, int pass) const
+    {
+        const int chunkSize = 256;
+        int chunks = (m_photons + chunkSize - 1) / chunkSize;
+        std::vector<std::vector<PhotonBeam>> chunkBeams(chunks);
+        tbb::parallel_for(tbb::blocked_range<int>(0, chunks), [&](const tbb::blocked_range<int>& range) {
+            std::unique_ptr<Sampler> sampler(scene->getSampler()->clone());
+            for(int chunk = range.begin(); chunk < range.end(); chunk++)
+            {
+                sampler->prepareStream(chunk, -2 - pass);
+                int end = std::min(m_photons, (chunk + 1) * chunkSize);
+                for(int i = chunk * chunkSize; i < end; i++)
+                    tracePhoton(scene, sampler.get(), emitters, chunkBeams[chunk]);
+            }
+        });
+
+        std::vector<PhotonBeam> beams;
+        for(std::vector<PhotonBeam>& chunk : chunkBeams)
+            beams.insert(beams.end(), chunk.begin(), chunk.end());
+        return beams;
+    }
+
+    void tracePhoton(const Scene* scene, Sampler* sampler, const std::vector<const Emitter*>& emitters, std::vector<PhotonBeam>& beams) const
+    {
+        const VolumeBVH& media = scene->getVolumeBVH();
+        size_t index = std::min(emitters.size() - 1, (size_t)(sampler->next1D() * emitters.size()));
+        Ray3f ray;
+        Color3f power = emitters[index]->samplePhoton(ray, sampler->next2D(), sampler->next2D()) * (float)emitters.size() / (float)m_photons;
+        float initialPower = power.maxCoeff();
+        if(initialPower <= 0.f || !power.isValid())
+            return;
+
+        for(int depth = 0; depth < m_max_depth; depth++)
+        {
+            Intersection its;
+            bool foundIntersection = scene->rayIntersectSurface(ray, its);
+            float tMax = foundIntersection ? its.t : sceneExit(scene, ray);
+
+            float t;
+            Color3f weight, albedo;
+            const Volume* medium = nullptr;
+            bool sampledMedium = media.sampleCollision(sampler, ray, tMax, 0, t, medium, weight, albedo);
+
+            /// The beam is the part of the free flight that crosses some medium
+            float t0 = 0.f, t1 = sampledMedium ? t : tMax;
+            if(media.clip(ray, t0, t1))
+                beams.push_back(PhotonBeam{ray(t0), ray.d, t1 - t0, power});
+
+            power *= weight;
+            if(sampledMedium)
+            {
+                power *= albedo;
+                PFQueryRecord pfqr(-ray.d);
+                medium->getPhaseFunction()->sample(pfqr, sampler->next2D());
+                ray = Ray3f(ray(t), pfqr.wo);
+            }
+            else if(foundIntersection)
+            {
+                BSDFQueryRecord bRec(its.toLocal(-ray.d), its.uv);
+                Color3f fs = its.mesh->getBSDF()->sample(bRec, sampler->next2D());
+                if(!fs.isValid())
+                    break;
+                power *= fs;
+                ray = Ray3f(its.p, its.toWorld(bRec.wo));
+            }
+            else
+                break;
+
+            /// Russian Roulette relative to the emitted power
+            if(depth > 3)
+            {
+                float q = std::min(1.f, power.maxCoeff() / initialPower);
+                if(sampler->next1D() >= q)
+                    break;
+                power /= q;
+            }
+            if(power.isZero())
+                break;
+        }
+    }
+
+    /// Distance along ray to the boundary of the scene, where photons that hit nothing stop
+    float sceneExit(const Scene* scene, const Ray3f& ray) const
+    {
+        float nearT, farT;
+        if(!scene->getBoundingBox().rayIntersect(ray, nearT, farT))
+            return 0.f;
+        return std::max(0.f, farT);
+    }
+
+    /// Radiance scattered by the media towards ray.o along (0, tMax), from the beams within the radius.
+    /// tr is set to the transmittance of the whole segment
+    Color3f gatherBeams(const Scene* scene, Sampler* sampler, const BeamBVH& beams, const Ray3f& ray, float tMax, Color3f& tr) const
+    {
+        const VolumeBVH& media = scene->getVolumeBVH();
+        float kernel = 0.5f / beams.getRadius();
+        std::vector<std::pair<float, Color3f>> hits;
+        beams.query(ray, tMax, [&](const PhotonBeam& beam, float t, float sinTheta) {
+            Color3f sigma = media.inScattering(ray(t), 0, [&](const Volume& volume) {
+                PFQueryRecord pRec(-ray.d, -beam.d);
+                return volume.getPhaseFunction()->eval(pRec);
+            });
+            if(!sigma.isZero())
+                hits.emplace_back(t, beam.power * sigma * kernel / sinTheta);
+        });
+        std::sort(hits.begin(), hits.end(), [](const std::pair<float, Color3f>& a, const std::pair<float, Color3f>& b) { return a.first < b.first; });
+
+        // Ratio tracking from one beam to the next, so the transmittance to every beam is estimated in a single pass
+        Color3f L(0.f);
+        tr = Color3f(1.f);
+        float t0 = 0.f;
+        for(const std::pair<float, Color3f>& hit : hits)
+        {
+            tr *= media.transmittance(sampler, Ray3f(ray(t0), ray.d), hit.first - t0, 0);
+            t0 = hit.first;
+            if(tr.isZero())
+                return L;
+            L += tr * hit.second;
+        }
+        tr *= media.transmittance(sampler, Ray3f(ray(t0), ray.d), tMax - t0, 0);
+        return L;
+    }
+
+    /// Next event estimation at a diffuse surface, with the transmittance of the media in between
+    Color3f directLight(const Scene* scene, Sampler* sampler, const Intersection& its, const Vector3f& w) const
+    {
+        float pdfLight;
+        const Emitter* em = scene->sampleEmitter(sampler->next1D(), pdfLight);
+        EmitterQueryRecord lRec(its.p);
+        Color3f Le = em->sample(lRec, sampler->next2D(), 0.f);
+        if(Le.isZero())
+            return Color3f(0.f);
+
+        BSDFQueryRecord bRec(its.toLocal(-w), its.toLocal(lRec.wi), its.uv, ESolidAngle);
+        Color3f f = its.mesh->getBSDF()->eval(bRec) * std::abs(its.shFrame.n.dot(lRec.wi));
+        if(f.isZero())
+            return Color3f(0.f);
+        return Le * f * scene->transmittanceTo(sampler, its.p, its.p + lRec.wi * lRec.dist, MediumStack(), 0, true) / pdfLight;
+    }
+};
+
+NORI_REGISTER_CLASS(PhotonBeams, "photon_beams");
+NORI_NAMESPACE_END
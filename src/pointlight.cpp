@@ -1,4 +1,5 @@
 #include <nori/emitter.h>
+#include <nori/warp.h>
 
 NORI_NAMESPACE_BEGIN
 
@@ -47,6 +48,13 @@ public:
         return m_radiance / (lRec.dist * lRec.dist);
     }
 
+    // Uniform directions, the radiance of a point light being its intensity
+    virtual Color3f samplePhoton(Ray3f & ray, const Point2f & samplePosition, const Point2f & sampleDirection) const
+    {
+        ray = Ray3f(m_position, Warp::squareToUniformSphere(sampleDirection));
+        return m_radiance * 4.f * M_PI;
+    }
+
     // Note that the pdf should be infinite, but for numerical
     // reasons it is more convenient to just leave as 1
 
@@ -0,0 +1,100 @@
+/*
+    Date: 19-1-2023
+    Authors: Pedro José Pérez García
+    Comms: Part of our nori extensions for the final assignment
+            of the course "Modelling and Simullation of Appearance",
+            Master in Robotics, Graphics and Computer Vision (MRGCV),
+            Universidad de Zaragoza, course 2022-2023
+*/
+
+#include <nori/radiancecache.h>
+#include <nori/sampler.h>
+#include <nori/warp.h>
+#include <nori/timer.h>
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+
+NORI_NAMESPACE_BEGIN
+
+void RadianceCache::build(const BoundingBox3f& bbox, int resolution, int samples, const Sampler* sampler,
+    const Occupancy& occupied, const Estimator& estimate)
+{
+    Timer timer;
+    m_grid = UniformGrid(bbox, resolution);
+    const Vector3f& cellSize = m_grid.cellSize;
+
+    // Occupancy, tested at the center and the corners of every cell
+    m_index.assign(m_grid.getCellCount(), -1);
+    std::vector<Point3f> cellOrigins;
+    for(int z = 0; z < m_grid.cells[2]; z++)
+    for(int y = 0; y < m_grid.cells[1]; y++)
+    for(int x = 0; x < m_grid.cells[0]; x++)
+    {
+        Point3f cellMin = m_grid.cellMin(x, y, z);
+        bool used = occupied(cellMin + 0.5f * cellSize);
+        for(int c = 0; c < 8 && !used; c++)
+            used = occupied(cellMin + Vector3f((c & 1) ? cellSize.x() : 0.f, (c & 2) ? cellSize.y() : 0.f, (c & 4) ? cellSize.z() : 0.f));
+        if(used)
+        {
+            m_index[m_grid.index(x, y, z)] = (int32_t)cellOrigins.size();
+            cellOrigins.push_back(cellMin);
+        }
+    }
+    // Filled aside, the cache stays empty (so lookups fail) while the pilot paths run
+    m_values.clear();
+    std::vector<Color3f> values(cellOrigins.size(), Color3f(0.f));
+
+    // Pilot paths, seeded per cell (see Sampler::prepareStream())
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, cellOrigins.size()), [&](const tbb::blocked_range<size_t>& range) {
+        std::unique_ptr<Sampler> cellSampler(sampler->clone());
+        for(size_t i = range.begin(); i < range.end(); i++)
+        {
+            cellSampler->prepareStream((int)i, -1);
+            Color3f L(0.f);
+            for(int s = 0; s < samples; s++)
+            {
+                Point3f p = cellOrigins[i] + Vector3f(cellSampler->next1D() * cellSize.x(),
+                    cellSampler->next1D() * cellSize.y(), cellSampler->next1D() * cellSize.z());
+                Vector3f wi = Warp::squareToUniformSphere(cellSampler->next2D());
+                Color3f Li = estimate(cellSampler.get(), p, wi);
+                if(Li.isValid())
+                    L += Li;
+            }
+            values[i] = L / (float)std::max(1, samples);
+        }
+    });
+    m_values = std::move(values);
+
+    std::cout << "Built radiance cache: (" << m_grid.cells[0] << ", " << m_grid.cells[1] << ", " << m_grid.cells[2] << ") cells, "
+        << m_values.size() << " cached, " << samples << " pilot paths each (took " << timer.elapsedString() << ")" << std::endl;
+}
+
+bool RadianceCache::lookup(const Point3f& p, Color3f& L) const
+{
+    if(m_values.empty())
+        return false;
+
+    // Trilinear interpolation between cell cellOrigins, renormalized over the cached cells
+    Vector3f local = m_grid.toLocal(p) - Vector3f(0.5f);
+    int x0 = (int)std::floor(local.x()), y0 = (int)std::floor(local.y()), z0 = (int)std::floor(local.z());
+    Vector3f f = local - Vector3f((float)x0, (float)y0, (float)z0);
+
+    L = Color3f(0.f);
+    float weightSum = 0.f;
+    for(int c = 0; c < 8; c++)
+    {
+        int dx = c & 1, dy = (c >> 1) & 1, dz = (c >> 2) & 1;
+        int32_t index = cellIndex(x0 + dx, y0 + dy, z0 + dz);
+        if(index < 0)
+            continue;
+        float w = (dx ? f.x() : 1.f - f.x()) * (dy ? f.y() : 1.f - f.y()) * (dz ? f.z() : 1.f - f.z());
+        L += w * m_values[index];
+        weightSum += w;
+    }
+    if(weightSum <= 0.f)
+        return false;
+    L /= weightSum;
+    return true;
+}
+
+NORI_NAMESPACE_END
@@ -25,13 +25,15 @@
 #include <nori/sampler.h>
 #include <nori/camera.h>
 #include <nori/emitter.h>
+#include <algorithm>
 
 NORI_NAMESPACE_BEGIN
 
-Scene::Scene(const PropertyList &) {
+Scene::Scene(const PropertyList &props) {
     m_accel = new Accel();
     m_enviromentalEmitter = nullptr;
     m_enviromentalVolumeMedium = nullptr;
+    m_frame = props.getInteger("frame", 0);
 }
 
 Scene::~Scene() {
@@ -76,39 +78,60 @@ void Scene::activate() {
         m_enviromentalVolumeMedium->addChild(NoriObjectFactory::createInstance("henyey-greenstein", PropertyList()));
     }
 
+    // Animated volumes are not loaded until a frame is selected
+    setFrame(m_frame, false);
+
     cout << endl;
     cout << "Configuration: " << toString() << endl;
     cout << endl;
 }
 
-/// Sample emitter
-const Emitter * Scene::sampleEmitter(float rnd, float &pdf) const {
-	auto const & n = m_emitters.size();
-	size_t index = std::min(static_cast<size_t>(std::floor(n*rnd)), n - 1);
-	pdf = 1. / float(n);
-	return m_emitters[index];
+void Scene::setFrame(int frame, bool prefetchNext)
+{
+    for(auto& vol : m_volumes)
+        vol->setFrame(frame, prefetchNext);
+    if(m_enviromentalVolumeMedium)
+        m_enviromentalVolumeMedium->setFrame(frame, prefetchNext);
+    m_frame = frame;
+
+    // Majorants change with the frame too
+    std::vector<VolumeBVH::Region> regions;
+    for(Mesh* mesh : m_meshes)
+        if(mesh->isVolume())
+            regions.push_back(VolumeBVH::Region{mesh->getBoundingBox(), mesh->getVolume(), mesh->getVolume()->getMajorant()});
+    m_volume_bvh.build(regions, m_enviromentalVolumeMedium);
+
+    // Emission grids of animated volumes may be zero in some frames
+    m_emissive_volumes.clear();
+    for(auto& vol : m_volumes)
+        if(vol->isEmissive() && std::find(m_emissive_volumes.begin(), m_emissive_volumes.end(), vol) == m_emissive_volumes.end())
+            m_emissive_volumes.push_back(vol);
 }
 
-const std::shared_ptr<Volume> Scene::sampleVolume(Sampler* sampler, std::vector<std::shared_ptr<Volume>> vols, float& pdf) const
+const Volume * Scene::sampleEmissiveVolume(float rnd, float &pdf) const
 {
-    if(vols.size() == 0)
+    if(m_emissive_volumes.empty())
     {
-        pdf = 1.f;
-        return m_enviromentalVolumeMedium;
+        pdf = 0.f;
+        return nullptr;
     }
-    //else
-    auto const & n = vols.size();
-	size_t index = std::min(static_cast<size_t>(std::floor(n*sampler->next1D())), n - 1);
+    auto const & n = m_emissive_volumes.size();
+    size_t index = std::min(static_cast<size_t>(std::floor(n*rnd)), n - 1);
+    pdf = 1.f / float(n);
+    return m_emissive_volumes[index].get();
+}
+
+/// Sample emitter
+const Emitter * Scene::sampleEmitter(float rnd, float &pdf) const {
+	auto const & n = m_emitters.size();
+	size_t index = std::min(static_cast<size_t>(std::floor(n*rnd)), n - 1);
 	pdf = 1. / float(n);
-	return vols[index];
+	return m_emitters[index];
 }
 
-bool Scene::rayIntersectThroughVolumes(Sampler* sampler, const Ray3f &ray, Intersection& its_out, std::shared_ptr<Volume> startVol, std::vector<VolumetricSegmentRecord>& segs) const
+bool Scene::rayIntersectThroughVolumes(Sampler* sampler, const Ray3f &ray, Intersection& its_out, const MediumStack& media, std::vector<VolumetricSegmentRecord>& segs) const
 {
-    bool done = false;
-    std::vector<std::shared_ptr<Volume>> volumes_traversed;
-    volumes_traversed.reserve(m_volumes.size());
-    volumes_traversed.push_back(startVol);
+    MediumStack traversed(media);
     Ray3f _ray(ray);
     int n_bounces = 0;
     while(true)
@@ -130,32 +153,11 @@ bool Scene::rayIntersectThroughVolumes(Sampler* sampler, const Ray3f &ray, Inter
             // float z = (its.p - _ray.o).norm();
             if(its.mesh->isVolume())
             {
-                /// Now we choose one volume from the ones we are currently traversing
-                ///     This is done uniformly (for now), if none traversed, return envVolume
-                float volume_pdf;
+                /// The segment up to the boundary is in the innermost medium, then we cross into (or out of) the volume
+                VolumetricSegmentRecord vsr(_ray.o, its.p, traversed.current(), 1.f);
                 Vector3f dir = _ray.d;
-                bool delete_vol = false;
                 _ray = Ray3f(its.p + (Epsilon * dir), dir);
-                std::shared_ptr<Volume> sampled_vol;
-                
-                // Add the volume to our "currently traversed" list if we aren't already traversing it
-                // If we are, remove it from the list, because we have just got out of it
-                auto iter = std::find(volumes_traversed.begin(), volumes_traversed.end(), its.mesh->getVolume());
-                if(iter != volumes_traversed.end())
-                {
-                    //If on the list, delete it because we are getting outside of it
-                    sampled_vol = sampleVolume(sampler, volumes_traversed, volume_pdf);
-                    volumes_traversed.erase(iter);
-                }
-                else
-                {
-                    //Otherwise, it's a new volume (we are entering it) and we add it to the list
-                    sampled_vol = sampleVolume(sampler, volumes_traversed, volume_pdf);
-                    volumes_traversed.push_back(its.mesh->getVolume());
-                }
-
-                
-                VolumetricSegmentRecord vsr(_ray.o, its.p, sampled_vol, volume_pdf);
+                traversed.cross(its.mesh->getVolume().get());
                 //ISNAN ?
                 //std::cout << "_NO_XT_INTER_VOL: " << vsr.xs << std::endl;
                 segs.push_back(vsr);
@@ -164,9 +166,7 @@ bool Scene::rayIntersectThroughVolumes(Sampler* sampler, const Ray3f &ray, Inter
             }
             else
             {
-                float volume_pdf;
-                std::shared_ptr<Volume> sampled_vol = sampleVolume(sampler, volumes_traversed, volume_pdf);
-                VolumetricSegmentRecord vsr(_ray.o, its.p, sampled_vol, volume_pdf);
+                VolumetricSegmentRecord vsr(_ray.o, its.p, traversed.current(), 1.f);
                 //ISNAN
                 //std::cout << "_NO_XT_INTER_NOVOL: " << vsr.xs << std::endl;
                 segs.push_back(vsr);
@@ -176,10 +176,7 @@ bool Scene::rayIntersectThroughVolumes(Sampler* sampler, const Ray3f &ray, Inter
         }
         else
         {
-            float volume_pdf;
-            std::shared_ptr<Volume> sampled_vol = m_enviromentalVolumeMedium;//sampleVolume(sampler, volumes_traversed, volume_pdf);
-
-            VolumetricSegmentRecord vsr(_ray.o, _ray.o + ray.d * 1.f, sampled_vol, volume_pdf);
+            VolumetricSegmentRecord vsr(_ray.o, _ray.o + ray.d * 1.f, m_enviromentalVolumeMedium.get(), 1.f);
             //ISNAN
             //std::cout << "KAMEHAMEHA: " << vsr.xs << std::endl;
             //std::cout << "_NO_XT_NOINTER: " << vsr.xs << std::endl;
@@ -190,62 +187,89 @@ bool Scene::rayIntersectThroughVolumes(Sampler* sampler, const Ray3f &ray, Inter
 }
 
 
-bool Scene::shadowRayThroughVolumes(Sampler* sampler, const Ray3f& sray, std::shared_ptr<Volume> startVol, std::vector<VolumetricSegmentRecord>& segs_shadow, float& t) const
+bool Scene::rayIntersectSurface(const Ray3f &ray, Intersection &its) const
 {
-    t = 0.0f;
-    std::vector<std::shared_ptr<Volume>> volumes_traversed;
-    volumes_traversed.reserve(m_volumes.size());
-    volumes_traversed.push_back(startVol);
-    Ray3f ray(sray);
-    int n_bounces = 0;
-    while(true)
+    Ray3f _ray(ray);
+    for(int i = 0; i < 100; i++)
     {
-        if(n_bounces > 100)
-        {
-            //std::cout << "rayIntersectThroughVolumes(no xt): Too many bounces. Is everything alright? Aborting..." << std::endl;
+        if(!rayIntersect(_ray, its))
             return false;
-        }
-        n_bounces++;        //I could put this here or before every continue, this one's easier though
-
-        Intersection its;
-        bool intersects = rayIntersect(ray, its);
-        if(!intersects)
-        {
-            float volume_pdf;
-            std::shared_ptr<Volume> sampled_vol = sampleVolume(sampler, volumes_traversed, volume_pdf);
+        if(!its.mesh->isVolume())
+            return true;
+        // Same ray, starting right after the boundary, so that its.t keeps measuring from ray.o
+        _ray.mint = its.t + Epsilon;
+    }
+    return false;
+}
 
-            VolumetricSegmentRecord vsr(ray.o, ray.o + ray.d * 1.f, sampled_vol, volume_pdf);
-            //std::cout << "_SHRAY_NO_INTER: " << vsr.xs << std::endl;
-            segs_shadow.push_back(vsr);
-            t += 1000.f;            //TODO distancia si se me va al infinito un rayo
-            return false;
-        }
-        else
+Color3f Scene::transmittanceTo(Sampler* sampler, const Point3f& p, const Point3f& q, const MediumStack& media,
+    int lod, bool combinedMedia) const
+{
+    const int MaxBoundaryHits = 16;
+    const float RouletteThreshold = 0.01f;
+
+    Vector3f d = q - p;
+    float dist = d.norm();
+    if(dist <= 2.f * Epsilon)
+        return Color3f(1.f);
+    d /= dist;
+    Ray3f ray(p, d, Epsilon, dist - Epsilon);
+
+    Accel::BoundaryHit hits[MaxBoundaryHits];
+    int nHits;
+    bool truncated;
+    if(m_accel->rayIntersectBoundaries(ray, hits, MaxBoundaryHits, nHits, truncated))
+        return Color3f(0.f);
+    if(combinedMedia && !truncated)
+        return m_volume_bvh.transmittance(sampler, Ray3f(p, d), ray.maxt, lod);
+
+    Color3f tr(1.f);
+    MediumStack traversed(media);
+    float t0 = 0.f;
+    while(true)
+    {
+        std::sort(hits, hits + nHits, [](const Accel::BoundaryHit& a, const Accel::BoundaryHit& b) { return a.t < b.t; });
+        for(int i = 0; i < nHits; i++)
         {
-            if(its.mesh->isVolume())
-            {
-                float volume_pdf;
-                std::shared_ptr<Volume> sampled_vol = sampleVolume(sampler, volumes_traversed, volume_pdf);
-                VolumetricSegmentRecord vsr(ray.o, its.p, sampled_vol, volume_pdf);
-                t += its.t;
-                ray = Ray3f(its.p + (ray.d * Epsilon), ray.d);
-                //continue;
-            }
-            else
+            // A ray through an edge hits both triangles, that is still a single boundary
+            if(i > 0 && hits[i].mesh == hits[i - 1].mesh && hits[i].t - hits[i - 1].t < Epsilon)
+                continue;
+            if(!combinedMedia)
             {
-                float volume_pdf;
-                std::shared_ptr<Volume> sampled_vol = sampleVolume(sampler, volumes_traversed, volume_pdf);
-                VolumetricSegmentRecord vsr(ray.o, its.p, sampled_vol, volume_pdf);
-                t += its.t;
-                return true;
+                if(traversed.current())
+                    tr *= traversed.current()->transmittance(sampler, ray(t0), ray(hits[i].t), lod);
+                traversed.cross(hits[i].mesh->getVolume().get());
+                t0 = hits[i].t;
+
+                float maxTr = tr.maxCoeff();
+                if(maxTr <= 0.f)
+                    return Color3f(0.f);
+                if(maxTr < RouletteThreshold)
+                {
+                    float survival = maxTr / RouletteThreshold;
+                    if(sampler->next1D() >= survival)
+                        return Color3f(0.f);
+                    tr /= survival;
+                }
             }
         }
+        if(!truncated)
+            break;
+
+        // More boundaries than fit at once: another query from the last one, it can only find boundaries now
+        ray.mint = hits[nHits - 1].t + Epsilon;
+        if(m_accel->rayIntersectBoundaries(ray, hits, MaxBoundaryHits, nHits, truncated))
+            return Color3f(0.f);
     }
+    if(combinedMedia)
+        return m_volume_bvh.transmittance(sampler, Ray3f(p, d), ray.maxt, lod);
+    if(traversed.current())
+        tr *= traversed.current()->transmittance(sampler, ray(t0), ray(ray.maxt), lod);
+    return tr;
 }
 
 
 
-
 /// Sample emitter with importance sampling
 const Emitter * Scene::sampleEmitter(Sampler *sampler, float &pdf, EmitterQueryRecord lRec) const {
 	
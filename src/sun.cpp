@@ -0,0 +1,52 @@
+/*
+    Date: 19-1-2023
+    Authors: Pedro José Pérez García
+    Comms: Part of our nori extensions for the final assignment
+            of the course "Modelling and Simullation of Appearance",
+            Master in Robotics, Graphics and Computer Vision (MRGCV),
+            Universidad de Zaragoza, course 2022-2023
+*/
+
+#include <nori/sun.h>
+#include <nori/frame.h>
+
+NORI_NAMESPACE_BEGIN
+
+SunEmitter::SunEmitter(const PropertyList &props)
+{
+    m_type = EmitterType::EMITTER_DISTANT_DISK;
+    /// Direction towards the sun
+    m_direction = props.getVector("direction", Vector3f(0.f, 1.f, 0.f)).normalized();
+    m_irradiance = props.getColor("irradiance", Color3f(1.f));
+    m_angular_radius = clamp(props.getFloat("angular_radius", 0.004675f), 0.f, (float)M_PI / 2.f);
+    m_cos_max = std::cos(m_angular_radius);
+}
+
+std::string SunEmitter::toString() const
+{
+    return tfm::format(
+        "SunEmitter[\n"
+        "  direction = %s,\n"
+        "  irradiance = %s,\n"
+        "  angular radius = %f\n"
+        "]", m_direction.toString(), m_irradiance.toString(), m_angular_radius);
+}
+
+Color3f SunEmitter::sample(EmitterQueryRecord & lRec, const Point2f & sample, float optional_u) const
+{
+    /// Uniform direction within the cone of the disk
+    float cosTheta = 1.f - sample.x() * (1.f - m_cos_max);
+    float sinTheta = std::sqrt(std::max(0.f, 1.f - cosTheta * cosTheta));
+    float phi = 2.f * M_PI * sample.y();
+    lRec.wi = Frame(m_direction).toWorld(Vector3f(sinTheta * std::cos(phi), sinTheta * std::sin(phi), cosTheta));
+    lRec.dist = Distance;
+    lRec.p = lRec.ref + lRec.wi * lRec.dist;
+    lRec.n = -lRec.wi;
+
+    // As with point lights, the pdf is left as 1 and the irradiance is returned
+    lRec.pdf = 1.;
+    return m_irradiance;
+}
+
+NORI_REGISTER_CLASS(SunEmitter, "sun");
+NORI_NAMESPACE_END
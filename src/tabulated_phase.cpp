@@ -0,0 +1,225 @@
+/*
+    Date: 19-1-2023
+    Authors: Pedro José Pérez García
+    Comms: Part of our nori extensions for the final assignment
+            of the course "Modelling and Simullation of Appearance",
+            Master in Robotics, Graphics and Computer Vision (MRGCV),
+            Universidad de Zaragoza, course 2022-2023
+*/
+
+#include <nori/phasefunction.h>
+#include <nori/frame.h>
+#include <filesystem/resolver.h>
+#include <algorithm>
+#include <fstream>
+#include <functional>
+#include <sstream>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Tabulated phase function, for measured or fitted ones (i.e. Mie scattering of clouds)
+ *
+ * The phase function is given either as a file of measured "angle value" pairs, or as a
+ * mixture of Henyey-Greenstein lobes, and resampled at activation into a piecewise constant
+ * table over cos(theta), together with its CDF and a guide table into it. Evaluating is
+ * a single table lookup, and sampling starts at the bin the guide table points to and
+ * walks forward (a step or two on average) before placing cos(theta) uniformly in the bin.
+ * The table is normalized, so it is sampled exactly and sample() always returns 1.
+ *
+ * theta is the scattering angle against the propagation direction (-wi), so 0 means
+ * forward scattering, unlike the g of the henyey-greenstein phase function.
+ */
+class TabulatedPhaseFunction : public PhaseFunction {
+public:
+    TabulatedPhaseFunction(const PropertyList &propList)
+    {
+        /// Measured phase function: lines of "angle value", the angle in degrees, # starts a comment. Values need not be normalized
+        m_filename = propList.getString("filename", "");
+
+        /// Fitted phase function: comma separated "g weight" pairs of Henyey-Greenstein lobes (g > 0 scatters forward)
+        m_lobes = propList.getString("lobes", "");
+
+        /// Bins of the table over cos(theta)
+        m_resolution = std::max(16, propList.getInteger("resolution", 1024));
+
+        mu_s = propList.getColor("mu_s", Color3f(0.f));
+
+        if(m_filename.empty() == m_lobes.empty())
+            throw NoriException("TabulatedPhaseFunction: either a filename or lobes has to be given!");
+    }
+
+    void activate()
+    {
+        /// Average of the phase function over every bin, from a few points inside it
+        const int subsamples = 8;
+        float binWidth = 2.f / m_resolution;
+        std::function<float(float)> phase = m_filename.empty() ? lobesPhase() : measuredPhase();
+        m_values.assign(m_resolution, 0.f);
+        for(int i = 0; i < m_resolution; i++)
+        {
+            for(int j = 0; j < subsamples; j++)
+                m_values[i] += std::max(0.f, phase(-1.f + binWidth * (i + (j + 0.5f) / subsamples)));
+            m_values[i] /= subsamples;
+        }
+
+        /// Normalization over the sphere: 2 pi sum(value * binWidth) = 1
+        m_cdf.assign(m_resolution + 1, 0.f);
+        for(int i = 0; i < m_resolution; i++)
+            m_cdf[i + 1] = m_cdf[i] + m_values[i];
+        float total = m_cdf[m_resolution];
+        if(!(total > 0.f))
+            throw NoriException("TabulatedPhaseFunction: the phase function is zero everywhere!");
+        m_mean_cosine = 0.f;
+        for(int i = 0; i < m_resolution; i++)
+        {
+            m_values[i] /= total * binWidth * 2.f * M_PI;
+            m_cdf[i + 1] /= total;
+            m_mean_cosine += m_values[i] * 2.f * M_PI * binWidth * (-1.f + binWidth * (i + 0.5f));
+        }
+        m_cdf[m_resolution] = 1.f;
+
+        /// m_guide[j] is the bin that holds u = j / resolution
+        m_guide.resize(m_resolution);
+        int bin = 0;
+        for(int j = 0; j < m_resolution; j++)
+        {
+            float u = (float)j / m_resolution;
+            while(bin < m_resolution - 1 && m_cdf[bin + 1] <= u)
+                bin++;
+            m_guide[j] = bin;
+        }
+    }
+
+    float eval(const PFQueryRecord &pRec) const
+    {
+        return m_values[binOf(-pRec.wi.dot(pRec.wo))];
+    }
+
+    /// Compute the density of \ref sample() wrt. solid angles
+    float pdf(PFQueryRecord &pRec) const
+    {
+        pRec.m_pdf = eval(pRec);
+        return pRec.m_pdf;
+    }
+
+    float sample(PFQueryRecord &pRec, const Point2f &sample) const
+    {
+        float u = sample.x();
+        int bin = m_guide[std::min(m_resolution - 1, (int)(u * m_resolution))];
+        while(bin < m_resolution - 1 && m_cdf[bin + 1] <= u)
+            bin++;
+        float binMass = m_cdf[bin + 1] - m_cdf[bin];
+        float offset = binMass > 0.f ? clamp((u - m_cdf[bin]) / binMass, 0.f, 1.f) : 0.5f;
+
+        float cosTheta = clamp(-1.f + (bin + offset) * 2.f / m_resolution, -1.f, 1.f);
+        float sinTheta = std::sqrt(std::max(0.f, 1.f - cosTheta * cosTheta));
+        float phi = 2.f * M_PI * sample.y();
+        pRec.wo = Frame(-pRec.wi).toWorld(Vector3f(sinTheta * std::cos(phi), sinTheta * std::sin(phi), cosTheta));
+        pRec.m_pdf = m_values[bin];
+        return m_values[bin] > 0.f ? 1.f : 0.f;
+    }
+
+    float getMeanCosine() const
+    {
+        return m_mean_cosine;
+    }
+
+    const Color3f get_mu_s() const
+    {
+        return mu_s;
+    }
+
+    /// Return a human-readable summary
+    std::string toString() const {
+        return tfm::format(
+            "TabulatedPhaseFunction[\n"
+            "  filename = \"%s\"\n"
+            "  lobes = \"%s\"\n"
+            "  resolution = %d\n"
+            "  mean cosine = %f\n"
+            "  mu_s = %s\n"
+            "]", m_filename, m_lobes, m_resolution, m_mean_cosine, mu_s);
+    }
+
+    EClassType getClassType() const { return EPhaseFunction; }
+private:
+    int binOf(float cosTheta) const
+    {
+        return std::min(m_resolution - 1, std::max(0, (int)((cosTheta + 1.f) * 0.5f * m_resolution)));
+    }
+
+    /// Mixture of the Henyey-Greenstein lobes, as a function of cos(theta)
+    std::function<float(float)> lobesPhase() const
+    {
+        std::vector<std::pair<float, float>> lobes;
+        std::stringstream lobeList(m_lobes);
+        std::string lobe;
+        while(std::getline(lobeList, lobe, ','))
+        {
+            std::stringstream ss(lobe);
+            float g, weight;
+            if(!(ss >> g >> weight))
+                throw NoriException("TabulatedPhaseFunction: malformed lobe \"%s\", expected \"g weight\"", lobe);
+            lobes.emplace_back(clamp(g, -0.999f, 0.999f), weight);
+        }
+        return [lobes](float cosTheta) {
+            float value = 0.f;
+            for(const std::pair<float, float>& lobe : lobes)
+            {
+                float g = lobe.first;
+                float denom = 1.f + g * g - 2.f * g * cosTheta;
+                value += lobe.second * (0.25f * INV_PI) * (1.f - g * g) / (denom * std::sqrt(denom));
+            }
+            return value;
+        };
+    }
+
+    /// Measured values, interpolated linearly in the angle, as a function of cos(theta)
+    std::function<float(float)> measuredPhase() const
+    {
+        filesystem::path path = getFileResolver()->resolve(m_filename);
+        std::ifstream is(path.str());
+        if(is.fail())
+            throw NoriException("TabulatedPhaseFunction: unable to open \"%s\"!", m_filename);
+
+        std::vector<std::pair<float, float>> samples;
+        std::string line;
+        while(std::getline(is, line))
+        {
+            line = line.substr(0, line.find('#'));
+            std::stringstream ss(line);
+            float angle, value;
+            if(ss >> angle >> value)
+                samples.emplace_back(angle * (float)M_PI / 180.f, value);
+        }
+        if(samples.empty())
+            throw NoriException("TabulatedPhaseFunction: \"%s\" has no \"angle value\" lines!", m_filename);
+        std::sort(samples.begin(), samples.end());
+
+        return [samples](float cosTheta) {
+            float theta = std::acos(clamp(cosTheta, -1.f, 1.f));
+            auto it = std::lower_bound(samples.begin(), samples.end(), std::make_pair(theta, -std::numeric_limits<float>::infinity()));
+            if(it == samples.begin())
+                return samples.front().second;
+            if(it == samples.end())
+                return samples.back().second;
+            const std::pair<float, float>& a = *(it - 1);
+            const std::pair<float, float>& b = *it;
+            float t = b.first > a.first ? (theta - a.first) / (b.first - a.first) : 0.f;
+            return a.second + t * (b.second - a.second);
+        };
+    }
+
+    std::string m_filename;
+    std::string m_lobes;
+    int m_resolution;
+    std::vector<float> m_values;        /// Phase function (and sampling density) over the bins of cos(theta)
+    std::vector<float> m_cdf;           /// m_cdf[i] is the probability of the bins below i
+    std::vector<int> m_guide;           /// First bin that may hold u = j / resolution
+    float m_mean_cosine = 0.f;
+    Color3f mu_s;
+};
+
+NORI_REGISTER_CLASS(TabulatedPhaseFunction, "tabulated");
+NORI_NAMESPACE_END
@@ -17,6 +17,7 @@
 
 #include <nori/texture.h>
 #include <nori/bitmap.h>
+#include <nori/assetcache.h>
 
 #include <filesystem/resolver.h>
 #include <fstream>
@@ -26,8 +27,6 @@ NORI_NAMESPACE_BEGIN
 class BitmapTexture: public Texture {
 public:
 	BitmapTexture(const PropertyList& props) {
-		m_bitmap = 0;
-
 		m_bitmap_name = props.getString("filename", "null");
 		std::string interpolation_type = props.getString("interpolation", "standard");			//Intento de añadir (no) interpolación closest
 		filesystem::path filename =
@@ -38,36 +37,21 @@ public:
 		{
 			cout << "Loading Texture Map: " << filename.str() << endl;
 
-			if(interpolation_type.compare("standard") == 0)
-			{
-				cout << "Using bilinear interpolation!" << endl;
-				m_bitmap = new LDRBitmap(filename.str(), true);
-			}
-			else if(interpolation_type.compare("closest") == 0)
-			{
-				cout << "Using closest interpolation!" << endl;
-				m_bitmap = new LDRBitmap(filename.str(), false);
-			}
-			else
-			{
-				cout << "Using bilinear interpolation!" << endl;
-				m_bitmap = new LDRBitmap(filename.str());
-			}
-				
+			bool bilinear = interpolation_type.compare("closest") != 0;
+			cout << (bilinear ? "Using bilinear interpolation!" : "Using closest interpolation!") << endl;
+
+			// Textures with the same file and interpolation share the bitmap
+			std::string path = filename.make_absolute().str();
+			m_bitmap = AssetCache<const LDRBitmap>::instance().get(path + (bilinear ? "|bilinear" : "|closest"), [&]() {
+				return std::make_shared<const LDRBitmap>(path, bilinear);
+			});
+
 			cout << "Loaded " << m_bitmap_name << " - SIZE [" << m_bitmap->rows() << ", " << m_bitmap->cols() << "]" << endl;
 		}
 		m_color = props.getColor("color", Color3f(1.));
 		m_scale[0] = props.getFloat("scalex", 1.f);
 		m_scale[1] = props.getFloat("scaley", 1.f);
 	}
-	~BitmapTexture()
-	{
-		if (m_bitmap)
-			delete m_bitmap;
-
-		m_bitmap = 0;
-	}
-
 	virtual std::string toString() const {
 		return tfm::format(
 			"Texture[\n"
@@ -88,7 +72,7 @@ public:
 
 protected:
 	Color3f m_color;
-	LDRBitmap* m_bitmap;
+	std::shared_ptr<const LDRBitmap> m_bitmap;
 	float m_rotation;
 	Vector2f m_scale;
 
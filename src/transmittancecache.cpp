@@ -0,0 +1,70 @@
+/*
+    Date: 19-1-2023
+    Authors: Pedro José Pérez García
+    Comms: Part of our nori extensions for the final assignment
+            of the course "Modelling and Simullation of Appearance",
+            Master in Robotics, Graphics and Computer Vision (MRGCV),
+            Universidad de Zaragoza, course 2022-2023
+*/
+
+#include <nori/transmittancecache.h>
+#include <nori/sampler.h>
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+
+NORI_NAMESPACE_BEGIN
+
+void TransmittanceCache::build(const BoundingBox3f& bbox, int resolution, int samples, const Sampler* sampler, int seed,
+    const Estimator& estimate)
+{
+    m_grid = UniformGrid(bbox, resolution);
+    const int* cells = m_grid.cells;
+
+    // Slices of vertices, seeded per slice (see Sampler::prepareStream())
+    std::vector<Color3f> values((size_t)(cells[0] + 1) * (cells[1] + 1) * (cells[2] + 1));
+    tbb::parallel_for(tbb::blocked_range<int>(0, cells[2] + 1), [&](const tbb::blocked_range<int>& range) {
+        std::unique_ptr<Sampler> sliceSampler(sampler->clone());
+        for(int z = range.begin(); z < range.end(); z++)
+        {
+            sliceSampler->prepareStream(z, seed);
+            for(int y = 0; y <= cells[1]; y++)
+            for(int x = 0; x <= cells[0]; x++)
+            {
+                Point3f p = m_grid.cellMin(x, y, z);
+                Color3f tr(0.f);
+                for(int s = 0; s < samples; s++)
+                {
+                    Color3f estimateTr = estimate(sliceSampler.get(), p);
+                    if(estimateTr.isValid())
+                        tr += estimateTr;
+                }
+                values[vertexIndex(x, y, z)] = tr / (float)std::max(1, samples);
+            }
+        }
+    });
+    m_values = std::move(values);
+}
+
+bool TransmittanceCache::lookup(const Point3f& p, Color3f& tr) const
+{
+    if(m_values.empty() || !m_grid.bbox.contains(p))
+        return false;
+
+    // Trilinear interpolation between the vertices of the cell holding p
+    Vector3f local = m_grid.toLocal(p);
+    int x0 = std::min(m_grid.cells[0] - 1, std::max(0, (int)local.x()));
+    int y0 = std::min(m_grid.cells[1] - 1, std::max(0, (int)local.y()));
+    int z0 = std::min(m_grid.cells[2] - 1, std::max(0, (int)local.z()));
+    Vector3f f = local - Vector3f((float)x0, (float)y0, (float)z0);
+
+    tr = Color3f(0.f);
+    for(int c = 0; c < 8; c++)
+    {
+        int dx = c & 1, dy = (c >> 1) & 1, dz = (c >> 2) & 1;
+        float w = (dx ? f.x() : 1.f - f.x()) * (dy ? f.y() : 1.f - f.y()) * (dz ? f.z() : 1.f - f.z());
+        tr += w * vertex(x0 + dx, y0 + dy, z0 + dz);
+    }
+    return true;
+}
+
+NORI_NAMESPACE_END
@@ -0,0 +1,38 @@
+/*
+    Date: 19-1-2023
+    Authors: Pedro José Pérez García
+    Comms: Part of our nori extensions for the final assignment
+            of the course "Modelling and Simullation of Appearance",
+            Master in Robotics, Graphics and Computer Vision (MRGCV),
+            Universidad de Zaragoza, course 2022-2023
+*/
+
+/// Offline preprocessing of .vol grids. Grids converted from VDB usually carry large empty margins,
+/// so the grid is cropped to its non-zero voxels, and its statistics and mip pyramid (the majorant
+/// grids) are stored in an extended header, so that nori does not have to compute them on every launch
+
+#include <nori/volumedatabase.h>
+
+using namespace nori;
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        cerr << "Syntax: " << argv[0] << " <input.vol> <output.vol>" << endl;
+        cerr << "Crops <input.vol> to its non-zero voxels and writes it to <output.vol>, along with its statistics and majorants" << endl;
+        return -1;
+    }
+    if (std::string(argv[1]) == std::string(argv[2])) {
+        cerr << "The input and output files must be different." << endl;
+        return -1;
+    }
+
+    // Local coordinates: the output keeps the bounding box of the input (cropped)
+    Volumedatabase grid(argv[1]);
+    if (!grid.cropToActive()) {
+        cerr << "\"" << argv[1] << "\" is empty everywhere, there is nothing to write." << endl;
+        return -1;
+    }
+    grid.writeOptimizedVOL(argv[2]);
+    cout << "Wrote " << argv[2] << endl;
+    return 0;
+}
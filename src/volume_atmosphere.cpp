@@ -0,0 +1,571 @@
+/*
+    Date: 19-1-2023
+    Authors: Pedro José Pérez García
+    Comms: Part of our nori extensions for the final assignment
+            of the course "Modelling and Simullation of Appearance",
+            Master in Robotics, Graphics and Computer Vision (MRGCV),
+            Universidad de Zaragoza, course 2022-2023
+*/
+
+#include <nori/volume.h>
+#include <nori/scene.h>
+#include <nori/sun.h>
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+#include <algorithm>
+#include <vector>
+
+NORI_NAMESPACE_BEGIN
+
+/// Geometry is in double precision: near the ground, r * r - bottom_radius^2 cancels out most of the digits of a float
+inline double clamp(double value, double min, double max) {
+    return value < min ? min : (value > max ? max : value);
+}
+
+/**
+ * \brief Earth-like atmosphere with Rayleigh and Mie scattering, precomputed into lookup tables
+ *
+ * Follows "Precomputed Atmospheric Scattering" (Bruneton and Neyret 2008, and the 2017 revision of its
+ * implementation): the densities fall off exponentially with the altitude above a spherical planet, the
+ * transmittance to the top of the atmosphere is tabulated over (r, mu) and the single scattering of the
+ * sun over (r, mu, mu_s, nu), both at activation. A segment of any length then costs a handful of table
+ * lookups: its transmittance is a ratio of transmittances to the top, and its in-scattering the
+ * scattering towards the top from its start minus the attenuated one from its end.
+ *
+ * r is the distance to the center of the planet, mu the cosine of the view ray against the zenith,
+ * mu_s the one of the sun and nu the one between the view ray and the sun. Distances are in meters,
+ * the scene is scaled by unit and its origin is at altitude meters above the ground.
+ *
+ * Meant to be the enviromental medium of the scene, it is never scattered in by the integrator
+ * (see isPrecomputed()). There is no multiple scattering, and the ground of the planet is black.
+ */
+class VolumeAtmosphere : public Volume
+{
+public:
+    VolumeAtmosphere(const PropertyList& props)
+    {
+        /// Planet and atmosphere radii (m)
+        m_bottom_radius = props.getFloat("bottom_radius", 6360e3f);
+        m_top_radius = props.getFloat("top_radius", 6420e3f);
+        if(!(m_top_radius > m_bottom_radius && m_bottom_radius > 0.f))
+            throw NoriException("VolumeAtmosphere: top_radius has to be above bottom_radius!");
+
+        /// Rayleigh scattering at sea level (1/m) and scale height (m)
+        m_rayleigh_scattering = props.getColor("rayleigh_scattering", Color3f(5.802e-6f, 13.558e-6f, 33.1e-6f));
+        m_rayleigh_height = props.getFloat("rayleigh_height", 8000.f);
+
+        /// Mie scattering and extinction at sea level (1/m), scale height (m) and asymmetry of the Cornette-Shanks phase function
+        m_mie_scattering = props.getColor("mie_scattering", Color3f(3.996e-6f));
+        m_mie_extinction = props.getColor("mie_extinction", Color3f(4.44e-6f));
+        m_mie_height = props.getFloat("mie_height", 1200.f);
+        m_mie_g = clamp(props.getFloat("mie_g", 0.8f), -0.999f, 0.999f);
+
+        /// Ozone absorption (1/m) at the peak of its layer, 25 km high and 30 km wide. Tints the twilight blue
+        m_ozone_absorption = props.getColor("ozone_absorption", Color3f(0.65e-6f, 1.881e-6f, 0.085e-6f));
+
+        /// Direction towards the sun, and its irradiance at the top of the atmosphere. Only for skies without
+        /// a sun emitter: the one of the scene overrides them (see setFrame())
+        m_sun_given = props.has("sun_direction") || props.has("sun_irradiance") || props.has("sun_angular_radius");
+        m_sun_direction = props.getVector("sun_direction", Vector3f(0.f, 1.f, 0.f)).normalized();
+        m_sun_irradiance = props.getColor("sun_irradiance", Color3f(1.f));
+        m_sun_angular_radius = props.getFloat("sun_angular_radius", 0.004675f);
+
+        /// The sun stops lighting the atmosphere below this elevation (cosine of the zenith angle, 102 degrees)
+        m_mu_s_min = props.getFloat("mu_s_min", -0.2f);
+
+        /// Meters per scene unit, and altitude of the origin of the scene over the ground (m)
+        m_unit = props.getFloat("unit", 1.f);
+        m_altitude = props.getFloat("altitude", 0.f);
+
+        /// Integration steps of the precomputation
+        m_steps = std::max(8, props.getInteger("steps", 64));
+
+        mu_t = Color3f(0.f);
+        mu_a = Color3f(0.f);
+        m_heterogeneous = true;
+    }
+
+    void activate()
+    {
+        /// The atmosphere is never scattered in, but the phase function has to be there for whoever asks
+        if(!m_phase_function)
+            m_phase_function = std::shared_ptr<PhaseFunction>(static_cast<PhaseFunction*>(
+                NoriObjectFactory::createInstance("rayleigh", PropertyList())));
+
+        /// The scattering tables wait for the sun of the scene (see setFrame())
+        precomputeTransmittance();
+    }
+
+    void setParent(NoriObject* parent)
+    {
+        if(parent->getClassType() == EScene)
+            m_scene = static_cast<const Scene*>(parent);
+    }
+
+    /// The scene selects its first frame once it holds all its emitters: the sun is taken from its emitter there
+    void setFrame(int frame, bool prefetchNext)
+    {
+        const SunEmitter* sun = nullptr;
+        if(m_scene)
+            for(const Emitter* emitter : m_scene->getLights())
+                if((sun = dynamic_cast<const SunEmitter*>(emitter)))
+                    break;
+        if(sun)
+        {
+            if(m_sun_given && (sun->getDirection() != m_sun_direction || (sun->getIrradiance() != m_sun_irradiance).any()
+                || sun->getAngularRadius() != m_sun_angular_radius))
+                cerr << "VolumeAtmosphere: its sun differs from the sun emitter, using the emitter's" << endl;
+            m_sun_given = false;
+            m_sun_direction = sun->getDirection();
+            m_sun_irradiance = sun->getIrradiance();
+            m_sun_angular_radius = sun->getAngularRadius();
+        }
+
+        /// Only the size of the sun is in the tables
+        if(m_rayleigh.empty() || m_scattering_radius != m_sun_angular_radius)
+        {
+            precomputeScattering();
+            m_scattering_radius = m_sun_angular_radius;
+        }
+    }
+
+    bool isPrecomputed() const { return true; }
+
+    Color3f precomputedScattering(const Ray3f& ray, float tMax, Color3f& tr) const
+    {
+        tr = Color3f(1.f);
+        Vector3d x;
+        double r, mu, d;
+        bool ground;
+        if(!enterAtmosphere(ray.o, ray.d, tMax, x, r, mu, d, ground))
+            return Color3f(0.f);
+
+        double mu_s = clamp(x.dot(m_sun_direction.cast<double>()) / r, -1.0, 1.0);
+        double nu = ray.d.dot(m_sun_direction);
+        Color3f rayleigh, mie;
+        singleScattering(r, mu, mu_s, nu, ground, rayleigh, mie);
+
+        if(std::isinf(d))
+        {
+            /// Leaves the atmosphere, or ends at the (black) ground of the planet
+            tr = ground ? Color3f(0.f) : transmittanceToTop(r, mu);
+        }
+        else
+        {
+            /// Whatever lies beyond the end of the segment does not reach its start
+            double r_d = clampRadius(std::sqrt(d * d + 2.0 * r * mu * d + r * r));
+            double mu_d = clamp((r * mu + d) / r_d, -1.0, 1.0);
+            double mu_s_d = clamp((r * mu_s + d * nu) / r_d, -1.0, 1.0);
+            tr = transmittance(r, mu, d, ground);
+            Color3f rayleigh_d, mie_d;
+            singleScattering(r_d, mu_d, mu_s_d, nu, ground, rayleigh_d, mie_d);
+            rayleigh = (rayleigh - tr * rayleigh_d).cwiseMax(0.f);
+            mie = (mie - tr * mie_d).cwiseMax(0.f);
+        }
+        return m_sun_irradiance * (rayleigh * rayleighPhase(nu) + mie * miePhase(nu));
+    }
+
+    Point3f samplePathStep(const Ray3f& ray, const Intersection& its, Sampler*& sampler, Color3f& _beta, bool& sampledMedium, int lod = 0) const
+    {
+        /// Never collides, the in-scattering is precomputed
+        sampledMedium = false;
+        _beta = transmittance(sampler, ray.o, its.p, lod);
+        return its.p;
+    }
+
+    float pdfFail(const Point3f& xz, const float& z, const Vector2f& sample) const
+    {
+        return 1.f;
+    }
+
+    Color3f transmittance(Sampler*& sampler, const Point3f& x0, const Point3f& xz, int lod = 0) const
+    {
+        Vector3f dir = xz - x0;
+        float dist = dir.norm();
+        if(dist <= 0.f)
+            return Color3f(1.f);
+        dir /= dist;
+        Vector3d x;
+        double r, mu, d;
+        bool ground;
+        if(!enterAtmosphere(x0, dir, dist, x, r, mu, d, ground))
+            return Color3f(1.f);
+        if(std::isinf(d))
+            return ground ? Color3f(0.f) : transmittanceToTop(r, mu);
+        return transmittance(r, mu, d, ground);
+    }
+
+    Color3f sample_mu_t(const Point3f& p_world) const
+    {
+        return Color3f(0.f);
+    }
+
+    Color3f sample_mu_a(const Point3f& p_world) const
+    {
+        return Color3f(0.f);
+    }
+
+    /// Zero, so the VolumeBVH leaves it out (combined_media does not see the atmosphere)
+    Color3f extinction(const Point3f& p_world, int lod = 0) const
+    {
+        return Color3f(0.f);
+    }
+
+    float getMajorant(int lod = 0) const
+    {
+        return 0.f;
+    }
+
+    void addChild(NoriObject* obj, const std::string& name = "none") {
+        switch (obj->getClassType()) {
+        case EPhaseFunction:
+            {
+                if(m_phase_function)
+                    throw NoriException("Volume: Tried to register multiple PF instances!");
+                PhaseFunction* _pf = static_cast<PhaseFunction*>(obj);
+                m_phase_function = std::shared_ptr<PhaseFunction>(_pf);
+            }
+            break;
+        default:
+            throw NoriException("VolumeAtmosphere::addChild(<%s>) is not supported!",
+                classTypeName(obj->getClassType()));
+            break;
+        }
+    }
+
+    /// Return a human-readable summary
+    std::string toString() const {
+        return tfm::format(
+            "VolumeAtmosphere[\n"
+            "  radii = %f, %f\n"
+            "  rayleigh = %s (height %f)\n"
+            "  mie = %s / %s (height %f, g %f)\n"
+            "  ozone = %s\n"
+            "  sun = %s (irradiance %s, angular radius %f)\n"
+            "  unit = %f, altitude = %f\n"
+            "]", m_bottom_radius, m_top_radius, m_rayleigh_scattering, m_rayleigh_height,
+            m_mie_scattering, m_mie_extinction, m_mie_height, m_mie_g, m_ozone_absorption,
+            m_sun_direction, m_sun_irradiance, m_sun_angular_radius, m_unit, m_altitude);
+    }
+
+private:
+    /// Resolution of the tables: transmittance over (mu, r), and scattering over (r, mu, mu_s, nu)
+    static constexpr int TransmittanceMu = 256, TransmittanceR = 64;
+    static constexpr int ScatteringR = 32, ScatteringMu = 128, ScatteringMuS = 32, ScatteringNu = 8;
+
+    double m_bottom_radius, m_top_radius;
+    Color3f m_rayleigh_scattering;
+    float m_rayleigh_height;
+    Color3f m_mie_scattering, m_mie_extinction;
+    float m_mie_height, m_mie_g;
+    Color3f m_ozone_absorption;
+    Vector3f m_sun_direction;
+    Color3f m_sun_irradiance;
+    float m_sun_angular_radius;
+    bool m_sun_given;
+    float m_scattering_radius = 0.f;           /// Angular radius of the sun the scattering tables were built for
+    const Scene* m_scene = nullptr;
+    float m_mu_s_min;
+    float m_unit, m_altitude;
+    int m_steps;
+
+    std::vector<Color3f> m_transmittance;       /// Transmittance to the top of the atmosphere, mu fastest
+    std::vector<Color3f> m_rayleigh;            /// Single scattering without the phase function nor the sun irradiance, nu fastest
+    std::vector<Color3f> m_mie;
+
+    /// Texture coordinate of x in [0, 1] for n texels, so that 0 and 1 land at the centers of the first and last ones
+    static double toTexCoord(double x, int n) { return 0.5 / n + x * (1.0 - 1.0 / n); }
+    static double fromTexCoord(double u, int n) { return (u - 0.5 / n) / (1.0 - 1.0 / n); }
+
+    double horizonDistance() const { return std::sqrt(m_top_radius * m_top_radius - m_bottom_radius * m_bottom_radius); }
+
+    double horizonDistance(double r) const { return std::sqrt(std::max(0.0, r * r - m_bottom_radius * m_bottom_radius)); }
+
+    double clampRadius(double r) const { return clamp(r, m_bottom_radius, m_top_radius); }
+
+    double distanceToTop(double r, double mu) const
+    {
+        double disc = r * r * (mu * mu - 1.0) + m_top_radius * m_top_radius;
+        return std::max(0.0, -r * mu + std::sqrt(std::max(0.0, disc)));
+    }
+
+    double distanceToBottom(double r, double mu) const
+    {
+        double disc = r * r * (mu * mu - 1.0) + m_bottom_radius * m_bottom_radius;
+        return std::max(0.0, -r * mu - std::sqrt(std::max(0.0, disc)));
+    }
+
+    bool intersectsGround(double r, double mu) const
+    {
+        return mu < 0.0 && r * r * (mu * mu - 1.0) + m_bottom_radius * m_bottom_radius >= 0.0;
+    }
+
+    Color3f extinctionAt(double altitude) const
+    {
+        float rayleigh = std::exp(-altitude / m_rayleigh_height);
+        float mie = std::exp(-altitude / m_mie_height);
+        float ozone = std::max(0.0, 1.0 - std::abs(altitude - 25e3) / 15e3);
+        return m_rayleigh_scattering * rayleigh + m_mie_extinction * mie + m_ozone_absorption * ozone;
+    }
+
+    static float rayleighPhase(double nu)
+    {
+        return 3.f / (16.f * M_PI) * (1.f + nu * nu);
+    }
+
+    float miePhase(double nu) const
+    {
+        float g2 = m_mie_g * m_mie_g;
+        float k = 3.f / (8.f * M_PI) * (1.f - g2) / (2.f + g2);
+        return k * (1.f + nu * nu) / std::pow(1.f + g2 - 2.f * m_mie_g * nu, 1.5f);
+    }
+
+    /**
+     * \brief Start of the ray (o, dir) up to tMax (scene units) inside the atmosphere
+     *
+     * Gives the start x relative to the center of the planet and its (r, mu), moving rays from space to where
+     * they enter, and the length d in meters of the segment up to tMax, infinite if the ray leaves the
+     * atmosphere or hits the ground before. Returns false if the segment does not go through the atmosphere
+     */
+    bool enterAtmosphere(const Point3f& o, const Vector3f& dir, float tMax, Vector3d& x, double& r, double& mu, double& d, bool& ground) const
+    {
+        x = Vector3d(o.x() * (double)m_unit, o.y() * (double)m_unit + m_bottom_radius + m_altitude, o.z() * (double)m_unit);
+        Vector3d v = dir.cast<double>();
+        double tEnd = std::isinf(tMax) ? std::numeric_limits<double>::infinity() : tMax * (double)m_unit;
+        r = x.norm();
+        double rmu = x.dot(v);
+        if(r > m_top_radius)
+        {
+            double disc = rmu * rmu - r * r + m_top_radius * m_top_radius;
+            double entry = -rmu - std::sqrt(std::max(0.0, disc));
+            if(disc < 0.0 || entry < 0.0 || entry >= tEnd)
+                return false;
+            x += v * entry;
+            tEnd -= entry;
+            r = m_top_radius;
+            rmu = x.dot(v);
+        }
+        r = clampRadius(r);
+        mu = clamp(rmu / r, -1.0, 1.0);
+        ground = intersectsGround(r, mu);
+        double exit = ground ? distanceToBottom(r, mu) : distanceToTop(r, mu);
+        d = tEnd < exit ? tEnd : std::numeric_limits<double>::infinity();
+        return true;
+    }
+
+    /// Bilinear lookup of the transmittance to the top of the atmosphere
+    Color3f transmittanceToTop(double r, double mu) const
+    {
+        double H = horizonDistance(), rho = horizonDistance(r);
+        double d = distanceToTop(r, mu);
+        double dMin = m_top_radius - r, dMax = rho + H;
+        double u = toTexCoord(dMax > dMin ? (d - dMin) / (dMax - dMin) : 0.0, TransmittanceMu);
+        double v = toTexCoord(rho / H, TransmittanceR);
+
+        float x = clamp((float)(u * TransmittanceMu - 0.5), 0.f, TransmittanceMu - 1.f);
+        float y = clamp((float)(v * TransmittanceR - 0.5), 0.f, TransmittanceR - 1.f);
+        int x0 = std::min((int)x, TransmittanceMu - 2), y0 = std::min((int)y, TransmittanceR - 2);
+        float fx = x - x0, fy = y - y0;
+        auto at = [&](int i, int j) { return m_transmittance[j * TransmittanceMu + i]; };
+        return (1.f - fy) * ((1.f - fx) * at(x0, y0) + fx * at(x0 + 1, y0))
+            + fy * ((1.f - fx) * at(x0, y0 + 1) + fx * at(x0 + 1, y0 + 1));
+    }
+
+    /// Transmittance of the segment of length d from (r, mu), as a ratio of transmittances to the top
+    Color3f transmittance(double r, double mu, double d, bool ground) const
+    {
+        double r_d = clampRadius(std::sqrt(d * d + 2.0 * r * mu * d + r * r));
+        double mu_d = clamp((r * mu + d) / r_d, -1.0, 1.0);
+        Color3f tr = ground ? transmittanceToTop(r_d, -mu_d) / transmittanceToTop(r, -mu).cwiseMax(1e-20f)
+                            : transmittanceToTop(r, mu) / transmittanceToTop(r_d, mu_d).cwiseMax(1e-20f);
+        return tr.cwiseMin(1.f);
+    }
+
+    /// Transmittance of the sun from radius r, faded out as it sets behind the horizon
+    Color3f transmittanceToSun(double r, double mu_s) const
+    {
+        double sinHorizon = m_bottom_radius / r;
+        double cosHorizon = -std::sqrt(std::max(0.0, 1.0 - sinHorizon * sinHorizon));
+        double width = sinHorizon * m_sun_angular_radius;
+        float x = clamp((float)((mu_s - cosHorizon + width) / (2.0 * width)), 0.f, 1.f);
+        return transmittanceToTop(r, mu_s) * (x * x * (3.f - 2.f * x));
+    }
+
+    void precomputeTransmittance()
+    {
+        double H = horizonDistance();
+        m_transmittance.assign(TransmittanceMu * TransmittanceR, Color3f(1.f));
+        tbb::parallel_for(tbb::blocked_range<int>(0, TransmittanceR), [&](const tbb::blocked_range<int>& range) {
+            for(int j = range.begin(); j < range.end(); j++)
+            {
+                double rho = H * fromTexCoord((j + 0.5) / TransmittanceR, TransmittanceR);
+                double r = std::sqrt(rho * rho + m_bottom_radius * m_bottom_radius);
+                for(int i = 0; i < TransmittanceMu; i++)
+                {
+                    double dMin = m_top_radius - r, dMax = rho + H;
+                    double d = dMin + fromTexCoord((i + 0.5) / TransmittanceMu, TransmittanceMu) * (dMax - dMin);
+                    double mu = d == 0.0 ? 1.0 : clamp((H * H - rho * rho - d * d) / (2.0 * r * d), -1.0, 1.0);
+
+                    /// Trapezoidal rule of the optical thickness up to the top
+                    double dx = distanceToTop(r, mu) / m_steps;
+                    Color3f tau(0.f);
+                    for(int k = 0; k <= m_steps; k++)
+                    {
+                        double t = k * dx;
+                        double r_t = std::sqrt(t * t + 2.0 * r * mu * t + r * r);
+                        tau += extinctionAt(r_t - m_bottom_radius) * (k == 0 || k == m_steps ? 0.5f : 1.f);
+                    }
+                    m_transmittance[j * TransmittanceMu + i] = (-tau * (float)dx).exp();
+                }
+            }
+        });
+    }
+
+    /// Scattering table coordinates of (r, mu, mu_s, nu), in [0, 1]. mu splits the table in rays that hit the ground and rays that do not
+    void scatteringCoords(double r, double mu, double mu_s, double nu, bool ground, double u[4]) const
+    {
+        double H = horizonDistance(), rho = horizonDistance(r);
+        u[0] = toTexCoord(rho / H, ScatteringR);
+
+        double r_mu = r * mu;
+        double disc = r_mu * r_mu - r * r + m_bottom_radius * m_bottom_radius;
+        if(ground)
+        {
+            double d = -r_mu - std::sqrt(std::max(0.0, disc));
+            double dMin = r - m_bottom_radius, dMax = rho;
+            u[1] = 0.5 - 0.5 * toTexCoord(dMax == dMin ? 0.0 : (d - dMin) / (dMax - dMin), ScatteringMu / 2);
+        }
+        else
+        {
+            double d = -r_mu + std::sqrt(std::max(0.0, disc + H * H));
+            double dMin = m_top_radius - r, dMax = rho + H;
+            u[1] = 0.5 + 0.5 * toTexCoord((d - dMin) / (dMax - dMin), ScatteringMu / 2);
+        }
+
+        double d = distanceToTop(m_bottom_radius, mu_s);
+        double dMin = m_top_radius - m_bottom_radius, dMax = H;
+        double a = (d - dMin) / (dMax - dMin);
+        double A = (distanceToTop(m_bottom_radius, m_mu_s_min) - dMin) / (dMax - dMin);
+        u[2] = toTexCoord(std::max(1.0 - a / A, 0.0) / (1.0 + a), ScatteringMuS);
+
+        u[3] = (nu + 1.0) * 0.5;
+    }
+
+    /// Inverse of scatteringCoords(), at the center of texel (i_r, i_mu, i_mu_s, i_nu)
+    void scatteringParams(int i_r, int i_mu, int i_mu_s, int i_nu, double& r, double& mu, double& mu_s, double& nu, bool& ground) const
+    {
+        double H = horizonDistance();
+        double rho = H * fromTexCoord((i_r + 0.5) / ScatteringR, ScatteringR);
+        r = std::sqrt(rho * rho + m_bottom_radius * m_bottom_radius);
+
+        double u_mu = (i_mu + 0.5) / ScatteringMu;
+        ground = u_mu < 0.5;
+        if(ground)
+        {
+            double dMin = r - m_bottom_radius, dMax = rho;
+            double d = dMin + (dMax - dMin) * fromTexCoord(1.0 - 2.0 * u_mu, ScatteringMu / 2);
+            mu = d == 0.0 ? -1.0 : clamp(-(rho * rho + d * d) / (2.0 * r * d), -1.0, 1.0);
+        }
+        else
+        {
+            double dMin = m_top_radius - r, dMax = rho + H;
+            double d = dMin + (dMax - dMin) * fromTexCoord(2.0 * u_mu - 1.0, ScatteringMu / 2);
+            mu = d == 0.0 ? 1.0 : clamp((H * H - rho * rho - d * d) / (2.0 * r * d), -1.0, 1.0);
+        }
+
+        double x = fromTexCoord((i_mu_s + 0.5) / ScatteringMuS, ScatteringMuS);
+        double dMin = m_top_radius - m_bottom_radius, dMax = H;
+        double A = (distanceToTop(m_bottom_radius, m_mu_s_min) - dMin) / (dMax - dMin);
+        double a = (A - x * A) / (1.0 + x * A);
+        double d = dMin + std::min(a, A) * (dMax - dMin);
+        mu_s = d == 0.0 ? 1.0 : clamp((H * H - d * d) / (2.0 * m_bottom_radius * d), -1.0, 1.0);
+
+        /// nu is bounded by the angle between the view ray and the sun
+        double spread = std::sqrt((1.0 - mu * mu) * (1.0 - mu_s * mu_s));
+        nu = clamp((i_nu + 0.5) / ScatteringNu * 2.0 - 1.0, mu * mu_s - spread, mu * mu_s + spread);
+    }
+
+    void precomputeScattering()
+    {
+        int size = ScatteringR * ScatteringMu * ScatteringMuS * ScatteringNu;
+        m_rayleigh.assign(size, Color3f(0.f));
+        m_mie.assign(size, Color3f(0.f));
+        tbb::parallel_for(tbb::blocked_range<int>(0, ScatteringR * ScatteringMu), [&](const tbb::blocked_range<int>& range) {
+            for(int rm = range.begin(); rm < range.end(); rm++)
+            {
+                int i_r = rm / ScatteringMu, i_mu = rm % ScatteringMu;
+                for(int i_mu_s = 0; i_mu_s < ScatteringMuS; i_mu_s++)
+                {
+                    for(int i_nu = 0; i_nu < ScatteringNu; i_nu++)
+                    {
+                        double r, mu, mu_s, nu;
+                        bool ground;
+                        scatteringParams(i_r, i_mu, i_mu_s, i_nu, r, mu, mu_s, nu, ground);
+
+                        /// Trapezoidal rule along the view ray, up to the ground or the top
+                        double dx = (ground ? distanceToBottom(r, mu) : distanceToTop(r, mu)) / m_steps;
+                        Color3f rayleigh(0.f), mie(0.f);
+                        for(int k = 0; k <= m_steps; k++)
+                        {
+                            double t = k * dx;
+                            double r_t = clampRadius(std::sqrt(t * t + 2.0 * r * mu * t + r * r));
+                            double mu_s_t = clamp((r * mu_s + t * nu) / r_t, -1.0, 1.0);
+                            Color3f tr = transmittance(r, mu, t, ground) * transmittanceToSun(r_t, mu_s_t);
+                            double altitude = r_t - m_bottom_radius;
+                            float w = k == 0 || k == m_steps ? 0.5f : 1.f;
+                            rayleigh += tr * (w * (float)std::exp(-altitude / m_rayleigh_height));
+                            mie += tr * (w * (float)std::exp(-altitude / m_mie_height));
+                        }
+                        int index = (rm * ScatteringMuS + i_mu_s) * ScatteringNu + i_nu;
+                        m_rayleigh[index] = rayleigh * m_rayleigh_scattering * (float)dx;
+                        m_mie[index] = mie * m_mie_scattering * (float)dx;
+                    }
+                }
+            }
+        });
+    }
+
+    /// Quadrilinear lookup of the single scattering, within the half of the table of the ray
+    void singleScattering(double r, double mu, double mu_s, double nu, bool ground, Color3f& rayleigh, Color3f& mie) const
+    {
+        double u[4];
+        scatteringCoords(r, mu, mu_s, nu, ground, u);
+        const int sizes[4] = { ScatteringR, ScatteringMu, ScatteringMuS, ScatteringNu };
+        int lo[4];
+        float f[4];
+        for(int k = 0; k < 4; k++)
+        {
+            int first = 0, last = sizes[k] - 1;
+            if(k == 1)
+            {
+                first = ground ? 0 : ScatteringMu / 2;
+                last = ground ? ScatteringMu / 2 - 1 : ScatteringMu - 1;
+            }
+            float x = clamp((float)(u[k] * sizes[k] - 0.5), (float)first, (float)last);
+            lo[k] = std::min((int)x, last - 1);
+            f[k] = x - lo[k];
+        }
+
+        rayleigh = Color3f(0.f);
+        mie = Color3f(0.f);
+        for(int corner = 0; corner < 16; corner++)
+        {
+            float w = 1.f;
+            int idx[4];
+            for(int k = 0; k < 4; k++)
+            {
+                bool upper = (corner >> k) & 1;
+                idx[k] = lo[k] + upper;
+                w *= upper ? f[k] : 1.f - f[k];
+            }
+            if(w == 0.f)
+                continue;
+            int index = ((idx[0] * ScatteringMu + idx[1]) * ScatteringMuS + idx[2]) * ScatteringNu + idx[3];
+            rayleigh += w * m_rayleigh[index];
+            mie += w * m_mie[index];
+        }
+    }
+};
+
+NORI_REGISTER_CLASS(VolumeAtmosphere, "atmosphere");
+NORI_NAMESPACE_END
@@ -0,0 +1,209 @@
+/*
+    Date: 19-1-2023
+    Authors: Pedro José Pérez García
+    Comms: Part of our nori extensions for the final assignment
+            of the course "Modelling and Simullation of Appearance",
+            Master in Robotics, Graphics and Computer Vision (MRGCV),
+            Universidad de Zaragoza, course 2022-2023
+*/
+
+#include <nori/integrator.h>
+#include <nori/scene.h>
+#include <nori/emitter.h>
+#include <nori/bsdf.h>
+#include <nori/mesh.h>
+#include <nori/phasefunction.h>
+#include <nori/sampler.h>
+#include <algorithm>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Biased ray marching of the media, for fast look development previews
+ *
+ * Camera rays march through all the media at once (the VolumeBVH of the scene, so the
+ * densities come straight from the grid lookups) with fixed steps, or adaptive ones that
+ * cover a bounded optical thickness. Every step gathers single scattering from one sampled
+ * light, whose transmittance is marched too with coarser steps, and marching stops once the
+ * transmittance falls below a threshold. Surfaces get direct lighting only, and there is no
+ * multiple scattering nor volumetric emission: the point is to judge density scales and
+ * lighting in seconds, path_mis_participating_media renders the final frames.
+ */
+class VolumePreview : public Integrator
+{
+public:
+    VolumePreview(const PropertyList &props)
+    {
+        /// Length of the marching steps of camera rays (the largest one with adaptive steps)
+        m_step_size = std::max(1e-4f, props.getFloat("step_size", 0.02f));
+
+        /// Adaptive steps: as long as they cover at most optical_step of optical thickness (and step_size of length)
+        m_adaptive = props.getBoolean("adaptive", false);
+        m_optical_step = std::max(1e-3f, props.getFloat("optical_step", 0.1f));
+
+        /// Shadow rays march with steps shadow_step_scale times longer
+        m_shadow_step_scale = std::max(1.f, props.getFloat("shadow_step_scale", 4.f));
+
+        /// Marching stops once the transmittance falls below it, whatever lies behind is dropped
+        m_min_transmittance = clamp(props.getFloat("min_transmittance", 0.01f), 0.f, 1.f);
+
+        /// Mip level of the density lookups, coarser levels are faster and blurrier
+        m_lod = std::max(0, props.getInteger("lod", 0));
+    }
+
+    Color3f Li(const Scene* scene, Sampler* sampler, const Ray3f& ray) const
+    {
+        Intersection its;
+        bool hit = scene->rayIntersectSurface(ray, its);
+        Color3f L(0.f), tr(1.f);
+        if(!march(scene, sampler, ray, hit ? its.t : std::numeric_limits<float>::infinity(), L, tr))
+            return L;
+
+        if(!hit)
+            return L + tr * scene->getBackground(ray);
+        if(its.mesh->isEmitter())
+        {
+            const Emitter* em = its.mesh->getEmitter();
+            EmitterQueryRecord er(em, ray.o, its.p, its.shFrame.n, its.uv);
+            L += tr * em->eval(er);
+        }
+        return L + tr * directLight(scene, sampler, ray, its);
+    }
+
+    std::string toString() const
+    {
+        return tfm::format(
+            "VolumePreview[\n"
+            "  step_size = %f\n"
+            "  adaptive = %s (optical_step = %f)\n"
+            "  shadow_step_scale = %f\n"
+            "  min_transmittance = %f\n"
+            "  lod = %d\n"
+            "]", m_step_size, m_adaptive, m_optical_step, m_shadow_step_scale, m_min_transmittance, m_lod);
+    }
+
+private:
+    float m_step_size;
+    bool m_adaptive;
+    float m_optical_step;
+    float m_shadow_step_scale;
+    float m_min_transmittance;
+    int m_lod;
+
+    /// Span of ray within (0, tMax) where there are media, bounded by the scene so that enviromental media end somewhere
+    bool mediaSpan(const Scene* scene, const Ray3f& ray, float tMax, float& tMin, float& tEnd) const
+    {
+        tMin = 0.f;
+        tEnd = tMax;
+        if(!scene->getVolumeBVH().clip(ray, tMin, tEnd))
+            return false;
+        float nearT, farT;
+        if(std::isinf(tEnd) && scene->getBoundingBox().rayIntersect(ray, nearT, farT))
+            tEnd = farT;
+        return tEnd > tMin && !std::isinf(tEnd);
+    }
+
+    /**
+     * \brief Marches ray up to tMax, adding the single scattering it gathers to L and leaving its transmittance in tr
+     *
+     * Steps start at a random offset shared by the whole ray, so step artifacts turn into noise. The extinction is
+     * taken as constant over every step, so each one scatters (1 - exp(-mu_t dt)) / mu_t times its in-scattering.
+     * Returns false if marching stopped early at the transmittance threshold
+     */
+    bool march(const Scene* scene, Sampler* sampler, const Ray3f& ray, float tMax, Color3f& L, Color3f& tr) const
+    {
+        float t, tEnd;
+        if(!mediaSpan(scene, ray, tMax, t, tEnd))
+            return true;
+        const VolumeBVH& media = scene->getVolumeBVH();
+        float offset = sampler->next1D();
+
+        while(t < tEnd)
+        {
+            float dt = m_step_size;
+            if(m_adaptive)
+                dt = std::min(dt, m_optical_step / std::max(Epsilon, media.extinction(ray(t), m_lod).maxCoeff()));
+            dt = std::min(dt, tEnd - t);
+            Point3f x = ray(t + offset * dt);
+            Color3f mu_t = media.extinction(x, m_lod);
+            t += dt;
+            if(mu_t.isZero())
+                continue;
+
+            Color3f stepTr = (-mu_t * dt).exp();
+            Color3f scattered;
+            for(int i = 0; i < 3; i++)
+                scattered[i] = mu_t[i] > 0.f ? (1.f - stepTr[i]) / mu_t[i] : dt;
+            L += tr * scattered * inScattering(scene, sampler, x, ray.d);
+            tr *= stepTr;
+            if(tr.maxCoeff() < m_min_transmittance)
+                return false;
+        }
+        return true;
+    }
+
+    /// In-scattered radiance at x from one sampled light, times mu_s (without the transmittance of the step)
+    Color3f inScattering(const Scene* scene, Sampler* sampler, const Point3f& x, const Vector3f& d) const
+    {
+        float pdflight;
+        const Emitter* em = scene->sampleEmitter(sampler->next1D(), pdflight);
+        EmitterQueryRecord emitterRecord(x);
+        Color3f Le = em->sample(emitterRecord, sampler->next2D(), 0.f);
+        if(Le.isZero() || !(pdflight > 0.f))
+            return Color3f(0.f);
+
+        Color3f scattering = scene->getVolumeBVH().inScattering(x, m_lod, [&](const Volume& volume) {
+            PFQueryRecord pfRecord(-d, emitterRecord.wi);
+            return volume.getPhaseFunction()->eval(pfRecord);
+        });
+        if(scattering.isZero())
+            return Color3f(0.f);
+        return scattering * Le * shadowTransmittance(scene, x, emitterRecord) / pdflight;
+    }
+
+    /// Direct lighting of a surface point from one sampled light
+    Color3f directLight(const Scene* scene, Sampler* sampler, const Ray3f& ray, const Intersection& its) const
+    {
+        float pdflight;
+        const Emitter* em = scene->sampleEmitter(sampler->next1D(), pdflight);
+        EmitterQueryRecord emitterRecord(its.p);
+        Color3f Le = em->sample(emitterRecord, sampler->next2D(), 0.f);
+        if(Le.isZero() || !(pdflight > 0.f))
+            return Color3f(0.f);
+
+        BSDFQueryRecord bsdfRecord(its.toLocal(-ray.d), its.toLocal(emitterRecord.wi), its.uv, ESolidAngle);
+        Color3f f = its.mesh->getBSDF()->eval(bsdfRecord) * std::abs(its.shFrame.n.dot(emitterRecord.wi));
+        if(f.isZero())
+            return Color3f(0.f);
+        return f * Le * shadowTransmittance(scene, its.p, emitterRecord) / pdflight;
+    }
+
+    /// Visibility and marched transmittance from x to the light point of emitterRecord (0 under the threshold)
+    Color3f shadowTransmittance(const Scene* scene, const Point3f& x, const EmitterQueryRecord& emitterRecord) const
+    {
+        Intersection its;
+        Ray3f ray(x, emitterRecord.wi, Epsilon, emitterRecord.dist - Epsilon);
+        if(scene->rayIntersectSurface(ray, its))
+            return Color3f(0.f);
+
+        float t, tEnd;
+        if(!mediaSpan(scene, Ray3f(x, emitterRecord.wi), emitterRecord.dist, t, tEnd))
+            return Color3f(1.f);
+        const VolumeBVH& media = scene->getVolumeBVH();
+        float step = m_step_size * m_shadow_step_scale;
+        float maxTau = -std::log(std::max(m_min_transmittance, 1e-6f));
+        Color3f tau(0.f);
+        while(t < tEnd)
+        {
+            float dt = std::min(step, tEnd - t);
+            tau += media.extinction(ray(t + 0.5f * dt), m_lod) * dt;
+            t += dt;
+            if(tau.minCoeff() > maxTau)
+                return Color3f(0.f);
+        }
+        return (-tau).exp();
+    }
+};
+
+NORI_REGISTER_CLASS(VolumePreview, "volume_preview");
+NORI_NAMESPACE_END
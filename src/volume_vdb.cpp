@@ -10,6 +10,10 @@
 #include <nori/volume.h>
 #include <nori/mesh.h>
 #include <nori/volumedatabase.h>
+#include <nori/assetcache.h>
+#include <filesystem/resolver.h>
+#include <Eigen/LU>
+#include <thread>
 
 NORI_NAMESPACE_BEGIN
 
@@ -29,25 +33,94 @@ public:
     VolumeVDB(const PropertyList& props)
     {
         mu_t = props.getColor("mu_t", Color3f(0.f));
-        mu_a = props.getColor("mu_a", Color3f(0.f));        // TODO: not supported (yet?), but we can load it even though it does nothing
+        mu_a = props.getColor("mu_a", Color3f(0.f));        // Only used for emission, the absorption itself comes from mu_t - mu_s
         m_vdb_file_name = props.getString("vdb_filename", "null");
         m_mu_t_vdb_name = props.getString("vdb_mu_t_name", "density");
+        m_decomposition_tracking = props.getBoolean("decomposition_tracking", true);
         m_heterogeneous = false;
+
+        /// Out-of-core grids are split into bricks that are loaded on demand into a bounded cache (the
+        /// full resolution level only, the coarser mip levels stay in RAM, see VolumeStorageOptions)
+        m_storage.out_of_core = props.getBoolean("out_of_core", false);
+        m_storage.brick_size = props.getInteger("brick_size", m_storage.brick_size);
+        m_storage.cache_bytes = (size_t)std::max(1, props.getInteger("brick_cache_mb", 512)) << 20;
         //m_mu_a_vdb_name = props.getString("vdb_mu_a_name", "temperature");*/
         /// TODO: Call the constructor for mu_{t,a}_structure_to_be_determined_dont_use_this when I implement it
         if(m_vdb_file_name != "null")
         {
-            Transform trafo = props.getTransform("toWorld", Transform());
-            std::cout << "TRANSFORM: " << trafo.toString() << std::endl;
-            m_volumegrid_mu_t = std::make_shared<Volumedatabase>(m_vdb_file_name, trafo);
+            m_trafo = props.getTransform("toWorld", Transform());
+            m_inv_trafo = m_trafo.inverse();
+            m_jacobian = std::abs(m_trafo.getMatrix().topLeftCorner<3, 3>().determinant());
+            std::cout << "TRANSFORM: " << m_trafo.toString() << std::endl;
+            /// Sequences (i.e. smoke_####.vol) are loaded when the scene selects a frame, see setFrame()
+            if(!Volumedatabase::isSequencePattern(m_vdb_file_name))
+                m_volumegrid_mu_t = acquireGrid(m_vdb_file_name, m_volumegrid_mu_t);
             m_heterogeneous = true;
         }
+
+        /// Emission: mu_a * density * emission_scale * (emission grid), i.e. a temperature/emission channel
+        m_emission_file_name = props.getString("emission_filename", "null");
+        m_emission_scale = props.getColor("emission_scale", Color3f(1.f));
+        if(m_emission_file_name != "null")
+        {
+            if(!m_heterogeneous)
+                throw NoriException("VolumeVDB: emission_filename requires a density grid (vdb_filename)!");
+            if(!Volumedatabase::isSequencePattern(m_emission_file_name))
+            {
+                m_volumegrid_emission = acquireGrid(m_emission_file_name, m_volumegrid_emission);
+                // Otherwise the density is a sequence, and the CDF is built once setFrame() loads it
+                if(m_volumegrid_mu_t)
+                    buildEmissionCDF();
+            }
+        }
+    }
+
+    void setFrame(int frame, bool prefetchNext)
+    {
+        bool densitySequence = Volumedatabase::isSequencePattern(m_vdb_file_name);
+        bool emissionSequence = Volumedatabase::isSequencePattern(m_emission_file_name);
+        if(!densitySequence && !emissionSequence)
+            return;
+
+        if(m_prefetch_thread.joinable())
+            m_prefetch_thread.join();
+
+        if(frame != m_frame)
+        {
+            if(densitySequence)
+                loadFrame(m_vdb_file_name, frame, m_volumegrid_mu_t, m_volumegrid_next);
+            if(emissionSequence)
+                loadFrame(m_emission_file_name, frame, m_volumegrid_emission, m_volumegrid_emission_next);
+            m_frame = frame;
+            if(m_volumegrid_emission)
+                buildEmissionCDF();
+        }
+
+        // Load frame + 1 (density and emission) while this one renders. The buffers of the frame we just left are reused
+        std::string nextDensity = densitySequence ? Volumedatabase::frameFilename(m_vdb_file_name, frame + 1) : "";
+        std::string nextEmission = emissionSequence ? Volumedatabase::frameFilename(m_emission_file_name, frame + 1) : "";
+        if(prefetchNext && (!densitySequence || std::ifstream(resolvePath(nextDensity)).good()) && (!emissionSequence || std::ifstream(resolvePath(nextEmission)).good()))
+        {
+            m_next_frame = frame + 1;
+            m_prefetch_thread = std::thread([this, nextDensity, nextEmission]() {
+                if(!nextDensity.empty())
+                    m_volumegrid_next = acquireGrid(nextDensity, m_volumegrid_next);
+                if(!nextEmission.empty())
+                    m_volumegrid_emission_next = acquireGrid(nextEmission, m_volumegrid_emission_next);
+            });
+        }
+        else
+        {
+            m_next_frame = -1;
+        }
     }
 
     /// TODO: Free memory here if needed
     ~VolumeVDB()
     {
         std::cout << "DESTRUCTOR VDB" << std::endl;
+        if(m_prefetch_thread.joinable())
+            m_prefetch_thread.join();
         /*if(m_phase_function)
             delete m_phase_function;
 
@@ -80,7 +153,7 @@ public:
     }
 
 
-    Point3f samplePathStep(const Ray3f& ray, const Intersection& its, Sampler*& sampler, Color3f& _beta, std::shared_ptr<Volume>& nextVolume, std::shared_ptr<Volume>& currentVolume, bool& sampledMedium) const
+    Point3f samplePathStep(const Ray3f& ray, const Intersection& its, Sampler*& sampler, Color3f& _beta, bool& sampledMedium, int lod = 0) const
     {
         //If our medium is homogeneous, it's easier
         if(!m_heterogeneous)
@@ -91,15 +164,11 @@ public:
             /// We compute a t and check if it is medium interaction or surface interaction
             //Since this is a homogeneous medium the point we pass here is irrelevant
             float _mu_t = sample_mu_t(Point3f(0.f))[channel];
-            float dist = -std::log(1.f - sampler->next1D()) / _mu_t;
+            /// A medium without extinction (i.e. the default enviromental one) never collides, and -log(1) / 0 would be NaN
+            float u = sampler->next1D();
+            float dist = _mu_t > 0.f ? -std::log(1.f - u) / _mu_t : std::numeric_limits<float>::infinity();
             float t = std::min(dist * ray.d.norm(), its.t);
             sampledMedium = t < its.t;
-            nextVolume = currentVolume;
-
-            if(!sampledMedium && its.mesh->isVolume())
-            {
-                nextVolume = its.mesh->getVolume();
-            }
 
             sampled_point = ray(t);
 
@@ -117,7 +186,7 @@ public:
             /// If we sampled within the medium, use the right pdf for the weighting, otherwise, 1-cdf
             if(sampledMedium)
             {
-                _beta = Tr * currentVolume->getPhaseFunction()->get_mu_s() / pdf;
+                _beta = Tr * m_phase_function->get_mu_s() / pdf;
             }
             else
             {
@@ -127,22 +196,15 @@ public:
         }
         //else, heterogeneous volume
 
+        /// With decomposition tracking, the minimum density acts as a homogeneous control medium
         Color3f mu_s = m_phase_function->get_mu_s();
-        Point3f sampled_point = m_volumegrid_mu_t->samplePathStep(ray, its, sampler, mu_s, mu_t, _beta, sampledMedium);
-
-        if(sampledMedium)
-        {
-            nextVolume = currentVolume;
-        }
-        else if(its.mesh->isVolume())
-        {
-            nextVolume = its.mesh->getVolume();
-        }
+        /// The grid works in its own space. Ray parameters are preserved by the (affine) transform, so its.t still holds
+        Point3f sampled_point = m_trafo * m_volumegrid_mu_t->samplePathStep(m_inv_trafo * ray, its, sampler, mu_s, mu_t, controlDensity(lod), _beta, sampledMedium, lod);
 
         return sampled_point;
     }
 
-    Color3f transmittance(Sampler*& sampler, const Point3f& x0, const Point3f& xz) const
+    Color3f transmittance(Sampler*& sampler, const Point3f& x0, const Point3f& xz, int lod = 0) const
     {
         //if this is a homogeneous volume
         if(!m_heterogeneous)
@@ -155,7 +217,8 @@ public:
         /// Perform ratio tracking
 
         /// TODO: monocanal + revisar para mi queridísimo renderizador 2.0
-        return m_volumegrid_mu_t->ratioTracking(sampler, x0, xz, (mu_t.sum() / 3.f));      
+        Ray3f ray = m_inv_trafo * Ray3f(x0, (xz - x0).normalized());
+        return m_volumegrid_mu_t->ratioTracking(sampler, ray, Vector3f(xz - x0).norm(), (mu_t.sum() / 3.f), controlDensity(lod), lod);
     }
 
     Color3f sample_mu_t(const Point3f& p_world) const
@@ -168,7 +231,7 @@ public:
         }
         //else, we have an heterogeneous volume, return mu_t
         /// TODO: We have to check the grid
-        return m_volumegrid_mu_t->sample_density(p_world);
+        return m_volumegrid_mu_t->sample_density(m_inv_trafo * p_world);
 
         //float rand = (static_cast <float> (std::rand()) / static_cast <float> (RAND_MAX)) * 2.f;
         //return Color3f(rand * mu_t);
@@ -180,6 +243,56 @@ public:
         
     }
 
+    Color3f extinction(const Point3f& p_world, int lod = 0) const
+    {
+        if(!m_heterogeneous)
+            return mu_t;
+        // Tracked as a gray medium, see Volumedatabase::samplePathStep()
+        return Color3f(mu_t.sum() / 3.f * m_volumegrid_mu_t->sample_density(m_inv_trafo * p_world, lod).sum() / 3.f);
+    }
+
+    float getMajorant(int lod = 0) const
+    {
+        if(!m_heterogeneous)
+            return mu_t.maxCoeff();
+        return mu_t.sum() / 3.f * m_volumegrid_mu_t->getMaxDensity(lod);
+    }
+
+    bool isEmissive() const
+    {
+        return m_emissive;
+    }
+
+    Color3f emission(const Point3f& p_world) const
+    {
+        if(!m_emissive)
+            return Color3f(0.f);
+        return emissionLocal(m_inv_trafo * p_world);
+    }
+
+    Color3f emissionAtCollision(const Point3f& p_world) const
+    {
+        if(!m_emissive)
+            return Color3f(0.f);
+        // Tracking samples collisions with density (mu_t.sum() / 3) * density, so the density cancels out
+        return mu_a * m_emission_scale * m_volumegrid_emission->sample_density(m_inv_trafo * p_world) / (mu_t.sum() / 3.f);
+    }
+
+    Color3f sampleEmission(Sampler* sampler, Point3f& p, float& pdf) const
+    {
+        if(!m_emissive)
+        {
+            pdf = 0.f;
+            return Color3f(0.f);
+        }
+        Point3f p_local = m_volumegrid_emission->sampleVoxel(m_emission_cdf, sampler, pdf);
+        if(pdf <= 0.f)
+            return Color3f(0.f);
+        p = m_trafo * p_local;
+        pdf /= m_jacobian;
+        return emissionLocal(p_local);
+    }
+
     Color3f sample_mu_a(const Point3f& p_world) const
     {
         return mu_a * 1.f;
@@ -216,15 +329,97 @@ public:
             "  mu_t_channel = %s\n"
             "  mu_a_channel = %s\n"
             "  vdb_file = %s\n"
+            "  decomposition_tracking = %s\n"
+            "  out_of_core = %s (brick_size = %i, brick_cache_mb = %i)\n"
+            "  emission_file = %s (scale %s)\n"
             "  phase_function = {\n"
             "  %s  }\n"
-            "]", mu_t, mu_a, m_mu_t_vdb_name, mu_a, m_vdb_file_name, m_phase_function->toString());
+            "]", mu_t, mu_a, m_mu_t_vdb_name, mu_a, m_vdb_file_name, m_decomposition_tracking,
+            m_storage.out_of_core, m_storage.brick_size, (int)(m_storage.cache_bytes >> 20),
+            m_emission_file_name, m_emission_scale, m_phase_function->toString());
     }
 
 private:
+    /// Resolves a grid file against the scene directory (see getFileResolver()), as absolute path
+    static std::string resolvePath(const std::string& filename)
+    {
+        filesystem::path path = getFileResolver()->resolve(filename);
+        return path.exists() ? path.make_absolute().str() : filename;
+    }
+
+    /// Grids are shared through the AssetCache by every volume that uses the same file and storage options.
+    /// `recycle` (i.e. the grid of the previous frame) is reloaded in place if nobody else is using it
+    std::shared_ptr<Volumedatabase> acquireGrid(const std::string& filename, std::shared_ptr<Volumedatabase>& recycle) const
+    {
+        std::string path = resolvePath(filename);
+        std::string options = tfm::format("|%s|%i", m_storage.out_of_core ? "out_of_core" : "in_core", m_storage.brick_size);
+        AssetCache<Volumedatabase>& cache = AssetCache<Volumedatabase>::instance();
+        return cache.get(path + options, [&]() {
+            if(recycle && cache.detach(recycle->getFilename() + options, recycle))
+            {
+                std::shared_ptr<Volumedatabase> grid = std::move(recycle);
+                grid->reload(path);
+                return grid;
+            }
+            return std::make_shared<Volumedatabase>(path, m_storage);
+        });
+    }
+
+    /// Emission at a point in grid space
+    Color3f emissionLocal(const Point3f& p) const
+    {
+        float density = m_volumegrid_mu_t->sample_density(p).sum() / 3.f;
+        return mu_a * m_emission_scale * density * m_volumegrid_emission->sample_density(p);
+    }
+
+    /// Frame of a sequence into `grid`, swapped in from `next` if it was prefetched while the previous frame was rendering
+    void loadFrame(const std::string& pattern, int frame, std::shared_ptr<Volumedatabase>& grid, std::shared_ptr<Volumedatabase>& next) const
+    {
+        if(next && m_next_frame == frame)
+            std::swap(grid, next);
+        else
+            grid = acquireGrid(Volumedatabase::frameFilename(pattern, frame), grid);
+    }
+
+    /// Emission sampling CDF of the current frame, proportional to density * emission (see emissionLocal()).
+    /// Built before rendering (on construction or in setFrame()), render threads only read it
+    void buildEmissionCDF()
+    {
+        m_emissive = !mu_a.isZero() && m_volumegrid_emission->buildSamplingCDF(m_emission_cdf, m_volumegrid_mu_t.get());
+        if(!m_emissive)
+            std::cout << "VolumeVDB: emission grid " << m_volumegrid_emission->getFilename() << " (or mu_a) is zero, the volume will not emit" << std::endl;
+    }
+
+    /// Density of the homogeneous control medium used for decomposition tracking (0 disables it).
+    /// It is the floor of the whole grid, not one per region: grids with empty margins get 0 and fall back
+    /// to delta tracking (clipped to their bounds), while hazy grids that never go below some density
+    /// (i.e. fog) sample that part analytically, and only track the residual
+    float controlDensity(int lod) const
+    {
+        return m_decomposition_tracking ? std::max(0.f, m_volumegrid_mu_t->getMinDensity(lod)) : 0.f;
+    }
+
     std::string     m_vdb_file_name;
     std::string     m_mu_t_vdb_name;
     std::shared_ptr<Volumedatabase> m_volumegrid_mu_t;
+    bool            m_decomposition_tracking;
+    Transform       m_trafo;
+    Transform       m_inv_trafo;
+    float           m_jacobian = 1.f;                   /// |det| of the linear part of m_trafo, for pdfs in world space volume
+    VolumeStorageOptions m_storage;
+
+    std::string     m_emission_file_name;
+    Color3f         m_emission_scale;
+    std::shared_ptr<Volumedatabase> m_volumegrid_emission;
+    Volumedatabase::SamplingCDF m_emission_cdf;
+    bool            m_emissive = false;
+
+    /// Animated sequences: current frame, and the next one being loaded in the background
+    int             m_frame = -1;
+    int             m_next_frame = -1;
+    std::shared_ptr<Volumedatabase> m_volumegrid_next;
+    std::shared_ptr<Volumedatabase> m_volumegrid_emission_next;
+    std::thread     m_prefetch_thread;
 
     /// TODO: Tengo que decidir si lo controlo todo en función de albedo y mu_t o de mu_t y mu_a
     /// TODO: Mira el chat de Discord con Nestor para esto!!
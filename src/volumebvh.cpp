@@ -0,0 +1,317 @@
+/*
+    Date: 19-1-2023
+    Authors: Pedro José Pérez García
+    Comms: Part of our nori extensions for the final assignment
+            of the course "Modelling and Simullation of Appearance",
+            Master in Robotics, Graphics and Computer Vision (MRGCV),
+            Universidad de Zaragoza, course 2022-2023
+*/
+
+#include <nori/volumebvh.h>
+#include <algorithm>
+
+NORI_NAMESPACE_BEGIN
+
+void VolumeBVH::build(std::vector<Region> regions, const std::shared_ptr<Volume>& global)
+{
+    m_regions.clear();
+    m_nodes.clear();
+    for(Region& region : regions)
+        if(region.majorant > 0.f)
+            m_regions.push_back(region);
+
+    m_global = nullptr;
+    m_global_majorant = 0.f;
+    if(global && global->getMajorant() > 0.f)
+    {
+        m_global = global;
+        m_global_majorant = global->getMajorant();
+    }
+
+    if(m_regions.size() > MaxRegions)
+        throw NoriException("VolumeBVH: the scene has %i media regions, at most %i are supported!", (int)m_regions.size(), (int)MaxRegions);
+
+    if(!m_regions.empty())
+        buildRecursive(0, (uint32_t)m_regions.size());
+}
+
+uint32_t VolumeBVH::buildRecursive(uint32_t start, uint32_t end)
+{
+    uint32_t index = (uint32_t)m_nodes.size();
+    m_nodes.push_back(Node());
+
+    BoundingBox3f bbox, centroids;
+    float majorant = 0.f;
+    for(uint32_t i = start; i < end; i++)
+    {
+        bbox.expandBy(m_regions[i].bbox);
+        centroids.expandBy(m_regions[i].bbox.getCenter());
+        majorant += m_regions[i].majorant;
+    }
+
+    // A scene rarely has more than a handful of media, so leaves are tiny and the split is a plain median
+    Node node;
+    node.bbox = bbox;
+    node.majorant = majorant;
+    node.start = start;
+    node.size = 0;
+    node.right = 0;
+    if(end - start <= 2)
+    {
+        node.size = end - start;
+        m_nodes[index] = node;
+        return index;
+    }
+
+    int axis = centroids.getLargestAxis();
+    uint32_t mid = (start + end) / 2;
+    std::nth_element(m_regions.begin() + start, m_regions.begin() + mid, m_regions.begin() + end,
+        [axis](const Region& a, const Region& b) { return a.bbox.getCenter()[axis] < b.bbox.getCenter()[axis]; });
+
+    buildRecursive(start, mid);
+    node.right = buildRecursive(mid, end);
+    m_nodes[index] = node;
+    return index;
+}
+
+template <typename Callback> void VolumeBVH::forEachRegionAt(const Point3f& p, const Callback& callback) const
+{
+    if(m_nodes.empty())
+        return;
+    uint32_t stack[64];
+    int top = 0;
+    stack[top++] = 0;
+    while(top > 0)
+    {
+        const Node& node = m_nodes[stack[--top]];
+        if(!node.bbox.contains(p))
+            continue;
+        if(node.isLeaf())
+        {
+            for(uint32_t i = node.start; i < node.start + node.size; i++)
+                if(m_regions[i].bbox.contains(p))
+                    callback(m_regions[i]);
+        }
+        else
+        {
+            stack[top++] = node.right;
+            stack[top++] = (uint32_t)(&node - &m_nodes[0]) + 1;
+        }
+    }
+}
+
+uint32_t VolumeBVH::majorantSegments(const Ray3f& ray, float tMax, Segment* segments) const
+{
+    // Every pierced region adds its majorant at its entry and removes it at its exit
+    std::pair<float, float> events[2 * MaxRegions];
+    uint32_t eventCount = 0;
+    if(!m_nodes.empty())
+    {
+        uint32_t stack[64];
+        int top = 0;
+        stack[top++] = 0;
+        while(top > 0)
+        {
+            uint32_t index = stack[--top];
+            const Node& node = m_nodes[index];
+            float nearT, farT;
+            if(node.majorant <= 0.f || !node.bbox.rayIntersect(ray, nearT, farT) || farT <= 0.f || nearT >= tMax)
+                continue;
+            if(node.isLeaf())
+            {
+                for(uint32_t i = node.start; i < node.start + node.size; i++)
+                {
+                    if(!m_regions[i].bbox.rayIntersect(ray, nearT, farT))
+                        continue;
+                    nearT = std::max(nearT, 0.f);
+                    farT = std::min(farT, tMax);
+                    if(nearT >= farT)
+                        continue;
+                    events[eventCount++] = std::make_pair(nearT, m_regions[i].majorant);
+                    events[eventCount++] = std::make_pair(farT, -m_regions[i].majorant);
+                }
+            }
+            else
+            {
+                stack[top++] = node.right;
+                stack[top++] = index + 1;
+            }
+        }
+    }
+
+    uint32_t segmentCount = 0;
+    if(eventCount == 0)
+    {
+        if(m_global)
+            segments[segmentCount++] = Segment{0.f, tMax, m_global_majorant};
+        return segmentCount;
+    }
+    std::sort(events, events + eventCount, [](const std::pair<float, float>& a, const std::pair<float, float>& b) { return a.first < b.first; });
+
+    float t = 0.f;
+    float majorant = 0.f;
+    for(uint32_t i = 0; i < eventCount; i++)
+    {
+        if(events[i].first > t)
+        {
+            if(majorant > 0.f || m_global)
+                segments[segmentCount++] = Segment{t, events[i].first, majorant + m_global_majorant};
+            t = events[i].first;
+        }
+        majorant = std::max(0.f, majorant + events[i].second);
+    }
+    if(m_global && t < tMax)
+        segments[segmentCount++] = Segment{t, tMax, m_global_majorant};
+    return segmentCount;
+}
+
+Color3f VolumeBVH::extinction(const Point3f& p, int lod) const
+{
+    Color3f mu_t(0.f);
+    if(m_global)
+        mu_t += m_global->extinction(p, lod);
+    forEachRegionAt(p, [&](const Region& region) {
+        mu_t += region.volume->extinction(p, lod);
+    });
+    return mu_t;
+}
+
+Color3f VolumeBVH::emissionAtCollision(const Point3f& p, int lod) const
+{
+    Color3f Le(0.f);
+    if(m_global && m_global->isEmissive())
+        Le += m_global->emission(p);
+    forEachRegionAt(p, [&](const Region& region) {
+        if(region.volume->isEmissive())
+            Le += region.volume->emission(p);
+    });
+    if(Le.isZero())
+        return Le;
+    float mu_t = extinction(p, lod).sum() / 3.f;
+    return mu_t > 0.f ? Color3f(Le / mu_t) : Color3f(0.f);
+}
+
+Color3f VolumeBVH::inScattering(const Point3f& p, int lod, const std::function<float(const Volume&)>& phase) const
+{
+    Color3f L(0.f);
+    if(m_global)
+        L += m_global->getAlbedo() * m_global->extinction(p, lod) * phase(*m_global);
+    forEachRegionAt(p, [&](const Region& region) {
+        Color3f mu_t = region.volume->extinction(p, lod);
+        if(!mu_t.isZero())
+            L += region.volume->getAlbedo() * mu_t * phase(*region.volume);
+    });
+    return L;
+}
+
+bool VolumeBVH::clip(const Ray3f& ray, float& tMin, float& tMax) const
+{
+    if(m_global)
+        return tMin < tMax;
+    Segment segments[MaxSegments];
+    uint32_t segmentCount = majorantSegments(ray, tMax, segments);
+    if(segmentCount == 0)
+        return false;
+    tMin = std::max(tMin, segments[0].t0);
+    tMax = std::min(tMax, segments[segmentCount - 1].t1);
+    return tMin < tMax;
+}
+
+bool VolumeBVH::sampleCollision(Sampler* sampler, const Ray3f& ray, float tMax, int lod, float& t,
+    const Volume*& medium, Color3f& weight, Color3f& albedo) const
+{
+    weight = Color3f(1.f);
+    if(empty())
+        return false;
+
+    Segment segments[MaxSegments];
+    uint32_t segmentCount = majorantSegments(ray, tMax, segments);
+
+    // Extinction of every medium at the tentative collision (the global one has no region), to pick the one that scatters
+    std::pair<const Region*, Color3f> media[MaxRegions + 1];
+    for(uint32_t s = 0; s < segmentCount; s++)
+    {
+        const Segment& segment = segments[s];
+        if(segment.majorant <= 0.f)
+            continue;
+        t = segment.t0;
+        while(true)
+        {
+            t -= std::log(1.0f - sampler->next1D()) / segment.majorant;
+            if(t >= segment.t1)
+                break;
+
+            Point3f p = ray(t);
+            uint32_t mediaCount = 0;
+            Color3f mu_t(0.f);
+            if(m_global)
+            {
+                media[mediaCount++] = std::make_pair((const Region*)nullptr, m_global->extinction(p, lod));
+                mu_t += media[mediaCount - 1].second;
+            }
+            forEachRegionAt(p, [&](const Region& region) {
+                media[mediaCount++] = std::make_pair(&region, region.volume->extinction(p, lod));
+                mu_t += media[mediaCount - 1].second;
+            });
+
+            // Spectral tracking: real collisions with probability avg(mu_t) / majorant, chromatic null collisions
+            float mu_avg = mu_t.sum() / 3.f;
+            float pReal = std::min(1.f, mu_avg / segment.majorant);
+            if(sampler->next1D() < pReal)
+            {
+                float u = sampler->next1D() * mu_avg;
+                for(uint32_t i = 0; i < mediaCount; i++)
+                {
+                    float mu_i = media[i].second.sum() / 3.f;
+                    if(mu_i <= 0.f)
+                        continue;
+                    medium = media[i].first ? media[i].first->volume.get() : m_global.get();
+                    albedo = medium->getAlbedo() * media[i].second / mu_i;
+                    if(u < mu_i)
+                        break;
+                    u -= mu_i;
+                }
+                return true;
+            }
+            weight *= (Color3f(segment.majorant) - mu_t) / (segment.majorant - mu_avg);
+        }
+    }
+    return false;
+}
+
+Color3f VolumeBVH::transmittance(Sampler* sampler, const Ray3f& ray, float tMax, int lod) const
+{
+    Color3f tr(1.f);
+    if(empty())
+        return tr;
+
+    Segment segments[MaxSegments];
+    uint32_t segmentCount = majorantSegments(ray, tMax, segments);
+    for(uint32_t s = 0; s < segmentCount; s++)
+    {
+        const Segment& segment = segments[s];
+        if(segment.majorant <= 0.f)
+            continue;
+        float t = segment.t0;
+        while(true)
+        {
+            t -= std::log(1.0f - sampler->next1D()) / segment.majorant;
+            if(t >= segment.t1)
+                break;
+            tr *= (Color3f(segment.majorant) - extinction(ray(t), lod)).cwiseMax(0.f) / segment.majorant;
+            // Russian roulette once the transmittance is negligible, so dense media do not get tracked to the end
+            float maxTr = tr.maxCoeff();
+            if(maxTr <= 0.f)
+                return Color3f(0.f);
+            if(maxTr < 0.01f)
+            {
+                if(sampler->next1D() >= maxTr / 0.01f)
+                    return Color3f(0.f);
+                tr /= maxTr / 0.01f;
+            }
+        }
+    }
+    return tr;
+}
+
+NORI_NAMESPACE_END
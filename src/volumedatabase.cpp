@@ -18,6 +18,8 @@
 #include <nori/transform.h>
 #include <nori/volumedatabase.h>
 
+#include <zlib.h>
+
 #include <fstream>
 #include <iostream>
 #include <exception>
@@ -25,11 +27,18 @@
 
 NORI_NAMESPACE_BEGIN
 
-Volumedatabase::Volumedatabase(const std::string& filename, const Transform& trafo)
+Volumedatabase::Volumedatabase(const std::string& filename, const VolumeStorageOptions& storage)
 {
     m_volfilename = filename;
     // m_volgridname = gridname;
-    m_transform = trafo;
+    m_storage = storage;
+    m_storage.brick_size = std::max(2, storage.brick_size + storage.brick_size % 2);
+    m_brick_source = UINT32_MAX;
+    loadFile(m_volfilename);
+}
+
+void Volumedatabase::loadFile(const std::string& filename)
+{
     std::string extension = filename.substr(filename.find_last_of(".") + 1);
     if(extension == "vdb" || extension == "VDB")
     {
@@ -40,7 +49,11 @@ Volumedatabase::Volumedatabase(const std::string& filename, const Transform& tra
     }
     else if(extension == "vol" || extension == "VOL")
     {
-        loadVOLfile(m_volfilename);          //Initializes data according to the file's content
+        loadVOLfile(filename);          //Initializes data according to the file's content
+    }
+    else if(extension == "zvol" || extension == "ZVOL")
+    {
+        loadZVOLfile(filename);         //Compressed bricks, always out of core
     }
     else    //Unknown file type, throw a NoriException
     {
@@ -49,6 +62,454 @@ Volumedatabase::Volumedatabase(const std::string& filename, const Transform& tra
     }
 }
 
+Volumedatabase::Volumedatabase(std::vector<float>&& data, int cellsX, int cellsY, int cellsZ, int channels, const BoundingBox3f& bbox)
+{
+    m_volfilename = "<memory>";
+    m_brick_source = UINT32_MAX;
+    m_cellsX = cellsX;
+    m_cellsY = cellsY;
+    m_cellsZ = cellsZ;
+    m_numChannels = channels;
+    m_dataCount = (uint64_t)cellsX * cellsY * cellsZ * channels;
+    if(data.size() != m_dataCount)
+    {
+        std::cout << "In-memory volume data does not match its dimensions! Aborting..." << std::endl;
+        exit(1);
+    }
+    VOL_data = std::move(data);
+
+    m_bbox = bbox;
+    m_bb_xmin = m_bbox.min.x();
+    m_bb_ymin = m_bbox.min.y();
+    m_bb_zmin = m_bbox.min.z();
+    m_bb_xmax = m_bbox.max.x();
+    m_bb_ymax = m_bbox.max.y();
+    m_bb_zmax = m_bbox.max.z();
+
+    computeStatistics();
+}
+
+Volumedatabase::~Volumedatabase()
+{
+    if(m_brick_source != UINT32_MAX)
+        BrickCache::instance().evict(m_brick_source);
+}
+
+void Volumedatabase::reload(const std::string& filename)
+{
+    m_volfilename = filename;
+    loadFile(m_volfilename);
+}
+
+bool Volumedatabase::isSequencePattern(const std::string& filename)
+{
+    return filename.find('#') != std::string::npos;
+}
+
+std::string Volumedatabase::frameFilename(const std::string& pattern, int frame)
+{
+    // Replace the last run of '#' with the frame number, padded to the length of the run
+    size_t last = pattern.find_last_of('#');
+    if(last == std::string::npos)
+        return pattern;
+    size_t first = last;
+    while(first > 0 && pattern[first - 1] == '#')
+        first--;
+    std::string number = std::to_string(frame);
+    if(number.size() < last - first + 1)
+        number.insert(0, last - first + 1 - number.size(), '0');
+    return pattern.substr(0, first) + number + pattern.substr(last + 1);
+}
+
+template <typename F> void Volumedatabase::forEachBlock(const F& f) const
+{
+    if(!m_storage.out_of_core)
+    {
+        f(0, 0, 0, m_cellsX, m_cellsY, m_cellsZ, m_cellsX, m_cellsY, VOL_data.data());
+        return;
+    }
+    // Bricks are streamed straight from disk, so that the whole grid is never in memory
+    int bs = m_storage.brick_size;
+    BrickCache::Brick brick;
+    for(int bz = 0; bz < m_bricksZ; bz++)
+    for(int by = 0; by < m_bricksY; by++)
+    for(int bx = 0; bx < m_bricksX; bx++)
+    {
+        readBrick(((uint64_t)bz*m_bricksY + by)*m_bricksX + bx, brick);
+        f(bx*bs, by*bs, bz*bs, std::min(bs, m_cellsX - bx*bs), std::min(bs, m_cellsY - by*bs), std::min(bs, m_cellsZ - bz*bs), bs, bs, brick.data());
+    }
+}
+
+// .zvol layout (little endian, like .vol):
+//   "ZVL", uint8 version (1), int32 brick size, int32 cells X/Y/Z, int32 channels,
+//   6 floats with the (local) bounding box, uint64 offset of the mip pyramid,
+//   brick index: per brick (x fastest, then y, then z) uint64 offset, uint32 compressed size, float min and max,
+//   brick payloads: every brick padded to brick_size^3 voxels, laid out like a .vol grid of that size
+//                   and zlib compressed on its own. Uniform bricks (min == max) have no payload,
+//   mip pyramid: double mean, float min and max, int32 levels and, for every level but 0, int32 cells X/Y/Z,
+//                float min and max_avg, and its avg and max arrays, each one as uint64 compressed size + zlib data
+//
+// Storing the pyramid keeps loading lazy: only the header, the index and the pyramid are read
+// up front, and level 0 bricks are decompressed on first touch (see level0Voxel())
+static const uint64_t ZVOL_MIPS_OFFSET_POSITION = 3 + 1 + 5 * sizeof(int32_t) + 6 * sizeof(float);
+static const uint64_t ZVOL_INDEX_ENTRY_BYTES = sizeof(uint64_t) + sizeof(uint32_t) + 2 * sizeof(float);
+
+static void compressFloats(const float* data, size_t count, std::vector<unsigned char>& out)
+{
+    uLongf size = compressBound((uLong)(count * sizeof(float)));
+    out.resize(size);
+    if(compress2(out.data(), &size, reinterpret_cast<const Bytef*>(data), (uLong)(count * sizeof(float)), Z_DEFAULT_COMPRESSION) != Z_OK)
+    {
+        std::cout << "zlib compression failed! Aborting..." << std::endl;
+        exit(1);
+    }
+    out.resize(size);
+}
+
+static void decompressFloats(const unsigned char* data, size_t size, float* out, size_t count)
+{
+    uLongf outSize = (uLongf)(count * sizeof(float));
+    if(uncompress(reinterpret_cast<Bytef*>(out), &outSize, data, (uLong)size) != Z_OK || outSize != count * sizeof(float))
+    {
+        std::cout << "Corrupted .zvol data! Aborting..." << std::endl;
+        exit(1);
+    }
+}
+
+// Out-of-core .vol files are converted once into a .zvol next to them. The .zvol is only
+// rebuilt when its header does not match the .vol, so remember to delete it if the .vol
+// is overwritten with a grid of the same size
+void Volumedatabase::openBricks(const std::string& filename, uint64_t dataOffset)
+{
+    std::string zvolFilename = filename.substr(0, filename.find_last_of(".")) + ".zvol";
+
+    bool valid = false;
+    {
+        std::ifstream f(zvolFilename, std::ifstream::binary);
+        if(f.is_open())
+        {
+            char header[3];
+            f.read(header, 3);
+            uint8_t version = read<uint8_t>(f);
+            int32_t size = read<int32_t>(f), x = read<int32_t>(f), y = read<int32_t>(f), z = read<int32_t>(f), c = read<int32_t>(f);
+            f.seekg(ZVOL_MIPS_OFFSET_POSITION);
+            uint64_t mipsOffset = read<uint64_t>(f);
+            valid = f && header[0] == 'Z' && header[1] == 'V' && header[2] == 'L' && version == 1 && mipsOffset != 0
+                && size == m_storage.brick_size && x == m_cellsX && y == m_cellsY && z == m_cellsZ && c == m_numChannels;
+        }
+    }
+    if(!valid)
+        writeZVOL(filename, dataOffset, zvolFilename);
+
+    loadZVOLfile(zvolFilename);
+}
+
+void Volumedatabase::loadZVOLfile(const std::string& filename)
+{
+    if(m_brick_stream.is_open())
+        m_brick_stream.close();
+    m_brick_stream.clear();
+    m_brick_stream.open(filename, std::ifstream::binary);
+    if(!m_brick_stream.is_open())
+    {
+        std::cout << "Error trying to read .zvol file! Aborting... " << filename << std::endl;
+        exit(1);
+    }
+    m_brickfilename = filename;
+
+    char header[3];
+    m_brick_stream.read(header, 3);
+    if(header[0] != 'Z' || header[1] != 'V' || header[2] != 'L' || read<uint8_t>(m_brick_stream) != 1)
+    {
+        std::cout << "Wrong .zvol format or version! Aborting..." << std::endl;
+        exit(1);
+    }
+    m_storage.out_of_core = true;
+    m_storage.brick_size = read<int32_t>(m_brick_stream);
+    m_cellsX = read<int32_t>(m_brick_stream);
+    m_cellsY = read<int32_t>(m_brick_stream);
+    m_cellsZ = read<int32_t>(m_brick_stream);
+    m_numChannels = read<int32_t>(m_brick_stream);
+    m_dataCount = (uint64_t)m_cellsX * m_cellsY * m_cellsZ * m_numChannels;
+    m_bb_xmin = read<float>(m_brick_stream);
+    m_bb_ymin = read<float>(m_brick_stream);
+    m_bb_zmin = read<float>(m_brick_stream);
+    m_bb_xmax = read<float>(m_brick_stream);
+    m_bb_ymax = read<float>(m_brick_stream);
+    m_bb_zmax = read<float>(m_brick_stream);
+    updateBoundingBox();
+    uint64_t mipsOffset = read<uint64_t>(m_brick_stream);
+    if(mipsOffset == 0)
+    {
+        std::cout << "Incomplete .zvol file! Aborting... " << filename << std::endl;
+        exit(1);
+    }
+
+    int bs = m_storage.brick_size;
+    m_bricksX = (m_cellsX + bs - 1) / bs;
+    m_bricksY = (m_cellsY + bs - 1) / bs;
+    m_bricksZ = (m_cellsZ + bs - 1) / bs;
+    m_brick_index.resize((size_t)m_bricksX * m_bricksY * m_bricksZ);
+    for(BrickInfo& info : m_brick_index)
+    {
+        info.offset = read<uint64_t>(m_brick_stream);
+        info.size = read<uint32_t>(m_brick_stream);
+        info.min = read<float>(m_brick_stream);
+        info.max = read<float>(m_brick_stream);
+    }
+
+    // Conservative: the border is only known to be empty when the bricks on it are all zero
+    m_empty_border = true;
+    for(int bz = 0; bz < m_bricksZ; bz++)
+    for(int by = 0; by < m_bricksY; by++)
+    for(int bx = 0; bx < m_bricksX; bx++)
+    {
+        const BrickInfo& info = m_brick_index[((size_t)bz*m_bricksY + by)*m_bricksX + bx];
+        bool onFace = bx == 0 || by == 0 || bz == 0 || bx == m_bricksX - 1 || by == m_bricksY - 1 || bz == m_bricksZ - 1;
+        if(onFace && (info.min != 0.f || info.max != 0.f))
+            m_empty_border = false;
+    }
+
+    // Statistics and the coarse levels of the pyramid
+    m_brick_stream.seekg(mipsOffset);
+    m_mean = read<double>(m_brick_stream);
+    m_min = read<float>(m_brick_stream);
+    m_max = read<float>(m_brick_stream);
+    int levels = read<int32_t>(m_brick_stream);
+    m_mips.resize(std::max(1, levels));
+    m_mips[0].cellsX = m_cellsX;
+    m_mips[0].cellsY = m_cellsY;
+    m_mips[0].cellsZ = m_cellsZ;
+    m_mips[0].min = m_min;
+    m_mips[0].max_avg = m_max;
+    std::vector<unsigned char> compressed;
+    for(int lod = 1; lod < levels; lod++)
+    {
+        MipLevel& level = m_mips[lod];
+        level.cellsX = read<int32_t>(m_brick_stream);
+        level.cellsY = read<int32_t>(m_brick_stream);
+        level.cellsZ = read<int32_t>(m_brick_stream);
+        level.min = read<float>(m_brick_stream);
+        level.max_avg = read<float>(m_brick_stream);
+        size_t count = (size_t)level.cellsX * level.cellsY * level.cellsZ * m_numChannels;
+        for(std::vector<float>* values : {&level.avg, &level.max})
+        {
+            compressed.resize(read<uint64_t>(m_brick_stream));
+            m_brick_stream.read(reinterpret_cast<char *>(compressed.data()), compressed.size());
+            values->resize(count);
+            decompressFloats(compressed.data(), compressed.size(), values->data(), count);
+        }
+    }
+    if(!m_brick_stream)
+    {
+        std::cout << "Truncated .zvol file! Aborting... " << filename << std::endl;
+        exit(1);
+    }
+    std::vector<float>().swap(VOL_data);
+
+    // Every (re)load gets its own key, so bricks of the previous frame are never returned
+    BrickCache& cache = BrickCache::instance();
+    if(m_brick_source != UINT32_MAX)
+        cache.evict(m_brick_source);
+    m_brick_source = cache.registerSource();
+    cache.reserve(m_storage.cache_bytes);
+
+    std::cout << "Loaded grid volume data with dimensions: (" << m_cellsX << ", "
+    << m_cellsY << ", " << m_cellsZ << ") , mean " << m_mean << ", min " << m_min << " and max " << m_max << std::endl;
+    std::cout << "Out-of-core volume: (" << m_bricksX << ", " << m_bricksY << ", " << m_bricksZ << ") bricks of "
+        << bs << "^3 voxels, cache budget " << (cache.getCapacity() >> 20) << " MiB" << std::endl;
+}
+
+void Volumedatabase::writeZVOL(const std::string& volFilename, uint64_t dataOffset, const std::string& zvolFilename)
+{
+    std::ifstream in(volFilename, std::ifstream::binary);
+    std::ofstream out(zvolFilename, std::ofstream::binary);
+    if(!in.is_open() || !out.is_open())
+    {
+        std::cout << "Error trying to write .zvol file! Aborting... " << zvolFilename << std::endl;
+        exit(1);
+    }
+    std::cout << "Writing compressed bricks to " << zvolFilename << " .. " << std::flush;
+
+    int bs = m_storage.brick_size;
+    m_bricksX = (m_cellsX + bs - 1) / bs;
+    m_bricksY = (m_cellsY + bs - 1) / bs;
+    m_bricksZ = (m_cellsZ + bs - 1) / bs;
+    out.write("ZVL", 3);
+    writeGeneric<uint8_t>(out, 1);
+    writeGeneric<int32_t>(out, bs);
+    writeGeneric<int32_t>(out, m_cellsX);
+    writeGeneric<int32_t>(out, m_cellsY);
+    writeGeneric<int32_t>(out, m_cellsZ);
+    writeGeneric<int32_t>(out, m_numChannels);
+    for(int i = 0; i < 3; i++)
+        writeGeneric<float>(out, m_bbox.min[i]);
+    for(int i = 0; i < 3; i++)
+        writeGeneric<float>(out, m_bbox.max[i]);
+    writeGeneric<uint64_t>(out, 0);         // The pyramid is appended at the end
+
+    // The index is written once all the bricks are
+    m_brick_index.assign((size_t)m_bricksX * m_bricksY * m_bricksZ, BrickInfo());
+    uint64_t offset = ZVOL_MIPS_OFFSET_POSITION + sizeof(uint64_t) + m_brick_index.size() * ZVOL_INDEX_ENTRY_BYTES;
+    out.seekp(offset);
+
+    // A slab holds every row of one row of bricks: cellsX * bs * bs voxels
+    size_t rowCount = (size_t)m_cellsX * m_numChannels;
+    std::vector<float> slab(rowCount * bs * bs);
+    std::vector<float> brick((size_t)bs * bs * bs * m_numChannels);
+    std::vector<unsigned char> compressed;
+    uint64_t rawBytes = 0;
+    for(int bz = 0; bz < m_bricksZ; bz++)
+    for(int by = 0; by < m_bricksY; by++)
+    {
+        int nz = std::min(bs, m_cellsZ - bz*bs), ny = std::min(bs, m_cellsY - by*bs);
+        for(int z = 0; z < nz; z++)
+        for(int y = 0; y < ny; y++)
+        {
+            uint64_t row = ((uint64_t)(bz*bs + z)*m_cellsY + (by*bs + y)) * rowCount;
+            in.seekg(dataOffset + row * sizeof(float));
+            in.read(reinterpret_cast<char *>(&slab[((size_t)z*bs + y)*rowCount]), sizeof(float) * rowCount);
+        }
+        if(!in)
+        {
+            std::cout << "Truncated .VOL file! Aborting... " << volFilename << std::endl;
+            exit(1);
+        }
+        for(int bx = 0; bx < m_bricksX; bx++)
+        {
+            int nx = std::min(bs, m_cellsX - bx*bs);
+            BrickInfo& info = m_brick_index[((size_t)bz*m_bricksY + by)*m_bricksX + bx];
+            info.min = std::numeric_limits<float>::infinity();
+            info.max = -std::numeric_limits<float>::infinity();
+            std::fill(brick.begin(), brick.end(), 0.f);
+            for(int z = 0; z < nz; z++)
+            for(int y = 0; y < ny; y++)
+            {
+                const float* src = &slab[((size_t)z*bs + y)*rowCount + (size_t)bx*bs*m_numChannels];
+                std::copy_n(src, (size_t)nx*m_numChannels, &brick[(((size_t)z*bs + y)*bs)*m_numChannels]);
+                for(int i = 0; i < nx*m_numChannels; i++)
+                {
+                    info.min = std::min(info.min, src[i]);
+                    info.max = std::max(info.max, src[i]);
+                }
+            }
+            info.offset = offset;
+            info.size = 0;
+            if(info.min != info.max)
+            {
+                compressFloats(brick.data(), brick.size(), compressed);
+                out.write(reinterpret_cast<const char *>(compressed.data()), compressed.size());
+                info.size = (uint32_t)compressed.size();
+            }
+            offset += info.size;
+            rawBytes += brick.size() * sizeof(float);
+        }
+    }
+
+    out.seekp(ZVOL_MIPS_OFFSET_POSITION + sizeof(uint64_t));
+    for(const BrickInfo& info : m_brick_index)
+    {
+        writeGeneric<uint64_t>(out, info.offset);
+        writeGeneric<uint32_t>(out, info.size);
+        writeGeneric<float>(out, info.min);
+        writeGeneric<float>(out, info.max);
+    }
+    out.close();
+    if(!out)
+    {
+        std::cout << "Error trying to write .zvol file! Aborting... " << zvolFilename << std::endl;
+        exit(1);
+    }
+    std::cout << "done (" << (offset >> 20) << " MiB, " << (rawBytes >> 20) << " MiB uncompressed)." << std::endl;
+
+    // Statistics and pyramid, streaming the bricks we just wrote
+    if(m_brick_stream.is_open())
+        m_brick_stream.close();
+    m_brick_stream.clear();
+    m_brick_stream.open(zvolFilename, std::ifstream::binary);
+    computeStatistics();
+    m_brick_stream.close();
+
+    std::fstream f(zvolFilename, std::fstream::in | std::fstream::out | std::fstream::binary);
+    f.seekp(0, f.end);
+    uint64_t mipsOffset = (uint64_t)f.tellp();
+    writeGeneric<double>(f, m_mean);
+    writeGeneric<float>(f, m_min);
+    writeGeneric<float>(f, m_max);
+    writeGeneric<int32_t>(f, (int32_t)m_mips.size());
+    for(size_t lod = 1; lod < m_mips.size(); lod++)
+    {
+        const MipLevel& level = m_mips[lod];
+        writeGeneric<int32_t>(f, level.cellsX);
+        writeGeneric<int32_t>(f, level.cellsY);
+        writeGeneric<int32_t>(f, level.cellsZ);
+        writeGeneric<float>(f, level.min);
+        writeGeneric<float>(f, level.max_avg);
+        for(const std::vector<float>* values : {&level.avg, &level.max})
+        {
+            compressFloats(values->data(), values->size(), compressed);
+            writeGeneric<uint64_t>(f, (uint64_t)compressed.size());
+            f.write(reinterpret_cast<const char *>(compressed.data()), compressed.size());
+        }
+    }
+    // Only now the file is complete
+    f.seekp(ZVOL_MIPS_OFFSET_POSITION);
+    writeGeneric<uint64_t>(f, mipsOffset);
+    if(!f)
+    {
+        std::cout << "Error trying to write .zvol file! Aborting... " << zvolFilename << std::endl;
+        exit(1);
+    }
+}
+
+void Volumedatabase::readBrick(uint64_t brick, BrickCache::Brick& data) const
+{
+    const BrickInfo& info = m_brick_index[brick];
+    size_t count = (size_t)m_storage.brick_size * m_storage.brick_size * m_storage.brick_size * m_numChannels;
+    data.resize(count);
+    if(info.size == 0)
+    {
+        std::fill(data.begin(), data.end(), info.min);
+        return;
+    }
+
+    // Only the read is serialized, bricks are decompressed in parallel
+    static thread_local std::vector<unsigned char> compressed;
+    compressed.resize(info.size);
+    {
+        tbb::mutex::scoped_lock lock(m_brick_mutex);
+        m_brick_stream.seekg(info.offset);
+        m_brick_stream.read(reinterpret_cast<char *>(compressed.data()), info.size);
+        if(!m_brick_stream)
+        {
+            std::cout << "Truncated .zvol file! Aborting... " << m_brickfilename << std::endl;
+            exit(1);
+        }
+    }
+    decompressFloats(compressed.data(), compressed.size(), data.data(), count);
+}
+
+const float* Volumedatabase::level0Voxel(int x, int y, int z) const
+{
+    if(!m_storage.out_of_core)
+        return &VOL_data[(((size_t)z*m_cellsY + y)*m_cellsX + x)*m_numChannels];
+
+    int bs = m_storage.brick_size;
+    uint64_t brick = ((uint64_t)(z / bs)*m_bricksY + y / bs)*m_bricksX + x / bs;
+
+    // Consecutive lookups of a thread usually fall in the same brick, which skips the cache lock
+    static thread_local uint32_t lastSource = UINT32_MAX;
+    static thread_local uint64_t lastBrick = 0;
+    static thread_local BrickCache::BrickRef lastData;
+    if(lastSource != m_brick_source || lastBrick != brick)
+    {
+        lastData = BrickCache::instance().get(m_brick_source, brick, [&](BrickCache::Brick& data) { readBrick(brick, data); });
+        lastSource = m_brick_source;
+        lastBrick = brick;
+    }
+    return &(*lastData)[(((size_t)(z % bs)*bs + y % bs)*bs + x % bs)*m_numChannels];
+}
+
 void Volumedatabase::loadVOLfile(const std::string& filename)
 {
     VOL_stream.open(filename, std::ifstream::binary);
@@ -75,7 +536,7 @@ void Volumedatabase::loadVOLfile(const std::string& filename)
         exit(1);
     }
     version = read<uint8_t>(VOL_stream);
-    if((int)version != 3)
+    if((int)version != 3 && (int)version != 4)
     {
         std::cout << "Wrong .VOL version! Aborting..." << std::endl;
         exit(1);
@@ -91,7 +552,8 @@ void Volumedatabase::loadVOLfile(const std::string& filename)
     m_cellsZ = read<int32_t>(VOL_stream);
     m_numChannels = read<int32_t>(VOL_stream);
 
-    m_dataCount = m_cellsX * m_cellsY * m_cellsZ * m_numChannels;
+    // 64 bits, grids past 2^31 voxels are not that rare
+    m_dataCount = (uint64_t)m_cellsX * m_cellsY * m_cellsZ * m_numChannels;
 
     // This worked properly last time I checked 
     // (it would be so fun to read this in a week after completely breaking the code)
@@ -110,134 +572,590 @@ void Volumedatabase::loadVOLfile(const std::string& filename)
     m_bb_xmax = read<float>(VOL_stream);
     m_bb_ymax = read<float>(VOL_stream);
     m_bb_zmax = read<float>(VOL_stream);
-    std:: cout << "BOUNDING BOX: " << m_bb_xmin << " " << m_bb_ymin << " " << m_bb_zmin << " " << m_bb_xmax << " " << m_bb_ymax<< " " << m_bb_zmax << std::endl;
+    updateBoundingBox();
 
-    m_bbox = BoundingBox3f(
-            m_transform * Point3f(m_bb_xmin, m_bb_ymin, m_bb_zmin)
-        ,   m_transform * Point3f(m_bb_xmax, m_bb_ymax, m_bb_zmax
-        ));
+    uint64_t dataOffset = (uint64_t)VOL_stream.tellg();
+    bool precomputed = (int)version == 4;
+    if(precomputed)
+        dataOffset = readOptimizedHeader(filename);
+    if(m_storage.out_of_core)
+    {
+        VOL_stream.close();
+        openBricks(filename, dataOffset);
+        return;
+    }
 
-    m_bb_xmin = m_bbox.min.x();
-    m_bb_ymin = m_bbox.min.y();
-    m_bb_zmin = m_bbox.min.z();
-    m_bb_xmax = m_bbox.max.x();
-    m_bb_ymax = m_bbox.max.y();
-    m_bb_zmax = m_bbox.max.z();
+    // Assign size for the data buffer (reloads of the same resolution keep the old allocation)
+    VOL_data.resize(m_dataCount);
 
+    // Read the whole payload at once, and then compute the statistics over it (unless the header has them)
+    VOL_stream.seekg(dataOffset);
+    VOL_stream.read(reinterpret_cast<char *>(VOL_data.data()), sizeof(float) * (size_t)m_dataCount);
+    if(!VOL_stream)
+    {
+        std::cout << "Truncated .VOL file! Aborting... " << filename << std::endl;
+        exit(1);
+    }
+    VOL_stream.close();
 
-    std:: cout << "BOUNDING BOX TRAFO: " << m_bbox.min.x() << " " << m_bbox.min.y() << " " << m_bbox.min.z() << " " << m_bbox.max.x() << " " << m_bbox.max.y() << " " << m_bbox.max.z() << std::endl;
+    if(precomputed)
+        std::cout << "Loaded grid volume data with dimensions: (" << m_cellsX << ", "
+            << m_cellsY << ", " << m_cellsZ << ") , mean " << m_mean << ", min " << m_min << " and max " << m_max
+            << " (precomputed, " << m_mips.size() << " mip levels)" << std::endl;
+    else
+        computeStatistics();
+}
 
-    m_mean = 0.f;
-    m_max = -std::numeric_limits<float>::infinity();
+// Optimized .vol files (version 4, written by voloptimize) extend the header of version 3 with:
+//   uint64 offset of the voxel data, uint8 whether the border of the grid is empty, double mean, float min and max,
+//   int32 levels and, for every level but 0, int32 cells X/Y/Z, float min and max_avg and its avg and max arrays.
+// The voxel data is the same as in version 3. The max arrays of the pyramid are the majorant grids
+uint64_t Volumedatabase::readOptimizedHeader(const std::string& filename)
+{
+    uint64_t dataOffset = read<uint64_t>(VOL_stream);
+    m_empty_border = read<uint8_t>(VOL_stream) != 0;
+    m_mean = read<double>(VOL_stream);
+    m_min = read<float>(VOL_stream);
+    m_max = read<float>(VOL_stream);
+    int levels = read<int32_t>(VOL_stream);
+    m_mips.resize(std::max(1, levels));
+    m_mips[0].cellsX = m_cellsX;
+    m_mips[0].cellsY = m_cellsY;
+    m_mips[0].cellsZ = m_cellsZ;
+    m_mips[0].min = m_min;
+    m_mips[0].max_avg = m_max;
+    for(int lod = 1; lod < levels; lod++)
+    {
+        MipLevel& level = m_mips[lod];
+        level.cellsX = read<int32_t>(VOL_stream);
+        level.cellsY = read<int32_t>(VOL_stream);
+        level.cellsZ = read<int32_t>(VOL_stream);
+        level.min = read<float>(VOL_stream);
+        level.max_avg = read<float>(VOL_stream);
+        size_t count = (size_t)level.cellsX * level.cellsY * level.cellsZ * m_numChannels;
+        for(std::vector<float>* values : {&level.avg, &level.max})
+        {
+            values->resize(count);
+            VOL_stream.read(reinterpret_cast<char *>(values->data()), sizeof(float) * count);
+        }
+    }
+    if(!VOL_stream)
+    {
+        std::cout << "Truncated .VOL file! Aborting... " << filename << std::endl;
+        exit(1);
+    }
+    return dataOffset;
+}
 
-    VOL_data = new float[m_dataCount];    //Assign size for the data buffer 
+void Volumedatabase::writeOptimizedVOL(const std::string& filename)
+{
+    if(m_storage.out_of_core)
+    {
+        std::cout << "Only in core grids can be written to .VOL files! Aborting..." << std::endl;
+        exit(1);
+    }
+    std::ofstream out(filename, std::ofstream::binary);
+    if(!out.is_open())
+    {
+        std::cout << "Error trying to write .VOL file! Aborting... " << filename << std::endl;
+        exit(1);
+    }
+    out.write("VOL", 3);
+    writeGeneric<uint8_t>(out, 4);
+    writeGeneric<int32_t>(out, 1);
+    writeGeneric<int32_t>(out, m_cellsX);
+    writeGeneric<int32_t>(out, m_cellsY);
+    writeGeneric<int32_t>(out, m_cellsZ);
+    writeGeneric<int32_t>(out, m_numChannels);
+    for(int i = 0; i < 3; i++)
+        writeGeneric<float>(out, m_bbox.min[i]);
+    for(int i = 0; i < 3; i++)
+        writeGeneric<float>(out, m_bbox.max[i]);
 
-    // Read the float values one by one, for every grid in the volume
-    for(int i = 0; i < m_dataCount; i++)
+    uint64_t offsetPosition = (uint64_t)out.tellp();
+    writeGeneric<uint64_t>(out, 0);         // Offset of the voxel data, known once the pyramid is written
+    writeGeneric<uint8_t>(out, m_empty_border ? 1 : 0);
+    writeGeneric<double>(out, m_mean);
+    writeGeneric<float>(out, m_min);
+    writeGeneric<float>(out, m_max);
+    writeGeneric<int32_t>(out, (int32_t)m_mips.size());
+    for(size_t lod = 1; lod < m_mips.size(); lod++)
+    {
+        const MipLevel& level = m_mips[lod];
+        writeGeneric<int32_t>(out, level.cellsX);
+        writeGeneric<int32_t>(out, level.cellsY);
+        writeGeneric<int32_t>(out, level.cellsZ);
+        writeGeneric<float>(out, level.min);
+        writeGeneric<float>(out, level.max_avg);
+        for(const std::vector<float>* values : {&level.avg, &level.max})
+            out.write(reinterpret_cast<const char *>(values->data()), sizeof(float) * values->size());
+    }
+    uint64_t dataOffset = (uint64_t)out.tellp();
+    out.write(reinterpret_cast<const char *>(VOL_data.data()), sizeof(float) * VOL_data.size());
+    out.seekp(offsetPosition);
+    writeGeneric<uint64_t>(out, dataOffset);
+    out.close();
+    if(!out)
     {
-        float val = read<float>(VOL_stream);
-        m_mean += (double)val;
-        m_max = std::max(m_max, val);
-        VOL_data[i] = val;
+        std::cout << "Error trying to write .VOL file! Aborting... " << filename << std::endl;
+        exit(1);
+    }
+}
+
+bool Volumedatabase::cropToActive()
+{
+    if(m_storage.out_of_core)
+    {
+        std::cout << "Only in core grids can be cropped! Aborting..." << std::endl;
+        exit(1);
+    }
+    int cells[3] = {m_cellsX, m_cellsY, m_cellsZ};
+    int lo[3] = {m_cellsX, m_cellsY, m_cellsZ};
+    int hi[3] = {-1, -1, -1};
+    for(int z = 0; z < m_cellsZ; z++)
+    for(int y = 0; y < m_cellsY; y++)
+    for(int x = 0; x < m_cellsX; x++)
+    {
+        const float* voxel = &VOL_data[(((size_t)z*m_cellsY + y)*m_cellsX + x)*m_numChannels];
+        if(std::any_of(voxel, voxel + m_numChannels, [](float v) { return v != 0.f; }))
+        {
+            int p[3] = {x, y, z};
+            for(int i = 0; i < 3; i++)
+            {
+                lo[i] = std::min(lo[i], p[i]);
+                hi[i] = std::max(hi[i], p[i]);
+            }
+        }
+    }
+    if(hi[0] < 0)
+    {
+        std::cout << "The grid is empty, there is nothing to crop" << std::endl;
+        return false;
     }
 
+    // One voxel of margin, so that clamped lookups outside the new bounds still read zero
+    int n[3];
+    for(int i = 0; i < 3; i++)
+    {
+        lo[i] = std::max(0, lo[i] - 1);
+        hi[i] = std::min(cells[i] - 1, hi[i] + 1);
+        n[i] = hi[i] - lo[i] + 1;
+    }
+    std::vector<float> cropped((size_t)n[0] * n[1] * n[2] * m_numChannels);
+    for(int z = 0; z < n[2]; z++)
+    for(int y = 0; y < n[1]; y++)
+        std::copy_n(&VOL_data[((((size_t)z + lo[2])*m_cellsY + y + lo[1])*m_cellsX + lo[0])*m_numChannels], (size_t)n[0]*m_numChannels,
+            &cropped[(((size_t)z*n[1] + y)*n[0])*m_numChannels]);
+
+    std::cout << "Cropped grid from (" << m_cellsX << ", " << m_cellsY << ", " << m_cellsZ << ") to ("
+        << n[0] << ", " << n[1] << ", " << n[2] << ") voxels" << std::endl;
+
+    Point3f bbMin = m_bbox.min, bbMax = m_bbox.max;
+    for(int i = 0; i < 3; i++)
+    {
+        float voxelSize = (m_bbox.max[i] - m_bbox.min[i]) / cells[i];
+        bbMin[i] = m_bbox.min[i] + lo[i] * voxelSize;
+        bbMax[i] = m_bbox.min[i] + (hi[i] + 1) * voxelSize;
+    }
+    m_bb_xmin = bbMin.x();
+    m_bb_ymin = bbMin.y();
+    m_bb_zmin = bbMin.z();
+    m_bb_xmax = bbMax.x();
+    m_bb_ymax = bbMax.y();
+    m_bb_zmax = bbMax.z();
+    updateBoundingBox();
+
+    m_cellsX = n[0];
+    m_cellsY = n[1];
+    m_cellsZ = n[2];
+    m_dataCount = cropped.size();
+    VOL_data = std::move(cropped);
+    computeStatistics();
+    return true;
+}
+
+void Volumedatabase::updateBoundingBox()
+{
+    std:: cout << "BOUNDING BOX: " << m_bb_xmin << " " << m_bb_ymin << " " << m_bb_zmin << " " << m_bb_xmax << " " << m_bb_ymax<< " " << m_bb_zmax << std::endl;
+    m_bbox = BoundingBox3f(Point3f(m_bb_xmin, m_bb_ymin, m_bb_zmin), Point3f(m_bb_xmax, m_bb_ymax, m_bb_zmax));
+}
+
+void Volumedatabase::computeStatistics()
+{
+    m_mean = 0.f;
+    m_max = -std::numeric_limits<float>::infinity();
+    m_min = std::numeric_limits<float>::infinity();
+    m_empty_border = true;
+    forEachBlock([&](int x0, int y0, int z0, int nx, int ny, int nz, int sx, int sy, const float* data) {
+        for(int z = 0; z < nz; z++)
+        for(int y = 0; y < ny; y++)
+        {
+            const float* row = data + (((size_t)z*sy + y)*sx)*m_numChannels;
+            for(int i = 0; i < nx * m_numChannels; i++)
+            {
+                float val = row[i];
+                m_mean += (double)val;
+                m_max = std::max(m_max, val);
+                m_min = std::min(m_min, val);
+            }
+
+            // Whole rows lie on the y and z faces, only their ends on the x ones
+            auto nonZero = [](const float* begin, const float* end) { return std::any_of(begin, end, [](float v) { return v != 0.f; }); };
+            if(y0 + y == 0 || y0 + y == m_cellsY - 1 || z0 + z == 0 || z0 + z == m_cellsZ - 1)
+            {
+                if(nonZero(row, row + nx * m_numChannels))
+                    m_empty_border = false;
+            }
+            else
+            {
+                if(x0 == 0 && nonZero(row, row + m_numChannels))
+                    m_empty_border = false;
+                if(x0 + nx == m_cellsX && nonZero(row + (nx - 1) * m_numChannels, row + nx * m_numChannels))
+                    m_empty_border = false;
+            }
+        }
+    });
+
     m_mean /= (double)m_dataCount;
 
     std::cout << "Loaded grid volume data with dimensions: (" << m_cellsX << ", " 
-    << m_cellsY << ", " << m_cellsZ << ") , mean " << m_mean << " and max " << m_max << std::endl;
-    VOL_stream.close();
+    << m_cellsY << ", " << m_cellsZ << ") , mean " << m_mean << ", min " << m_min << " and max " << m_max << std::endl;
+
+    buildMipPyramid();
 }
 
-Color3f Volumedatabase::sample_density(const Point3f& pos_world)
+void Volumedatabase::buildMipPyramid()
 {
+    // Halve the resolution until the whole grid fits in a single voxel
+    int levels = 1;
+    for(int x = m_cellsX, y = m_cellsY, z = m_cellsZ; x > 1 || y > 1 || z > 1; levels++)
+    {
+        x = (x + 1) / 2;
+        y = (y + 1) / 2;
+        z = (z + 1) / 2;
+    }
+    // Levels are resized in place, so reloading a grid of the same size does not reallocate
+    m_mips.resize(levels);
+
+    m_mips[0].cellsX = m_cellsX;
+    m_mips[0].cellsY = m_cellsY;
+    m_mips[0].cellsZ = m_cellsZ;
+    m_mips[0].min = m_min;
+    m_mips[0].max_avg = m_max;
+
+    for(int lod = 1; lod < levels; lod++)
+    {
+        const MipLevel& fine = m_mips[lod - 1];
+        MipLevel& coarse = m_mips[lod];
+        coarse.cellsX = (fine.cellsX + 1) / 2;
+        coarse.cellsY = (fine.cellsY + 1) / 2;
+        coarse.cellsZ = (fine.cellsZ + 1) / 2;
+        size_t count = (size_t)coarse.cellsX * coarse.cellsY * coarse.cellsZ * m_numChannels;
+        coarse.avg.assign(count, 0.f);
+        coarse.max.assign(count, -std::numeric_limits<float>::infinity());
+        coarse.min = std::numeric_limits<float>::infinity();
+        coarse.max_avg = -std::numeric_limits<float>::infinity();
+
+        // Every fine voxel is accumulated into its parent, so that level 0 can be streamed brick by brick
+        auto scatter = [&](int x0, int y0, int z0, int nx, int ny, int nz, int sx, int sy, const float* fineAvg, const float* fineMax) {
+            for(int z = 0; z < nz; z++)
+            for(int y = 0; y < ny; y++)
+            for(int x = 0; x < nx; x++)
+            for(int c = 0; c < m_numChannels; c++)
+            {
+                size_t fidx = (((size_t)z*sy + y)*sx + x)*m_numChannels + c;
+                size_t idx = ((((size_t)(z0 + z)/2)*coarse.cellsY + (y0 + y)/2)*coarse.cellsX + (x0 + x)/2)*m_numChannels + c;
+                coarse.avg[idx] += fineAvg[fidx];
+                coarse.max[idx] = std::max(coarse.max[idx], fineMax[fidx]);
+            }
+        };
+        if(lod == 1)
+            forEachBlock([&](int x0, int y0, int z0, int nx, int ny, int nz, int sx, int sy, const float* data) {
+                scatter(x0, y0, z0, nx, ny, nz, sx, sy, data, data);
+            });
+        else
+            scatter(0, 0, 0, fine.cellsX, fine.cellsY, fine.cellsZ, fine.cellsX, fine.cellsY, fine.avg.data(), fine.max.data());
+
+        for(int z = 0; z < coarse.cellsZ; z++)
+        for(int y = 0; y < coarse.cellsY; y++)
+        for(int x = 0; x < coarse.cellsX; x++)
+        {
+            // Children in the finer level (odd sizes leave the last voxel with less children)
+            int n = (std::min(2*x + 2, fine.cellsX) - 2*x) * (std::min(2*y + 2, fine.cellsY) - 2*y) * (std::min(2*z + 2, fine.cellsZ) - 2*z);
+            for(int c = 0; c < m_numChannels; c++)
+            {
+                size_t idx = (((size_t)z*coarse.cellsY + y)*coarse.cellsX + x)*m_numChannels + c;
+                coarse.avg[idx] /= (float)n;
+                coarse.min = std::min(coarse.min, coarse.avg[idx]);
+                coarse.max_avg = std::max(coarse.max_avg, coarse.avg[idx]);
+            }
+        }
+    }
+
+    std::cout << "Built density mip pyramid with " << m_mips.size() << " levels" << std::endl;
+}
+
+void Volumedatabase::voxelCoords(const Point3f& pos_world, int lod, int& idx_x, int& idx_y, int& idx_z) const
+{
+    const MipLevel& level = m_mips[lod];
     Point3f pos_local = Point3f((float)clamp(pos_world.x(), std::min(m_bb_xmin, m_bb_xmax), std::max(m_bb_xmin, m_bb_xmax))
                             , (float)clamp(pos_world.y(), std::min(m_bb_ymin, m_bb_ymax), std::max(m_bb_ymin, m_bb_ymax))
                             , (float)clamp(pos_world.z(), std::min(m_bb_zmin, m_bb_zmax), std::max(m_bb_zmin, m_bb_zmax)));
-    // std::cout << "................................................" << std::endl;
     // std::cout << "POINT: " << pos_local.toString() << "\nMIN: " << m_bbox.min.toString() << "\nMAX: " << m_bbox.max.toString() << std::endl;
     // We use (for now) the convention that min = 0,0,0 and max = m_cells{X,Y,Z}
     float t_x = abs(pos_local.x() - m_bb_xmin) / abs(m_bb_xmax - m_bb_xmin);
     float t_y = abs(pos_local.y() - m_bb_ymin) / abs(m_bb_ymax - m_bb_ymin);
     float t_z = abs(pos_local.z() - m_bb_zmin) / abs(m_bb_zmax - m_bb_zmin);
-    // std::cout << "T_X: " << t_x << " T_Y: " << t_y << " T_Z: " << t_z << std::endl;
-    int idx_x = (int)floor(lerp(t_x, 0, m_cellsX));
-    int idx_y = (int)floor(lerp(t_y, 0, m_cellsY));
-    int idx_z = (int)floor(lerp(t_z, 0, m_cellsZ));
-    // std::cout << "X: " << idx_x << " Y: " << idx_y << " Z: " << idx_z << std::endl;
-    // std::cout << "CELLS_X: " << m_cellsX << " CELLS_Y: " << m_cellsY << " CELLS_Z: " << m_cellsZ << std::endl;
-    // std::cout << "................................................" << std::endl;
+    // The max face of the bounding box belongs to the last voxel
+    idx_x = clamp((int)floor(lerp(t_x, 0, level.cellsX)), 0, level.cellsX - 1);
+    idx_y = clamp((int)floor(lerp(t_y, 0, level.cellsY)), 0, level.cellsY - 1);
+    idx_z = clamp((int)floor(lerp(t_z, 0, level.cellsZ)), 0, level.cellsZ - 1);
+}
+
+Color3f Volumedatabase::sample_density(const Point3f& pos_world, int lod)
+{
+    lod = clampLOD(lod);
+    int idx_x, idx_y, idx_z;
+    voxelCoords(pos_world, lod, idx_x, idx_y, idx_z);
+    const float* data;
+    if(lod == 0)
+        data = level0Voxel(idx_x, idx_y, idx_z);
+    else
+    {
+        const MipLevel& level = m_mips[lod];
+        data = &level.avg[(((size_t)idx_z*level.cellsY + idx_y)*level.cellsX + idx_x)*m_numChannels];
+    }
     // Finally, access the data structure
     if(m_numChannels == 3)
     {
         /// TODO: Trilinear interpolation!!!!
-
-        float mu_t_r = VOL_data[((idx_z*m_cellsY + idx_y)*m_cellsX + idx_x)*m_numChannels + 0];
-        float mu_t_g = VOL_data[((idx_z*m_cellsY + idx_y)*m_cellsX + idx_x)*m_numChannels + 1];
-        float mu_t_b = VOL_data[((idx_z*m_cellsY + idx_y)*m_cellsX + idx_x)*m_numChannels + 2];
-        return Color3f(mu_t_r, mu_t_g, mu_t_b);
+        return Color3f(data[0], data[1], data[2]);
     }
     // Otherwise we will assume only 1 channel
-    if(idx_z > m_cellsZ || idx_x > m_cellsX || idx_y > m_cellsY)
+    return Color3f(data[0]);
+}
+
+Color3f Volumedatabase::sample_majorant(const Point3f& pos_world, int lod)
+{
+    lod = clampLOD(lod);
+    int idx_x, idx_y, idx_z;
+    voxelCoords(pos_world, lod, idx_x, idx_y, idx_z);
+    const float* data;
+    if(lod == 0)
+        data = level0Voxel(idx_x, idx_y, idx_z);
+    else
+    {
+        const MipLevel& level = m_mips[lod];
+        data = &level.max[(((size_t)idx_z*level.cellsY + idx_y)*level.cellsX + idx_x)*m_numChannels];
+    }
+    if(m_numChannels == 3)
+    {
+        return Color3f(data[0], data[1], data[2]);
+    }
+    return Color3f(data[0]);
+}
+
+float Volumedatabase::maxDensityIn(const BoundingBox3f& box) const
+{
+    // Pulled slightly inwards, so that a box matching a voxel does not reach its neighbours
+    Vector3f margin = box.getExtents() * 1e-3f;
+    int lo[3], hi[3];
+    voxelCoords(box.min + margin, 0, lo[0], lo[1], lo[2]);
+    voxelCoords(box.max - margin, 0, hi[0], hi[1], hi[2]);
+    float result = 0.f;
+    for(int z = std::min(lo[2], hi[2]); z <= std::max(lo[2], hi[2]); z++)
+    for(int y = std::min(lo[1], hi[1]); y <= std::max(lo[1], hi[1]); y++)
+    for(int x = std::min(lo[0], hi[0]); x <= std::max(lo[0], hi[0]); x++)
     {
-        return Color3f(m_mean);
+        const float* voxel = level0Voxel(x, y, z);
+        float density = 0.f;
+        for(int c = 0; c < m_numChannels; c++)
+            density += voxel[c];
+        result = std::max(result, density / m_numChannels);
     }
+    return result;
+}
 
-    float mu_t = VOL_data[((idx_z*m_cellsY + idx_y)*m_cellsX + idx_x)*m_numChannels + 0];
-    //std::cout << "mu_t: " << mu_t << std::endl;
-    return Color3f(mu_t);
+bool Volumedatabase::buildSamplingCDF(SamplingCDF& cdf, const Volumedatabase* weight) const
+{
+    // Bricks of the brick file when out of core, or of the same size over VOL_data otherwise
+    int bs = m_storage.brick_size;
+    cdf.bricks[0] = (m_cellsX + bs - 1) / bs;
+    cdf.bricks[1] = (m_cellsY + bs - 1) / bs;
+    cdf.bricks[2] = (m_cellsZ + bs - 1) / bs;
+    size_t brickCount = (size_t)cdf.bricks[0] * cdf.bricks[1] * cdf.bricks[2];
+    size_t brickVoxels = (size_t)bs * bs * bs;
+
+    // Voxel weights, allocated only for bricks that have any
+    std::vector<std::vector<float>> weights(brickCount);
+    forEachBlock([&](int x0, int y0, int z0, int nx, int ny, int nz, int sx, int sy, const float* data) {
+        for(int z = 0; z < nz; z++)
+        for(int y = 0; y < ny; y++)
+        for(int x = 0; x < nx; x++)
+        {
+            const float* voxel = data + (((size_t)z*sy + y)*sx + x)*m_numChannels;
+            float w = 0.f;
+            for(int c = 0; c < m_numChannels; c++)
+                w += std::max(0.f, voxel[c]);
+            if(w <= 0.f)
+                continue;
+            int gx = x0 + x, gy = y0 + y, gz = z0 + z;
+            if(weight)
+            {
+                // The max keeps the pdf positive wherever the (piecewise constant) product is, whatever the resolutions
+                Point3f a(m_bb_xmin + gx * (m_bb_xmax - m_bb_xmin) / m_cellsX, m_bb_ymin + gy * (m_bb_ymax - m_bb_ymin) / m_cellsY, m_bb_zmin + gz * (m_bb_zmax - m_bb_zmin) / m_cellsZ);
+                Point3f b(m_bb_xmin + (gx + 1) * (m_bb_xmax - m_bb_xmin) / m_cellsX, m_bb_ymin + (gy + 1) * (m_bb_ymax - m_bb_ymin) / m_cellsY, m_bb_zmin + (gz + 1) * (m_bb_zmax - m_bb_zmin) / m_cellsZ);
+                w *= weight->maxDensityIn(BoundingBox3f(a.cwiseMin(b), a.cwiseMax(b)));
+                if(w <= 0.f)
+                    continue;
+            }
+            std::vector<float>& brick = weights[((size_t)(gz / bs)*cdf.bricks[1] + gy / bs)*cdf.bricks[0] + gx / bs];
+            if(brick.empty())
+                brick.assign(brickVoxels, 0.f);
+            brick[((size_t)(gz % bs)*bs + gy % bs)*bs + gx % bs] = w / m_numChannels;
+        }
+    });
+
+    cdf.brickCDF.clear();
+    cdf.brickCDF.reserve(brickCount);
+    cdf.voxelCDFs.assign(brickCount, DiscretePDF());
+    for(size_t b = 0; b < brickCount; b++)
+    {
+        if(weights[b].empty())
+        {
+            cdf.brickCDF.append(0.f);
+            continue;
+        }
+        DiscretePDF& voxels = cdf.voxelCDFs[b];
+        voxels.reserve(brickVoxels);
+        for(float w : weights[b])
+            voxels.append(w);
+        cdf.brickCDF.append(voxels.normalize());
+        std::vector<float>().swap(weights[b]);
+    }
+    return cdf.brickCDF.normalize() > 0.f;
 }
 
+Point3f Volumedatabase::sampleVoxel(const SamplingCDF& cdf, Sampler* sampler, float& pdf) const
+{
+    float pdfBrick, pdfVoxel;
+    size_t brick = cdf.brickCDF.sample(sampler->next1D(), pdfBrick);
+    if(cdf.voxelCDFs[brick].size() == 0)
+    {
+        pdf = 0.f;
+        return m_bbox.getCenter();
+    }
+    size_t voxel = cdf.voxelCDFs[brick].sample(sampler->next1D(), pdfVoxel);
+
+    int bs = m_storage.brick_size;
+    int bx = (int)(brick % cdf.bricks[0]), by = (int)((brick / cdf.bricks[0]) % cdf.bricks[1]), bz = (int)(brick / ((size_t)cdf.bricks[0] * cdf.bricks[1]));
+    int x = bx*bs + (int)(voxel % bs), y = by*bs + (int)((voxel / bs) % bs), z = bz*bs + (int)(voxel / ((size_t)bs * bs));
+
+    // Uniformly inside the voxel (the mapping of voxelCoords())
+    Point2f s2 = sampler->next2D();
+    Point3f t((x + s2.x()) / m_cellsX, (y + s2.y()) / m_cellsY, (z + sampler->next1D()) / m_cellsZ);
+    Vector3f extents = m_bbox.getExtents();
+    float voxelVolume = extents.x() * extents.y() * extents.z() / ((float)m_cellsX * m_cellsY * m_cellsZ);
+    pdf = pdfBrick * pdfVoxel / voxelVolume;
+    return Point3f(m_bb_xmin + t.x() * (m_bb_xmax - m_bb_xmin), m_bb_ymin + t.y() * (m_bb_ymax - m_bb_ymin), m_bb_zmin + t.z() * (m_bb_zmax - m_bb_zmin));
+}
 
 // Unlike PBBook, I think I don't need to calculate tMin and tMax
 // and my intersections will be from 0 to its.p? (i think)
-Point3f Volumedatabase::samplePathStep(const Ray3f& ray, const Intersection& its, Sampler* sampler, const Color3f& mu_s, const Color3f& mu_t, Color3f& _beta, bool& sampledMedium)
+//
+// Decomposition tracking (Kutz et al. 2017): the density is split into a homogeneous
+// control component (control <= min density) and a residual one. The control component
+// is sampled analytically, just like a homogeneous medium, and only the residual is
+// delta tracked against (max - control). Both components are real collisions,
+// so whichever happens first is the sampled interaction.
+//
+// Coarser levels of detail are tracked against their own (lower) majorant
+Point3f Volumedatabase::samplePathStep(const Ray3f& ray, const Intersection& its, Sampler* sampler, const Color3f& mu_s, const Color3f& mu_t, const float& control, Color3f& _beta, bool& sampledMedium, int lod)
 {
+    lod = clampLOD(lod);
     float tMax = its.t;
+    float scale = mu_t.sum() / 3.f;
+
+    // Analytic sample of the homogeneous control medium
+    float tControl = std::numeric_limits<float>::infinity();
+    if(control > 0.f)
+        tControl = -std::log(1.0f - sampler->next1D()) / (control * scale);
+
+    // Residual medium, delta tracked until it collides or we reach the control collision
     float t = 0.f;
-    while (true) {
-        t -= std::log(1.0f - sampler->next1D()) / m_max / (mu_t.sum() / 3.f);
+    float tLimit = std::min(tMax, tControl);
+    if(!clipToBounds(ray, t, tLimit, control))
+    {
+        sampledMedium = false;
+        _beta = Color3f(1.f);
+        return ray(tMax);
+    }
+    float residualMax = m_mips[lod].max_avg - control;
+    while (residualMax > 0.f) {
+        t -= std::log(1.0f - sampler->next1D()) / (residualMax * scale);
         //std::cout << "t_ratio: " << t << " " << tMax << std::endl;
-        if(t >= tMax)
-        {
-            sampledMedium = false;
-            _beta = Color3f(1.f);
-            return ray(tMax);
-        }
+        if(t >= tLimit)
+            break;
 
-        float density = sample_density(ray(t)).sum() / 3.f;         /// TODO: We assume only 1 channel for now, change it later(?)
+        float density = sample_density(ray(t), lod).sum() / 3.f;         /// TODO: We assume only 1 channel for now, change it later(?)
         
-        // Check if we sample an interaction with the medium
-        if(density / m_max > sampler->next1D())
+        // Check if we sample an interaction with the (residual) medium
+        if((density - control) / residualMax > sampler->next1D())
         {
             sampledMedium = true;
             _beta = Color3f(mu_s / mu_t);
             return ray(t);
         }
     }
-    return ray(0.f);
+
+    // The control medium collided before the residual one and before the surface
+    if(tControl < tMax)
+    {
+        sampledMedium = true;
+        _beta = Color3f(mu_s / mu_t);
+        return ray(tControl);
+    }
+
+    sampledMedium = false;
+    _beta = Color3f(1.f);
+    return ray(tMax);
+}
+
+bool Volumedatabase::clipToBounds(const Ray3f& ray, float& tMin, float& tMax, float control) const
+{
+    if(!m_empty_border || control > 0.f)
+        return true;
+    float nearT, farT;
+    if(!m_bbox.rayIntersect(ray, nearT, farT))
+        return false;
+    tMin = std::max(tMin, nearT);
+    tMax = std::min(tMax, farT);
+    return tMin < tMax;
+}
+
+Color3f Volumedatabase::ratioTracking(Sampler* sampler, const Point3f& x0, const Point3f& xz, const float& mu_t, const float& control, int lod)
+{
+    return ratioTracking(sampler, Ray3f(x0, (xz - x0).normalized()), Vector3f(xz - x0).norm(), mu_t, control, lod);
 }
 
-Color3f Volumedatabase::ratioTracking(Sampler* sampler, const Point3f& x0, const Point3f& xz, const float& mu_t)
+Color3f Volumedatabase::ratioTracking(Sampler* sampler, const Ray3f& ray, float tMax, const float& mu_t, const float& control, int lod)
 {
-    float tMax = Vector3f(xz - x0).norm();
-    Vector3f dir = (xz - x0).normalized();
+    lod = clampLOD(lod);
 
-    float tr = 1.f;
+    // The control component is homogeneous, so its transmittance is analytic
+    float tr = std::exp(-control * mu_t * tMax);
+    float residualMax = m_mips[lod].max_avg - control;
     float t = 0.f;
+    if(!clipToBounds(ray, t, tMax, control))
+        return Color3f(tr, tr, tr);
 
-    while (true) {
-        t -= std::log(1.0f - sampler->next1D()) / m_max / mu_t;
+    while (residualMax > 0.f) {
+        t -= std::log(1.0f - sampler->next1D()) / residualMax / mu_t;
         //std::cout << "t_ratio: " << t << " " << tMax << std::endl;
         if(t >= tMax)
-            return Color3f(tr, tr, tr);
-        // std::cout << "~~~~~~~~~~~~~~~~~~~~~~~~~~~~~" << std::endl;
-        // std::cout << "DIR: " << dir.toString() << std::endl;
-        // std::cout << "T: " << t << std::endl;
-        // std::cout << "TMAX: " << tMax << std::endl;
-        // std::cout << "XZ: " << xz.toString() << std::endl;
-        // std::cout << "~~~~~~~~~~~~~~~~~~~~~~~~~~~~~" << std::endl;
-        float density = sample_density(x0 + t*dir).sum() / 3.f;         /// TODO: We assume only 1 color for now, change it later(?)
-        tr *= (1 - std::max((float)0, density / m_max));
+            break;
+        float density = sample_density(ray(t), lod).sum() / 3.f;         /// TODO: We assume only 1 color for now, change it later(?)
+        tr *= (1 - std::max((float)0, (density - control) / residualMax));
     }
     return Color3f(tr, tr, tr);
 }
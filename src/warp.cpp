@@ -247,7 +247,7 @@ Vector3f Warp::squareToRayleigh(const Point2f& sample)
 /// Añadido
 float Warp::squareToRayleighPdf(const Vector3f& v)
 {
-    return 1.0f / (2.0f * M_PI);
+    return INV_FOURPI;
 }
 
 